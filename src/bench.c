@@ -0,0 +1,506 @@
+#include "protracker.h"
+#include "player61a.h"
+#include "replay.h"
+#include "buffer.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+
+ modpack_bench - throughput benchmark on synthetic ProTracker modules
+
+ Every configuration generates a deterministic module and measures loading, each optimize pass,
+ MOD export, P61A export/import and a full replay. Results are written as JSON lines (one per
+ configuration and operation) to the output file.
+
+*/
+
+#if defined(BENCH_COUNT_ALLOCATIONS)
+
+// heap allocations of the benchmarked code, the build wraps malloc/calloc/realloc (-Wl,--wrap)
+
+static size_t heap_allocations = 0;
+static size_t heap_allocated = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* data, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    ++heap_allocations;
+    heap_allocated += size;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+    ++heap_allocations;
+    heap_allocated += count * size;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* data, size_t size)
+{
+    ++heap_allocations;
+    heap_allocated += size;
+    return __real_realloc(data, size);
+}
+
+#endif
+
+typedef struct
+{
+    const char* name;
+    size_t patterns;            // number of patterns (1-128)
+    double effect_density;      // probability of a channel carrying an effect (0-1)
+    double note_density;        // probability of a channel carrying a note (0-1)
+    double track_repetition;    // probability of a channel track being a copy of an earlier one (0-1)
+    size_t sample_bytes;        // maximum sample size in bytes
+    uint32_t seed;
+} bench_config_t;
+
+typedef struct
+{
+    const char* name;
+    size_t iterations;
+    double seconds;
+    size_t allocations;
+    size_t allocated;
+} bench_result_t;
+
+static const bench_config_t presets[] = {
+    { "small",   8,   0.2, 0.3, 0.2,  4096,   1 },
+    { "medium",  32,  0.4, 0.4, 0.4,  16384,  2 },
+    { "large",   100, 0.5, 0.5, 0.5,  65534,  3 },
+    { "dense",   64,  0.9, 0.9, 0.1,  8192,   4 },
+};
+
+static const uint16_t periods[] = {
+    856,808,762,720,678,640,604,570,538,508,480,453,
+    428,404,381,360,339,320,302,285,269,254,240,226,
+    214,202,190,180,170,160,151,143,135,127,120,113
+};
+
+static uint32_t random_state;
+
+static uint32_t next_random(void)
+{
+    // xorshift32
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return random_state = x;
+}
+
+static uint32_t random_range(uint32_t range)
+{
+    return range ? next_random() % range : 0;
+}
+
+static bool random_chance(double probability)
+{
+    return (next_random() & 0xffffff) < (uint32_t)(probability * 0x1000000);
+}
+
+static void generate_effect(protracker_effect_t* effect)
+{
+    static const uint8_t commands[] = { 0, 1, 2, 3, 4, 5, 6, 7, 9, 10, 11, 12, 13, 14, 15 };
+    static const uint8_t extended[] = { 0x0, 0x1, 0x2, 0x5, 0x6, 0x9, 0xa, 0xb, 0xc, 0xd, 0xe };
+
+    effect->cmd = commands[random_range(sizeof(commands))];
+    effect->data.value = (uint8_t)random_range(256);
+
+    switch (effect->cmd)
+    {
+        case PT_CMD_POS_JUMP:
+        case PT_CMD_PATTERN_BREAK:
+            // keep flow changes rare, they end patterns early
+            if (random_chance(0.8))
+            {
+                effect->cmd = PT_CMD_SET_VOLUME;
+            }
+            effect->data.value &= 0x3f;
+            break;
+
+        case PT_CMD_SET_VOLUME:
+            effect->data.value &= 0x3f;
+            break;
+
+        case PT_CMD_EXTENDED:
+            effect->data.ext.cmd = extended[random_range(sizeof(extended))];
+            break;
+
+        case PT_CMD_SET_SPEED:
+            effect->data.value = (uint8_t)(1 + random_range(31));
+            break;
+    }
+}
+
+/**
+ *
+ * Generate a deterministic module for a configuration
+ *
+**/
+static void generate_module(protracker_t* module, const bench_config_t* config)
+{
+    protracker_create(module);
+    random_state = config->seed * 2654435761u + 1;
+
+    snprintf(module->header.name, sizeof(module->header.name), "bench %s", config->name);
+
+    size_t num_samples = 1 + random_range(PT_NUM_SAMPLES);
+    for (size_t i = 0; i < num_samples; ++i)
+    {
+        protracker_sample_t* sample = &(module->sample_headers[i]);
+
+        if (i > 0 && random_chance(0.1))
+        {
+            // duplicate for 'identical_samples'
+            size_t source = random_range(i);
+            size_t bytes = module->sample_headers[source].length * 2;
+
+            *sample = module->sample_headers[source];
+            module->sample_data[i] = malloc(bytes);
+            memcpy(module->sample_data[i], module->sample_data[source], bytes);
+            continue;
+        }
+
+        size_t words = 1 + random_range(config->sample_bytes / 2);
+        sample->length = (uint16_t)words;
+        sample->volume = (uint8_t)random_range(65);
+        sample->finetone = random_chance(0.1) ? (uint8_t)random_range(16) : 0;
+
+        if (random_chance(0.3) && words > 2)
+        {
+            sample->repeat_offset = (uint16_t)random_range(words / 2);
+            sample->repeat_length = (uint16_t)(words - sample->repeat_offset);
+        }
+        else
+        {
+            sample->repeat_offset = 0;
+            sample->repeat_length = 1;
+        }
+
+        uint8_t* data = module->sample_data[i] = malloc(words * 2);
+        size_t audible = words * 2 - random_range(words);   // trailing silence for 'trim'
+        for (size_t j = 0; j < words * 2; ++j)
+        {
+            data[j] = j < audible ? (uint8_t)next_random() : 0;
+        }
+    }
+
+    module->num_patterns = config->patterns;
+    module->patterns = malloc(module->num_patterns * sizeof(protracker_pattern_t));
+    memset(module->patterns, 0, module->num_patterns * sizeof(protracker_pattern_t));
+
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        protracker_pattern_t* pattern = &(module->patterns[i]);
+
+        for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+        {
+            if (i > 0 && random_chance(config->track_repetition))
+            {
+                // copy a track from any earlier pattern and channel
+                const protracker_pattern_t* source = &(module->patterns[random_range(i)]);
+                size_t channel = random_range(PT_NUM_CHANNELS);
+
+                for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+                {
+                    pattern->rows[j].channels[k] = source->rows[j].channels[channel];
+                }
+                continue;
+            }
+
+            for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+            {
+                protracker_channel_t* channel = &(pattern->rows[j].channels[k]);
+
+                if (random_chance(config->note_density))
+                {
+                    protracker_set_period(channel, periods[random_range(sizeof(periods) / sizeof(periods[0]))]);
+                    protracker_set_sample(channel, (uint8_t)(1 + random_range(num_samples)));
+                }
+
+                if (random_chance(config->effect_density))
+                {
+                    protracker_effect_t effect;
+                    generate_effect(&effect);
+                    protracker_set_effect(channel, &effect);
+                }
+            }
+        }
+    }
+
+    // play every pattern once, then a few repeats; leave one pattern in the middle unused
+    // (the loader derives the pattern count from the highest position, so it cannot be the last)
+    size_t unused = module->num_patterns > 2 ? module->num_patterns / 2 : module->num_patterns;
+    size_t length = 0;
+    for (size_t i = 0; i < module->num_patterns && length < PT_NUM_POSITIONS; ++i)
+    {
+        if (i != unused)
+        {
+            module->song.positions[length++] = (uint8_t)i;
+        }
+    }
+    while (length < PT_NUM_POSITIONS && length < module->num_patterns + 16)
+    {
+        size_t pattern = random_range(module->num_patterns);
+        module->song.positions[length++] = (uint8_t)(pattern == unused ? 0 : pattern);
+    }
+    module->song.length = (uint8_t)length;
+    module->song.restart_position = 127;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef enum
+{
+    OP_LOAD_MOD,
+    OP_UNUSED_PATTERNS,
+    OP_IDENTICAL_PATTERNS,
+    OP_UNREACHABLE_ROWS,
+    OP_TRIM,
+    OP_UNUSED_SAMPLES,
+    OP_IDENTICAL_SAMPLES,
+    OP_COMPACT_SAMPLES,
+    OP_CLEAN,
+    OP_EXPORT_MOD,
+    OP_EXPORT_P61A,
+    OP_LOAD_P61A,
+    OP_REPLAY,
+
+    OP_COUNT
+} bench_op_t;
+
+static const char* op_names[OP_COUNT] = {
+    "load:mod",
+    "optimize:unused_patterns",
+    "optimize:identical_patterns",
+    "optimize:unreachable_rows",
+    "optimize:trim",
+    "optimize:unused_samples",
+    "optimize:identical_samples",
+    "optimize:compact_samples",
+    "optimize:clean",
+    "convert:mod",
+    "convert:p61a",
+    "load:p61a",
+    "analyze:replay",
+};
+
+/**
+ *
+ * Run one operation. Optimize passes work on a fresh copy of the module each iteration; the time
+ * for loading that copy is not included.
+ *
+**/
+static double run_op(bench_result_t* result, bench_op_t op, const buffer_t* mod_data, const buffer_t* p61a_data)
+{
+    protracker_t* module = NULL;
+    double start = 0, end = 0;
+
+    if (op != OP_LOAD_MOD && op != OP_LOAD_P61A)
+    {
+        module = protracker_load(mod_data);
+    }
+
+    buffer_t output;
+    buffer_init(&output, 1);
+
+#if defined(BENCH_COUNT_ALLOCATIONS)
+    size_t allocations = heap_allocations;
+    size_t allocated = heap_allocated;
+#endif
+
+    start = now();
+    switch (op)
+    {
+        case OP_LOAD_MOD:           module = protracker_load(mod_data); break;
+        case OP_UNUSED_PATTERNS:    protracker_remove_unused_patterns(module); break;
+        case OP_IDENTICAL_PATTERNS: protracker_remove_identical_patterns(module); break;
+        case OP_UNREACHABLE_ROWS:   protracker_remove_unreachable_rows(module); break;
+        case OP_TRIM:               protracker_trim_samples(module); break;
+        case OP_UNUSED_SAMPLES:     protracker_remove_unused_samples(module); break;
+        case OP_IDENTICAL_SAMPLES:  protracker_remove_identical_samples(module); break;
+        case OP_COMPACT_SAMPLES:    protracker_compact_sample_indexes(module); break;
+        case OP_CLEAN:              protracker_clean_effects(module, "clean"); break;
+        case OP_EXPORT_MOD:         protracker_convert(&output, module, ""); break;
+        case OP_EXPORT_P61A:        player61a_convert(&output, module, ""); break;
+        case OP_LOAD_P61A:          module = player61a_load(p61a_data); protracker_materialize(module); break;
+        case OP_REPLAY:             replay_duration(module); break;
+        default: break;
+    }
+    end = now();
+
+#if defined(BENCH_COUNT_ALLOCATIONS)
+    result->allocations += heap_allocations - allocations;
+    result->allocated += heap_allocated - allocated;
+#else
+    (void)result;
+#endif
+
+    buffer_release(&output);
+    if (module)
+    {
+        protracker_free(module);
+    }
+
+    return end - start;
+}
+
+static void measure(bench_result_t* result, bench_op_t op, const buffer_t* mod_data, const buffer_t* p61a_data, double min_time, size_t min_iterations)
+{
+    memset(result, 0, sizeof(bench_result_t));
+    result->name = op_names[op];
+
+    while (result->iterations < min_iterations || result->seconds < min_time)
+    {
+        result->seconds += run_op(result, op, mod_data, p61a_data);
+        ++result->iterations;
+    }
+}
+
+static void show_usage(void)
+{
+    fprintf(stderr,
+        "modpack_bench - benchmark modpack on synthetic modules\n\n"
+        "  -o FILE          Write results to FILE (JSON lines, default: bench_output.txt)\n"
+        "  -t SECONDS       Minimum time per operation (default: 0.2)\n"
+        "  -n N             Minimum iterations per operation (default: 10)\n"
+        "  -config NAME     Only run preset NAME (small, medium, large, dense)\n\n"
+        "  Custom configuration (replaces presets):\n"
+        "  -patterns N      Number of patterns (1-128)\n"
+        "  -effects F       Effect density (0-1)\n"
+        "  -notes F         Note density (0-1)\n"
+        "  -repeat F        Track repetition (0-1)\n"
+        "  -samples N       Maximum sample size in bytes\n"
+        "  -seed N          Random seed\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* filename = "bench_output.txt";
+    const char* only = NULL;
+    double min_time = 0.2;
+    size_t min_iterations = 10;
+
+    bench_config_t custom = { "custom", 32, 0.4, 0.4, 0.4, 16384, 1 };
+    bool use_custom = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* opt = i < (argc-1) ? argv[i+1] : NULL;
+
+        if (!strcmp("-h", arg) || !strcmp("--help", arg) || !opt)
+        {
+            show_usage();
+            return strcmp("-h", arg) && strcmp("--help", arg) ? 1 : 0;
+        }
+
+        if (!strcmp("-o", arg))                 filename = opt;
+        else if (!strcmp("-t", arg))            min_time = strtod(opt, NULL);
+        else if (!strcmp("-n", arg))            min_iterations = strtoul(opt, NULL, 10);
+        else if (!strcmp("-config", arg))       only = opt;
+        else if (!strcmp("-patterns", arg))     { custom.patterns = strtoul(opt, NULL, 10); use_custom = true; }
+        else if (!strcmp("-effects", arg))      { custom.effect_density = strtod(opt, NULL); use_custom = true; }
+        else if (!strcmp("-notes", arg))        { custom.note_density = strtod(opt, NULL); use_custom = true; }
+        else if (!strcmp("-repeat", arg))       { custom.track_repetition = strtod(opt, NULL); use_custom = true; }
+        else if (!strcmp("-samples", arg))      { custom.sample_bytes = strtoul(opt, NULL, 10); use_custom = true; }
+        else if (!strcmp("-seed", arg))         { custom.seed = strtoul(opt, NULL, 10); use_custom = true; }
+        else
+        {
+            show_usage();
+            return 1;
+        }
+
+        ++i;
+    }
+
+    if (custom.patterns < 1 || custom.patterns > 128 || custom.sample_bytes < 2 || custom.sample_bytes > 131070)
+    {
+        fprintf(stderr, "Invalid configuration (patterns: 1-128, samples: 2-131070 bytes).\n");
+        return 1;
+    }
+
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open '%s' for writing.\n", filename);
+        return 1;
+    }
+
+    set_log_level(LOG_LEVEL_NONE);
+
+    const bench_config_t* configs = use_custom ? &custom : presets;
+    size_t num_configs = use_custom ? 1 : sizeof(presets) / sizeof(presets[0]);
+
+    for (size_t i = 0; i < num_configs; ++i)
+    {
+        const bench_config_t* config = &(configs[i]);
+        if (only && strcmp(only, config->name))
+        {
+            continue;
+        }
+
+        protracker_t module;
+        generate_module(&module, config);
+
+        buffer_t mod_data, p61a_data;
+        buffer_init(&mod_data, 1);
+        buffer_init(&p61a_data, 1);
+
+        protracker_convert(&mod_data, &module, "");
+        player61a_convert(&p61a_data, &module, "");
+        protracker_destroy(&module);
+
+        double mod_mb = buffer_count(&mod_data) / (1024.0 * 1024.0);
+
+        printf("%s (%lu patterns, %lu bytes MOD, %lu bytes P61A):\n", config->name, config->patterns, buffer_count(&mod_data), buffer_count(&p61a_data));
+
+        for (size_t op = 0; op < OP_COUNT; ++op)
+        {
+            bench_result_t result;
+            measure(&result, (bench_op_t)op, &mod_data, &p61a_data, min_time, min_iterations);
+
+            double per_second = result.iterations / result.seconds;
+
+            printf(" %-28s %12.1f modules/s %10.2f MB/s", result.name, per_second, per_second * mod_mb);
+
+            fprintf(fp, "{\"config\":\"%s\",\"patterns\":%lu,\"effect_density\":%.2f,\"note_density\":%.2f,\"track_repetition\":%.2f,"
+                "\"sample_bytes\":%lu,\"seed\":%u,\"mod_bytes\":%lu,\"p61a_bytes\":%lu,\"operation\":\"%s\",\"iterations\":%lu,"
+                "\"seconds\":%.6f,\"modules_per_second\":%.1f,\"mb_per_second\":%.3f",
+                config->name, config->patterns, config->effect_density, config->note_density, config->track_repetition,
+                config->sample_bytes, config->seed, buffer_count(&mod_data), buffer_count(&p61a_data), result.name, result.iterations,
+                result.seconds, per_second, per_second * mod_mb);
+
+            // heap allocations are only known where the build can wrap malloc
+#if defined(BENCH_COUNT_ALLOCATIONS)
+            printf(" %8.1f allocs", (double)result.allocations / result.iterations);
+            fprintf(fp, ",\"allocations\":%.1f,\"allocated\":%.1f",
+                (double)result.allocations / result.iterations, (double)result.allocated / result.iterations);
+#endif
+            printf("\n");
+            fprintf(fp, "}\n");
+        }
+
+        buffer_release(&mod_data);
+        buffer_release(&p61a_data);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
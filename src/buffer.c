@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <assert.h>
 
+size_t buffer_allocations = 0;
+size_t buffer_allocated = 0;
+
 void buffer_init(buffer_t* buffer, size_t elemsize)
 {
 	buffer->size = 0;
@@ -33,6 +36,12 @@ void buffer_reset(buffer_t* buffer)
 	buffer->size = 0;
 }
 
+void buffer_truncate(buffer_t* buffer, size_t elements)
+{
+	assert(elements <= (buffer->size / buffer->elemsize));
+	buffer->size = elements * buffer->elemsize;
+}
+
 void* buffer_alloc(buffer_t* buffer, size_t elements)
 {
 	size_t newSize = buffer->size + (elements * buffer->elemsize);
@@ -42,13 +51,17 @@ void* buffer_alloc(buffer_t* buffer, size_t elements)
 		newCapacity = newCapacity < newSize ? newSize : newCapacity;
 
 		uint8_t* newData = malloc(newCapacity);
-		memcpy(newData, buffer->data, buffer->size);
+		if (buffer->data)
+			memcpy(newData, buffer->data, buffer->size);
 
 		if (buffer->data)
 			free(buffer->data);
 
 		buffer->capacity = newCapacity;
 		buffer->data = newData;
+
+		++buffer_allocations;
+		buffer_allocated += newCapacity;
 	}
 
 	uint8_t* data = buffer->data + buffer->size;
@@ -12,10 +12,15 @@ typedef struct buffer_t
 	uint8_t* data;
 } buffer_t;
 
+// Allocation counters over all buffers (for statistics)
+extern size_t buffer_allocations;
+extern size_t buffer_allocated;
+
 void buffer_init(buffer_t* buffer, size_t elemsize);
 void buffer_set(buffer_t* buffer, const uint8_t* data, size_t length);
 void buffer_release(buffer_t* buffer);
 void buffer_reset(buffer_t* buffer);
+void buffer_truncate(buffer_t* buffer, size_t elements);
 
 void* buffer_alloc(buffer_t* buffer, size_t elements);
 void* buffer_add(buffer_t* buffer, const void* data, size_t size);
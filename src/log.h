@@ -7,11 +7,23 @@
 #define LOG_LEVEL_DEBUG (1)
 #define LOG_LEVEL_TRACE (2)
 
+// Most verbose level compiled in, messages above it are removed at compile time
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+
+extern int log_level;
+
 void set_log_level(int level);
 void log_msg(int level, const char* format, ...);
 
-#define LOG_ERROR(...) log_msg(LOG_LEVEL_ERROR, "ERROR: " __VA_ARGS__)
-#define LOG_WARN(...) log_msg(LOG_LEVEL_WARN, "WARN: " __VA_ARGS__)
-#define LOG_INFO(...) log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
-#define LOG_DEBUG(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
-#define LOG_TRACE(...) log_msg(LOG_LEVEL_TRACE, __VA_ARGS__)
+// Checked before any message argument is evaluated
+#define LOG_ENABLED(level) (((level) <= LOG_COMPILE_LEVEL) && ((level) <= log_level))
+
+#define LOG_AT(level, ...) do { if (LOG_ENABLED(level)) log_msg(level, __VA_ARGS__); } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, "ERROR: " __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, "WARN: " __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
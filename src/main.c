@@ -1,7 +1,10 @@
 #include "protracker.h"
 #include "player61a.h"
+#include "replay.h"
+#include "render.h"
 #include "buffer.h"
 #include "options.h"
+#include "stats.h"
 #include "log.h"
 
 static const unsigned char help_text[] = {
@@ -15,15 +18,35 @@ static const unsigned char help_text[] = {
 "  -out:FORMAT NAME     Save module in specified format.\n\n"
 "  Available formats:\n"
 "    mod                Protracker\n"
-"    p61a               The Player 6.1A\n\n"
+"    p61a               The Player 6.1A\n"
+"    p61a-config        Replayer configuration (usecode equates) for all\n"
+"                       modules written to the same NAME (output only)\n"
+"    p61a-pack          P61A songs of all modules written to the same NAME,\n"
+"                       sharing one track area and one bank of unique\n"
+"                       samples (output only, written after the last\n"
+"                       argument, tracks of each song must fit in 64 KB)\n"
+"    auto               Detect format from file contents (input only)\n\n"
 
 "  If NAME is -, standard input/output will be utilized.\n\n"
+"  -probe:FORMAT NAME   Print module information as a JSON line, reading only\n"
+"                       the headers (sample data and patterns are skipped).\n"
+"  -info                Print information about the loaded module (including\n"
+"                       playing time) as a JSON line.\n"
+"  -render NAME         Render the loaded module to a WAV file (44.1kHz,\n"
+"                       16-bit stereo, Amiga panning).\n"
+"  -verify              Replay the loaded file and the last output written\n"
+"                       (or the optimized module if nothing was written)\n"
+"                       side by side, and report the first difference.\n"
+"  -roundtrip           Convert the loaded module to P61A in memory, reload\n"
+"                       it and compare patterns and samples with the module.\n\n"
 "  -opts:OPTIONS                Set import/export options\n\n"
 "  P61A export options:\n"
 "    sign                  Add signature when exporting (\'P61A\') (disabled)\n"
 "    4bit[=RANGE]          Compress specified samples to 4-bit (disabled)\n"
 "    delta                 Delta-encode samples (disabled)\n"
 "    [-]compress_patterns  Compress pattern data (enabled)\n"
+"    max_cycles=N          Limit estimated 68000 cycles per frame spent by the\n"
+"                          replayer, patterns are compressed less where needed\n"
 "    [-]song               Write song data to output (enabled)\n"
 "    [-]samples            Write sample data to output (enabled)\n\n"
 "  Preceeding a boolean option with a minus ('-') will disable the option.\n\n"
@@ -36,6 +59,10 @@ static const unsigned char help_text[] = {
 
 "  Available options:\n"
 "    unused_patterns    Remove unused patterns\n"
+"    identical_patterns Merge identical patterns\n"
+"                       (song positions are rewritten to match)\n"
+"    unreachable_rows   Clear rows that are never played\n"
+"                       (after Bxx/Dxx, before Dxx entry rows)\n"
 "    unused_samples     Remove unused samples\n"
 "                       (sample index is preserved)\n"
 "    trim               Trim tailing null data in samples\n"
@@ -45,7 +72,8 @@ static const unsigned char help_text[] = {
 "    identical_samples  Merge identical samples\n"
 "                       (pattern data is rewritten to match)\n"
 "    compact_samples    Remove empty space in the sample table\n"
-"    clean              Clean effects in pattern data\n"
+"    clean              Rewrite effects to one normal form, removing\n"
+"                       effects that change nothing\n"
 "    clean:e8           Remove E8x from pattern data\n"
 "                       (implies 'clean', not enabled by 'all')\n"
 "    all                Apply all available optimizes\n"
@@ -53,7 +81,15 @@ static const unsigned char help_text[] = {
 "  Preceeding a boolean option with a minus ('-') will disable the option.\n\n"
 "Miscellaneous:\n"
 "  -d N			Set log level (0 = info, 1 = debug, 2 = trace)\n"
-"  -q			Quiet mode\n\n"
+"  -q			Quiet mode\n"
+"  -stats[=json]		Print time, allocations and sizes per phase\n"
+"			(percentiles when processing more than one file)\n\n"
+"Convert two modules and write a replayer configuration covering both:\n"
+"  modpack -in:mod a.mod -out:p61a a.p61 -out:p61a-config player.i\n"
+"    -in:mod b.mod -out:p61a b.p61 -out:p61a-config player.i\n\n"
+"Pack two modules with identical tracks and samples stored once:\n"
+"  modpack -in:mod a.mod -out:p61a-pack songs.pak\n"
+"    -in:mod b.mod -out:p61a-pack songs.pak\n\n"
 "Remove unused patterns and samples, and re-save as MOD:\n"
 "  modpack -in:mod in.mod -optimize unused_patterns,unused_samples\n"
 "    -out:mod out.mod\n\n"
@@ -63,11 +99,31 @@ static const unsigned char help_text[] = {
 "    -opts:-song -out:p61a test.smp\n"
 };
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+// replayer configuration written to one file (-out:p61a-config), the union of the modules written to it
+typedef struct
+{
+    const char* name;
+    p61a_config_t config;
+    size_t module;          // argument index of the -in of the module merged last
+} config_output_t;
 
 static bool show_help(int argc, char* argv[]);
-static protracker_t* module_load(const char* filename, const char* format);
+static protracker_t* module_load(const char* filename, const char* format, buffer_t* input, const char** input_format);
+static protracker_t* parse_module(const buffer_t* buffer, const char* format);
+static void optimized(const stats_timer_t* timer, const char* phase, const char* saved, size_t size, const protracker_t* module);
+static bool patterns_valid(const protracker_t* module);
+static bool module_probe(const char* filename, const char* format);
+static bool module_info(const protracker_t* module);
+static bool module_render(const protracker_t* module, const char* filename);
+static bool module_verify(const protracker_t* module, const buffer_t* input, const char* input_format, const buffer_t* output, const char* output_format);
+static bool write_output(const char* filename, const buffer_t* buffer);
+static bool write_pack(const char* filename, p61a_pack_t* pack);
+static const char* detect_format(const uint8_t* data, size_t size, size_t file_size, unsigned* confidence);
 
 int main(int argc, char* argv[])
 {
@@ -78,6 +134,26 @@ int main(int argc, char* argv[])
 
     protracker_t* module = NULL;
     const char* options = "";
+    bool probe_failed = false;
+    bool check_failed = false;
+
+    // last loaded file and last written output (for -verify)
+    buffer_t input, output;
+    const char* input_format = NULL;
+    const char* output_format = NULL;
+    buffer_init(&input, 1);
+    buffer_init(&output, 1);
+
+    // replayer configurations per output name (-out:p61a-config), module_arg identifies the loaded module
+    buffer_t configs;
+    buffer_init(&configs, sizeof(config_output_t));
+    size_t module_arg = 0;
+
+    // modules added so far (-out:p61a-pack), written once all arguments are processed
+    p61a_pack_t pack;
+    const char* pack_name = NULL;
+    bool pack_failed = false;
+    player61a_pack_init(&pack);
     size_t i;
 
     for (i = 1; i < argc; ++i)
@@ -104,7 +180,15 @@ int main(int argc, char* argv[])
 
             LOG_INFO("Loading '%s'...\n", filename);
 
-            module = module_load(filename, format);
+            stats_begin_file(filename);
+
+            module = module_load(filename, format, &input, &input_format);
+            module_arg = i;
+
+            // outputs of the previous module are not verified against this one
+            buffer_release(&output);
+            output_format = NULL;
+
             if (!module)
             {
                 break;
@@ -112,6 +196,29 @@ int main(int argc, char* argv[])
 
             ++i;
         }
+        else if (!strncmp("-probe:", arg, 7))
+        {
+            if (!opt)
+            {
+                LOG_ERROR("No filename specified.\n");
+                break;
+            }
+
+            // keep going on failures, archives are probed file by file
+            if (!module_probe(opt, arg+7))
+            {
+                probe_failed = true;
+            }
+
+            ++i;
+        }
+        else if (!strcmp("-info", arg))
+        {
+            if (!module_info(module))
+            {
+                break;
+            }
+        }
         else if (!strncmp("-out:", arg, 5))
         {
             if (!opt)
@@ -126,11 +233,21 @@ int main(int argc, char* argv[])
             buffer_t buffer;
             buffer_init(&buffer, 1);
 
-            FILE* fp = NULL;
             int success = 0;
+            bool module_output = true;
+            bool deferred = false;
+            stats_timer_t timer;
 
             do
             {
+                if (!module)
+                {
+                    LOG_ERROR("No module loaded.\n");
+                    break;
+                }
+
+                stats_start(&timer);
+
                 if (!strcmp("mod", format))
                 {
                     if (!protracker_convert(&buffer, module, options))
@@ -138,6 +255,8 @@ int main(int argc, char* argv[])
                         LOG_ERROR("Conversion to ProTracker failed.\n");
                         break;
                     }
+                    stats_stop(&timer, "convert:mod");
+                    stats_size("output:mod", buffer_count(&buffer));
                 }
                 else if (!strcmp("p61a", format))
                 {
@@ -146,47 +265,151 @@ int main(int argc, char* argv[])
                         LOG_ERROR("Conversion to The Player 6.1A failed.\n");
                         break;
                     }
+                    stats_stop(&timer, "convert:p61a");
+                    stats_size("output:p61a", buffer_count(&buffer));
                 }
-                else
+                else if (!strcmp("p61a-config", format))
                 {
-                    LOG_ERROR("Unknown output format '%s'.\n", format);
-                    break;
-                }
+                    // modules written to the same name are merged, so the file covers all of them
+                    config_output_t* target = NULL;
+                    for (size_t n = 0; n < buffer_count(&configs) && !target; ++n)
+                    {
+                        config_output_t* other = buffer_get(&configs, n);
+                        target = strcmp(other->name, filename) ? NULL : other;
+                    }
+                    if (!target)
+                    {
+                        target = buffer_alloc(&configs, 1);
+                        memset(target, 0, sizeof(config_output_t));
+                        target->name = filename;
+                    }
 
-                LOG_INFO("Writing result to '%s'...", filename);
+                    p61a_config_t current;
+                    player61a_get_config(&current, module, options);
 
-                if (!strcmp(filename, "-"))
-                {
-                    fp = stdout;
+                    // a module written again only adds what its options changed
+                    if (target->module == module_arg)
+                    {
+                        current.modules = 0;
+                    }
+                    target->module = module_arg;
+
+                    player61a_merge_config(&(target->config), &current);
+                    player61a_write_config(&buffer, &(target->config));
+                    stats_stop(&timer, "convert:p61a-config");
+                    module_output = false;
                 }
-                else
+                else if (!strcmp("p61a-pack", format))
                 {
-                    fp = fopen(filename, "wb");
-                    if (!fp)
+                    // rewriting the pack for every module would take quadratic time
+                    if (pack_name && strcmp(pack_name, filename) && !write_pack(pack_name, &pack))
+                    {
+                        break;
+                    }
+                    if (!player61a_pack_add(&pack, module, options))
                     {
-                        LOG_INFO("failed to open '%s' for writing.\n", filename);
+                        LOG_ERROR("Conversion to P61A pack failed.\n");
                         break;
                     }
+                    stats_stop(&timer, "convert:p61a-pack");
+                    pack_name = filename;
+                    module_output = false;
+                    deferred = true;
+                }
+                else
+                {
+                    LOG_ERROR("Unknown output format '%s'.\n", format);
+                    break;
+                }
+
+                if (!patterns_valid(module))
+                {
+                    break;
                 }
 
-                size_t size = buffer_count(&buffer);
-                if ((size > 0) && (fwrite(buffer_get(&buffer, 0), 1, size, fp) != size))
+                if (!deferred && !write_output(filename, &buffer))
                 {
-                    LOG_INFO("failed to write %lu bytes.\n", size);
                     break;
                 }
 
-                LOG_INFO("done.\n");
                 success = 1;
             }
             while (0);
 
-            if (fp && (fp != stdout))
+            if (success && module_output)
+            {
+                buffer_release(&output);
+                output = buffer;
+                output_format = format;
+            }
+            else
+            {
+                buffer_release(&buffer);
+            }
+
+            if (!success)
+            {
+                break;
+            }
+
+            ++i;
+        }
+        else if (!strcmp("-verify", arg))
+        {
+            if (!module)
+            {
+                LOG_ERROR("No module loaded.\n");
+                break;
+            }
+
+            // keep going on differences, like -probe
+            if (!module_verify(module, &input, input_format, output_format ? &output : NULL, output_format))
+            {
+                check_failed = true;
+            }
+        }
+        else if (!strcmp("-roundtrip", arg))
+        {
+            if (!module)
+            {
+                LOG_ERROR("No module loaded.\n");
+                break;
+            }
+
+            stats_timer_t timer;
+            stats_start(&timer);
+
+            size_t mismatches = player61a_roundtrip(module, options);
+
+            stats_stop(&timer, "roundtrip:p61a");
+
+            if (!patterns_valid(module))
+            {
+                break;
+            }
+
+            if (mismatches)
             {
-                fclose(fp);
+                LOG_ERROR("Round-trip through P61A found %lu mismatches.\n", mismatches);
+                check_failed = true;
+            }
+            else
+            {
+                LOG_INFO("Round-trip through P61A is identical.\n");
+            }
+        }
+        else if (!strcmp("-render", arg))
+        {
+            if (!opt)
+            {
+                LOG_ERROR("No filename specified.\n");
+                break;
             }
 
-            buffer_release(&buffer);
+            if (!module_render(module, opt))
+            {
+                break;
+            }
 
             ++i;
         }
@@ -202,36 +425,84 @@ int main(int argc, char* argv[])
                 break;
             }
 
+            if (!module)
+            {
+                LOG_ERROR("No module loaded.\n");
+                break;
+            }
+
             bool all = has_option(opt, "all", false);
+            stats_timer_t timer;
+            size_t size;
 
             if (has_option(opt, "unused_patterns", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_remove_unused_patterns(module);
+                optimized(&timer, "optimize:unused_patterns", "saved:unused_patterns", size, module);
+            }
+
+            if (has_option(opt, "unreachable_rows", false) || all)
+            {
+                stats_start(&timer);
+                size = protracker_get_size(module);
+                protracker_remove_unreachable_rows(module);
+                optimized(&timer, "optimize:unreachable_rows", "saved:unreachable_rows", size, module);
             }
 
             if (has_option(opt, "trim", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_trim_samples(module);
+                optimized(&timer, "optimize:trim", "saved:trim", size, module);
             }
 
             if (has_option(opt, "unused_samples", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_remove_unused_samples(module);
+                optimized(&timer, "optimize:unused_samples", "saved:unused_samples", size, module);
             }
 
             if (has_option(opt, "identical_samples", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_remove_identical_samples(module);
+                optimized(&timer, "optimize:identical_samples", "saved:identical_samples", size, module);
             }
 
             if (has_option(opt, "compact_samples", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_compact_sample_indexes(module);
+                optimized(&timer, "optimize:compact_samples", "saved:compact_samples", size, module);
             }
 
             if (has_option(opt, "clean", false) || has_option(opt, "clean:e8", false) || all)
             {
+                stats_start(&timer);
+                size = protracker_get_size(module);
                 protracker_clean_effects(module, opt);
+                optimized(&timer, "optimize:clean", "saved:clean", size, module);
+            }
+
+            // last, as the passes above can make patterns identical
+            if (has_option(opt, "identical_patterns", false) || all)
+            {
+                stats_start(&timer);
+                size = protracker_get_size(module);
+                protracker_remove_identical_patterns(module);
+                optimized(&timer, "optimize:identical_patterns", "saved:identical_patterns", size, module);
+            }
+
+            if (!patterns_valid(module))
+            {
+                break;
             }
 
             ++i;
@@ -251,14 +522,30 @@ int main(int argc, char* argv[])
         {
             set_log_level(LOG_LEVEL_NONE);
         }
+        else if (!strcmp("-stats", arg) || !strcmp("-stats=json", arg))
+        {
+            stats_enable(!strcmp("-stats=json", arg));
+        }
     }
 
+    if (pack_name && (i == argc) && !write_pack(pack_name, &pack))
+    {
+        pack_failed = true;
+    }
+    player61a_pack_release(&pack);
+    buffer_release(&configs);
+
     if (module)
     {
         protracker_free(module);
     }
 
-    return (i == argc) ? 0 : 1;
+    buffer_release(&input);
+    buffer_release(&output);
+
+    stats_report();
+
+    return ((i == argc) && !probe_failed && !check_failed && !pack_failed) ? 0 : 1;
 }
 
 static bool show_help(int argc, char* argv[])
@@ -280,7 +567,351 @@ static bool show_help(int argc, char* argv[])
     return true;
 }
 
-static protracker_t* module_load(const char* filename, const char* format)
+static void optimized(const stats_timer_t* timer, const char* phase, const char* saved, size_t size, const protracker_t* module)
+{
+    stats_stop(timer, phase);
+    stats_size(saved, (int64_t)size - (int64_t)protracker_get_size(module));
+}
+
+// patterns are decoded where they are first accessed, which reports invalid data and leaves the
+// pattern empty, so a step that used one fails
+static bool patterns_valid(const protracker_t* module)
+{
+    if (module->patterns_invalid)
+    {
+        LOG_ERROR("Failed to decode pattern data.\n");
+        return false;
+    }
+    return true;
+}
+
+static void print_json_string(const char* text)
+{
+    putchar('"');
+    for (const unsigned char* c = (const unsigned char*)text; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            printf("\\%c", *c);
+        }
+        else if (*c < 0x20 || *c >= 0x7f)
+        {
+            printf("\\u%04x", *c);
+        }
+        else
+        {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+// pick a loader from the start of the file, without parsing it fully
+static const char* detect_format(const uint8_t* data, size_t size, size_t file_size, unsigned* confidence)
+{
+    unsigned mod = protracker_sniff(data, size, file_size);
+    unsigned p61a = player61a_sniff(data, size, file_size);
+
+    const char* format = (mod >= p61a) ? "mod" : "p61a";
+    *confidence = (mod >= p61a) ? mod : p61a;
+
+    if (!*confidence)
+    {
+        LOG_ERROR("Could not detect module format.\n");
+        return NULL;
+    }
+
+    if (mod && p61a)
+    {
+        LOG_WARN("Ambiguous module format (mod: %u%%, p61a: %u%%), using '%s'.\n", mod, p61a, format);
+    }
+
+    LOG_INFO("Detected format '%s' (confidence %u%%).\n", format, *confidence);
+
+    return format;
+}
+
+static bool module_probe(const char* filename, const char* format)
+{
+    protracker_info_t info;
+    bool success = false;
+    bool detect = !strcmp("auto", format);
+    unsigned confidence = 0;
+    int fd = -1;
+
+    do
+    {
+        if (strcmp("mod", format) && strcmp("p61a", format) && !detect)
+        {
+            LOG_ERROR("Unknown input format '%s'.\n", format);
+            break;
+        }
+
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+        {
+            LOG_ERROR("Failed to open file '%s'.\n", filename);
+            break;
+        }
+
+        if (detect)
+        {
+            uint8_t prefix[P61A_SNIFF_SIZE > PT_HEADER_SIZE ? P61A_SNIFF_SIZE : PT_HEADER_SIZE];
+            ssize_t size = pread(fd, prefix, sizeof(prefix), 0);
+            off_t file_size = lseek(fd, 0, SEEK_END);
+
+            if ((size < 0) || (file_size < 0) || !(format = detect_format(prefix, size, file_size, &confidence)))
+            {
+                format = "auto";
+                break;
+            }
+        }
+
+        success = !strcmp("mod", format) ? protracker_probe(fd, &info) : player61a_probe(fd, &info);
+    }
+    while (false);
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    printf("{\"file\":");
+    print_json_string(filename);
+    printf(",\"format\":");
+    print_json_string(format);
+    if (detect)
+    {
+        printf(",\"confidence\":%u", confidence);
+    }
+
+    if (success)
+    {
+        printf(",\"name\":");
+        print_json_string(info.name);
+        printf(",\"samples\":%lu,\"sample_bytes\":%lu,\"song_length\":%lu,\"patterns\":%lu,\"size\":%lu,\"expected_size\":%lu}\n",
+            info.samples, info.sample_bytes, info.song_length, info.patterns, info.file_size, info.expected_size);
+    }
+    else
+    {
+        printf(",\"error\":true}\n");
+    }
+
+    return success;
+}
+
+static bool module_info(const protracker_t* module)
+{
+    if (!module)
+    {
+        LOG_ERROR("No module loaded.\n");
+        return false;
+    }
+
+    stats_timer_t timer;
+    stats_start(&timer);
+
+    replay_t replay;
+    bool ended = replay_run(module, NULL, &replay);
+
+    stats_stop(&timer, "analyze:replay");
+
+    char name[sizeof(module->header.name) + 1];
+    memcpy(name, module->header.name, sizeof(module->header.name));
+    name[sizeof(module->header.name)] = '\0';
+
+    printf("{\"name\":");
+    print_json_string(name);
+    printf(",\"song_length\":%u,\"patterns\":%lu,\"duration\":%.3f,\"rows\":%lu,\"ticks\":%lu,\"end\":\"%s\"}\n",
+        module->song.length, module->num_patterns, replay.seconds, (unsigned long)replay.rows, (unsigned long)replay.ticks,
+        !ended ? "none" : (replay.stopped ? "stop" : "loop"));
+
+    return true;
+}
+
+static bool module_render(const protracker_t* module, const char* filename)
+{
+    if (!module)
+    {
+        LOG_ERROR("No module loaded.\n");
+        return false;
+    }
+
+    buffer_t buffer;
+    buffer_init(&buffer, 1);
+
+    bool success = false;
+    stats_timer_t timer;
+
+    do
+    {
+        stats_start(&timer);
+
+        if (!render_wav(&buffer, module, RENDER_DEFAULT_RATE))
+        {
+            LOG_ERROR("Rendering failed.\n");
+            break;
+        }
+
+        stats_stop(&timer, "render");
+        stats_size("output:wav", buffer_count(&buffer));
+
+        success = write_output(filename, &buffer);
+    }
+    while (false);
+
+    buffer_release(&buffer);
+
+    return success;
+}
+
+static bool module_verify(const protracker_t* module, const buffer_t* input, const char* input_format, const buffer_t* output, const char* output_format)
+{
+    protracker_t* original = NULL;
+    protracker_t* result = NULL;
+    bool success = false;
+    stats_timer_t timer;
+
+    do
+    {
+        stats_start(&timer);
+
+        original = parse_module(input, input_format);
+        if (!original)
+        {
+            LOG_ERROR("Failed to reload original module.\n");
+            break;
+        }
+
+        // without an output, the module as currently optimized is verified
+        if (output)
+        {
+            result = parse_module(output, output_format);
+            if (!result)
+            {
+                LOG_ERROR("Failed to reload '%s' output.\n", output_format);
+                break;
+            }
+        }
+
+        replay_difference_t difference;
+        bool equal = replay_compare(original, result ? result : module, &difference);
+
+        stats_stop(&timer, "verify");
+
+        if (!equal)
+        {
+            if (difference.channel < 0)
+            {
+                LOG_ERROR("Playback differs at position %u, row %u, tick %u: %s %d != %d.\n",
+                    difference.position, difference.row, difference.tick, difference.what, difference.expected, difference.actual);
+            }
+            else
+            {
+                LOG_ERROR("Playback differs at position %u, row %u, tick %u, channel %d: %s %d != %d.\n",
+                    difference.position, difference.row, difference.tick, difference.channel + 1, difference.what, difference.expected, difference.actual);
+            }
+            break;
+        }
+
+        LOG_INFO("Verified %s plays the same as the original.\n", output ? output_format : "optimized module");
+        success = true;
+    }
+    while (false);
+
+    if (original)
+    {
+        protracker_free(original);
+    }
+    if (result)
+    {
+        protracker_free(result);
+    }
+
+    return success;
+}
+
+static bool write_output(const char* filename, const buffer_t* buffer)
+{
+    FILE* fp = NULL;
+    bool success = false;
+    stats_timer_t timer;
+
+    do
+    {
+        stats_start(&timer);
+
+        LOG_INFO("Writing result to '%s'...", filename);
+
+        if (!strcmp(filename, "-"))
+        {
+            fp = stdout;
+        }
+        else
+        {
+            fp = fopen(filename, "wb");
+            if (!fp)
+            {
+                LOG_INFO("failed to open '%s' for writing.\n", filename);
+                break;
+            }
+        }
+
+        size_t size = buffer_count(buffer);
+        if ((size > 0) && (fwrite(buffer_get(buffer, 0), 1, size, fp) != size))
+        {
+            LOG_INFO("failed to write %lu bytes.\n", size);
+            break;
+        }
+
+        stats_stop(&timer, "write");
+
+        LOG_INFO("done.\n");
+        success = true;
+    }
+    while (false);
+
+    if (fp && (fp != stdout))
+    {
+        fclose(fp);
+    }
+
+    return success;
+}
+
+// write a pack and start a new one
+static bool write_pack(const char* filename, p61a_pack_t* pack)
+{
+    buffer_t buffer;
+    buffer_init(&buffer, 1);
+
+    player61a_pack_write(&buffer, pack);
+    bool success = write_output(filename, &buffer);
+
+    buffer_release(&buffer);
+    player61a_pack_release(pack);
+    player61a_pack_init(pack);
+
+    return success;
+}
+
+static protracker_t* parse_module(const buffer_t* buffer, const char* format)
+{
+    if (!strcmp("mod", format))
+    {
+        return protracker_load(buffer);
+    }
+    if (!strcmp("p61a", format))
+    {
+        return player61a_load(buffer);
+    }
+
+    LOG_ERROR("Unknown input format '%s'.\n", format);
+    return NULL;
+}
+
+// the file contents and the detected format are kept for -verify
+static protracker_t* module_load(const char* filename, const char* format, buffer_t* input, const char** input_format)
 {
     protracker_t* module = NULL;
     FILE* fp = NULL;
@@ -288,8 +919,12 @@ static protracker_t* module_load(const char* filename, const char* format)
     buffer_t buffer;
     buffer_init(&buffer, 1);
 
+    stats_timer_t timer;
+
     do
     {
+        stats_start(&timer);
+
         if (strcmp("-", filename))
         {
             fp = fopen(filename, "rb");
@@ -314,20 +949,32 @@ static protracker_t* module_load(const char* filename, const char* format)
             }
         } while (true);
 
-        if (!strcmp("mod", format))
-        {
-            module = protracker_load(&buffer);
-        }
-        else if (!strcmp("p61a", format))
+        stats_stop(&timer, "read");
+        stats_size("input", buffer_count(&buffer));
+
+        if (!strcmp("auto", format))
         {
-            module = player61a_load(&buffer);
+            unsigned confidence;
+            size_t size = buffer_count(&buffer);
+
+            format = detect_format(size ? buffer_get(&buffer, 0) : NULL, size, size, &confidence);
+            if (!format)
+            {
+                LOG_ERROR("Failed to load module '%s'.\n", filename);
+                break;
+            }
         }
-        else
+
+        if (strcmp("mod", format) && strcmp("p61a", format))
         {
             LOG_ERROR("Unknown input format '%s'.\n", format);
             break;
         }
 
+        stats_start(&timer);
+        module = parse_module(&buffer, format);
+        stats_stop(&timer, !strcmp("mod", format) ? "load:mod" : "load:p61a");
+
         if (!module)
         {
             LOG_ERROR("Failed to load module '%s'.\n", filename);
@@ -341,7 +988,16 @@ static protracker_t* module_load(const char* filename, const char* format)
         fclose(fp);
     }
 
-    buffer_release(&buffer);
+    if (module)
+    {
+        buffer_release(input);
+        *input = buffer;
+        *input_format = format;
+    }
+    else
+    {
+        buffer_release(&buffer);
+    }
 
     return module;
 }
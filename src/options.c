@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 bool has_option(const char* options, const char* name, bool defaultValue)
 {
@@ -29,5 +30,35 @@ bool has_option(const char* options, const char* name, bool defaultValue)
     }
 
 
+    return defaultValue;
+}
+
+unsigned long get_option_value(const char* options, const char* name, unsigned long defaultValue)
+{
+    size_t namelen = strlen(name);
+    const char* curr = options;
+
+    while ((curr = strstr(curr, name)) != NULL)
+    {
+        bool start = (curr == options) || (curr[-1] == ',');
+        if (!start || (curr[namelen] != '='))
+        {
+            curr += 1;
+            continue;
+        }
+
+        const char* value = curr + namelen + 1;
+        char* end = NULL;
+        unsigned long result = strtoul(value, &end, 0);
+
+        if ((end == value) || ((*end != '\0') && (*end != ',')))
+        {
+            LOG_WARN("Invalid value for option '%s', using %lu.\n", name, defaultValue);
+            return defaultValue;
+        }
+
+        return result;
+    }
+
     return defaultValue;
 }
@@ -3,3 +3,10 @@
 #include <stdbool.h>
 
 bool has_option(const char* options, const char* name, bool defaultValue);
+
+/**
+ *
+ * Get the value of a numeric option ("name=N"), defaultValue if the option or its value is missing
+ *
+**/
+unsigned long get_option_value(const char* options, const char* name, unsigned long defaultValue);
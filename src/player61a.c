@@ -1,7 +1,9 @@
 #include "player61a.h"
+#include "replay.h"
 #include "options.h"
 #include "endianness.h"
 #include "log.h"
+#include "stats.h"
 
 /*
 		;0 = two files (song + samples)
@@ -25,7 +27,14 @@
 
 */
 
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static const char* signature = "P61A";
 
@@ -36,6 +45,9 @@ static void build_samples(player61a_t* output, const protracker_t* module, const
     bool usage[PT_NUM_SAMPLES];
     size_t sample_count = protracker_get_used_samples(module, usage);
 
+    // the header only needs sample lengths, data is only gathered when it is written
+    bool write_data = has_option(options, "samples", true);
+
     for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
     {
         const protracker_sample_t* input = &(module->sample_headers[i]);
@@ -93,9 +105,21 @@ static void build_samples(player61a_t* output, const protracker_t* module, const
 
         // TODO: compression / delta encoding
 
+        if (!write_data)
+        {
+            continue;
+        }
+
         if (input->length > 0)
         {
-            buffer_add(&(output->samples), module->sample_data[i], length * 2);
+            // loops may end past the sample data, pad with silence
+            size_t bytes = (length < input->length ? length : input->length) * 2;
+            buffer_add(&(output->samples), protracker_get_sample_data(module, i), bytes);
+
+            if (bytes < length * 2)
+            {
+                memset(buffer_alloc(&(output->samples), length * 2 - bytes), 0, length * 2 - bytes);
+            }
         }
         else
         {
@@ -154,74 +178,39 @@ static uint16_t periods[] = {
     214,202,190,180,170,160,151,143,135,127,120,113     // octave 3
 };
 
-static uint8_t index_from_period(uint16_t period)
-{
-    for (size_t i = 0; i < (sizeof(periods) / sizeof(uint16_t)); ++i)
-    {
-        if (periods[i] == period)
-        {
-            return (uint8_t)(i+1);
-        }
-    }
-    return 0;
-}
-
-static uint16_t period_from_index(uint8_t index)
-{
-    if (!index || index > (sizeof(periods) / sizeof(uint16_t)))
-    {
-        return 0;
-    }
-
-    return periods[index-1];
-}
+#define P61A_NUM_NOTES (sizeof(periods) / sizeof(uint16_t))
+#define P61A_NO_USECODE (0xff)
 
 typedef struct
 {
-    size_t patterns;
-    size_t samples;
-} p61a_offsets_t;
-
-static size_t get_sample_offset(const player61a_t* module)
-{
-    size_t curr = 0;
-
-    curr += sizeof(p61a_header_t);   // header
-    curr += sizeof(p61a_sample_t) * module->header.sample_count; // sample headers
-    curr += sizeof(p61a_pattern_offset_t) * module->header.pattern_count; // pattern offsets
-    curr += module->song.length+1; // song positions (+0xff)
-
-    curr += buffer_count(&(module->patterns)); // tracks
-
-    if (curr & 1)
-    {
-        ++curr;
-    }
+    uint8_t cmd;
+    uint8_t value;
+    uint8_t usecode;        // bit in usecode (P61A_NO_USECODE when no command remains)
+    bool has_command;
+} p61a_effect_t;
 
-    return curr;
-}
+/*
 
-static size_t get_channel_length(const p61a_channel_t* channel)
-{
-    if ((channel->data[0] & CHANNEL_EMPTY) == CHANNEL_EMPTY)
-        return 1;
+ Codec lookup tables, filled once by init_tables():
 
-    if ((channel->data[0] & CHANNEL_NOTE_INSTRUMENT) == CHANNEL_NOTE_INSTRUMENT)
-        return 2;
+ note_from_period - ProTracker period (12 bits) -> P61A note (1-36, 0 = no note)
+ period_from_note - P61A note (6 bits) -> ProTracker period (0 = no note)
+ encode_effects   - ProTracker (cmd << 8 | value) -> P61A command
+ decode_commands  - P61A command -> ProTracker command
 
-    if ((channel->data[0] & CHANNEL_COMMAND) == CHANNEL_COMMAND)
-        return 2;
+*/
 
-    return 3;
-}
+static uint8_t note_from_period[0x1000];
+static uint16_t period_from_note[0x40];
+static p61a_effect_t encode_effects[0x1000];
+static uint8_t decode_commands[0x10];
+static bool tables_initialized = false;
 
-static size_t to_p61a_channel(p61a_channel_t* out, const protracker_channel_t* in, const protracker_pattern_row_t* row, size_t channel_index, uint32_t* usecode)
+static p61a_effect_t encode_effect(uint8_t cmd, uint8_t value)
 {
-    uint8_t instrument = protracker_get_sample(in);
-    uint16_t period = protracker_get_period(in);
-    protracker_effect_t effect = protracker_get_effect(in);
-
-    uint8_t note = index_from_period(period);
+    protracker_effect_t effect;
+    effect.cmd = cmd;
+    effect.data.value = value;
 
     bool has_command = (effect.cmd + effect.data.value) != 0;
     switch (effect.cmd)
@@ -301,14 +290,92 @@ static size_t to_p61a_channel(p61a_channel_t* out, const protracker_channel_t* i
         break;
     }
 
+    p61a_effect_t out = { 0, 0, P61A_NO_USECODE, false };
     if (has_command)
     {
-        *usecode |= (effect.cmd == PT_CMD_EXTENDED) ? (1 << (effect.data.ext.cmd + 16)) : (1 << (effect.cmd));
+        out.cmd = effect.cmd;
+        out.value = effect.data.value;
+        out.usecode = (effect.cmd == PT_CMD_EXTENDED) ? (effect.data.ext.cmd + 16) : effect.cmd;
+        out.has_command = true;
     }
-    else
+    return out;
+}
+
+static void init_tables(void)
+{
+    if (tables_initialized)
     {
-        effect.cmd = 0;
-        effect.data.value = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < P61A_NUM_NOTES; ++i)
+    {
+        note_from_period[periods[i]] = (uint8_t)(i+1);
+        period_from_note[i+1] = periods[i];
+    }
+
+    for (size_t i = 0; i < 0x1000; ++i)
+    {
+        encode_effects[i] = encode_effect(i >> 8, i & 0xff);
+    }
+
+    for (size_t i = 0; i < 0x10; ++i)
+    {
+        decode_commands[i] = (i == PT_CMD_8) ? PT_CMD_ARPEGGIO : i;
+    }
+
+    tables_initialized = true;
+}
+
+typedef struct
+{
+    size_t patterns;
+    size_t samples;
+} p61a_offsets_t;
+
+static size_t get_sample_offset(const player61a_t* module)
+{
+    size_t curr = 0;
+
+    curr += sizeof(p61a_header_t);   // header
+    curr += sizeof(p61a_sample_t) * module->header.sample_count; // sample headers
+    curr += sizeof(p61a_pattern_offset_t) * module->header.pattern_count; // pattern offsets
+    curr += module->song.length+1; // song positions (+0xff)
+
+    curr += buffer_count(&(module->patterns)); // tracks
+
+    if (curr & 1)
+    {
+        ++curr;
+    }
+
+    return curr;
+}
+
+static size_t get_channel_length(const p61a_channel_t* channel)
+{
+    if ((channel->data[0] & CHANNEL_EMPTY) == CHANNEL_EMPTY)
+        return 1;
+
+    if ((channel->data[0] & CHANNEL_NOTE_INSTRUMENT) == CHANNEL_NOTE_INSTRUMENT)
+        return 2;
+
+    if ((channel->data[0] & CHANNEL_COMMAND) == CHANNEL_COMMAND)
+        return 2;
+
+    return 3;
+}
+
+static size_t to_p61a_channel(p61a_channel_t* out, const protracker_channel_t* in, const protracker_pattern_row_t* row, size_t channel_index, uint32_t* usecode)
+{
+    uint8_t instrument = protracker_get_sample(in);
+    uint8_t note = note_from_period[protracker_get_period(in)];
+    p61a_effect_t effect = encode_effects[((in->data[2] & 0x0f) << 8) | in->data[3]];
+
+    bool has_command = effect.has_command;
+    if (has_command)
+    {
+        *usecode |= 1u << effect.usecode;
     }
 
     // empty channel
@@ -335,7 +402,7 @@ static size_t to_p61a_channel(p61a_channel_t* out, const protracker_channel_t* i
     {
         // o110cccc bbbbbbbb
         out->data[0] = CHANNEL_COMMAND | (effect.cmd & 0x0f);
-        out->data[1] = effect.data.value;
+        out->data[1] = effect.value;
         out->data[2] = 0;
         return 2;
     }
@@ -345,7 +412,7 @@ static size_t to_p61a_channel(p61a_channel_t* out, const protracker_channel_t* i
 
     out->data[0] = CHANNEL_ALL | ((note << 1) & 0x7e) | ((instrument >> 4) & 0x01);
     out->data[1] = ((instrument << 4) & 0xf0) | (effect.cmd & 0x0f);
-    out->data[2] = effect.data.value;
+    out->data[2] = effect.value;
     return 3;
 }
 
@@ -363,50 +430,110 @@ static bool to_protracker_channel(protracker_channel_t* out, const p61a_channel_
         uint8_t note = ((in->data[0] & 0x07) << 3) | ((in->data[1] & 0xe0) >> 5);
         uint8_t sample = in->data[1] & 0x1f;
 
-        protracker_set_period(out, period_from_index(note));
+        protracker_set_period(out, period_from_note[note]);
         protracker_set_sample(out, sample);
     }
     else if ((in->data[0] & CHANNEL_COMMAND) == CHANNEL_COMMAND)
     {
         // CHANNEL_COMMAND - o110cccc bbbbbbbb
-        protracker_effect_t effect;
-        effect.cmd = in->data[0] & 0x0f;
-        effect.data.value = in->data[1];
-
-        protracker_set_effect(out, &effect);
+        out->data[2] = decode_commands[in->data[0] & 0x0f];
+        out->data[3] = in->data[1];
     }
     else
     {
         // CHANNEL_ALL - onnnnnni iiiicccc bbbbbbbb
         uint8_t note = (in->data[0] & 0x7e) >> 1;
         uint8_t sample = ((in->data[0] & 0x01) << 4) | ((in->data[1] & 0xf0) >> 4);
+        uint16_t period = period_from_note[note];
 
-        protracker_effect_t effect;
-        effect.cmd = in->data[1] & 0x0f;
-        effect.data.value = in->data[2];
-
-        protracker_set_period(out, period_from_index(note));
-        protracker_set_sample(out, sample);
-        protracker_set_effect(out, &effect);
-    }
-
-    {
-        protracker_effect_t effect = protracker_get_effect(out);
-
-        switch (effect.cmd)
-        {
-            case PT_CMD_8:
-            {
-                effect.cmd = PT_CMD_ARPEGGIO;
-                protracker_set_effect(out, &effect);
-            }
-            break;
-        }
+        out->data[0] = (sample & 0x10) | ((period >> 8) & 0x0f);
+        out->data[1] = period & 0xff;
+        out->data[2] = ((sample & 0x0f) << 4) | decode_commands[in->data[1] & 0x0f];
+        out->data[3] = in->data[2];
     }
 
     return true;
 }
 
+/*
+
+ Replay cost model
+
+ Estimated 68000 cycles (7.09 MHz PAL, chip memory without DMA contention) spent by the replayer's
+ pattern fetch per channel and row, counted from the instruction timings of each fetch path.
+ Effects are not modeled, P61A_CYCLES_FRAME stands for the fixed work done every frame.
+
+*/
+
+#define P61A_CYCLES_FRAME       (1200)  // fixed cost per frame (audio registers, DMA, song position)
+#define P61A_CYCLES_EMPTY       (34)    // o1111111
+#define P61A_CYCLES_COMMAND     (62)    // o110cccc bbbbbbbb
+#define P61A_CYCLES_NOTE        (78)    // o1110nnn nnniiiii
+#define P61A_CYCLES_ALL         (96)    // onnnnnni iiiicccc bbbbbbbb
+#define P61A_CYCLES_PACKED      (24)    // reading compression info
+#define P61A_CYCLES_SKIP        (18)    // row inside an empty run
+#define P61A_CYCLES_REPEAT      (44)    // row inside a repeat run
+#define P61A_CYCLES_JUMP        (58)    // taking a jump (offset read, position saved)
+#define P61A_CYCLES_RETURN      (30)    // end of a jump (position restored)
+
+#define P61A_MAX_OP_BYTES       (4)     // channel data and compression info
+#define P61A_MAX_JUMP_OPS       (COMPRESSION_DATA_BITS + 1)
+#define P61A_MAX_TRACK_BYTES    (PT_PATTERN_ROWS * P61A_MAX_OP_BYTES)
+#define P61A_REPLACED           (0xffff)    // instruction written as part of a jump
+
+// index of written instructions, windows of P61A_MATCH_OPS instructions (the shortest jump that
+// saves bytes) are hashed and at most P61A_MATCH_CANDIDATES windows are tried per instruction
+
+#define P61A_MATCH_OPS          (2)
+#define P61A_MATCH_CANDIDATES   (32)
+#define P61A_INDEX_BITS         (14)
+#define P61A_HASH_BASE          (0x01000193u)
+
+typedef enum
+{
+    TRACK_RAW,      // one instruction per row
+    TRACK_RUNS,     // empty and repeated rows compressed
+    TRACK_JUMPS,    // runs, and jumps back to identical rows
+    TRACK_LEVELS
+} p61a_track_level_t;
+
+typedef struct
+{
+    uint8_t data[P61A_MAX_OP_BYTES];
+    uint8_t length;
+    uint8_t rows;
+} p61a_track_op_t;
+
+typedef struct
+{
+    uint8_t data[P61A_MAX_TRACK_BYTES];
+    size_t length;
+    uint32_t cycles[PT_PATTERN_ROWS];   // estimated fetch cycles per row
+
+    p61a_track_op_t ops[PT_PATTERN_ROWS];   // instructions before jumps were inserted
+    size_t count;
+    uint16_t offsets[PT_PATTERN_ROWS];      // offset of each instruction in data (P61A_REPLACED = in a jump)
+    size_t shared;                          // bytes saved by jumps into other tracks
+    size_t cross_channel;                   // part of shared saved by tracks of other channels
+} p61a_track_t;
+
+typedef struct
+{
+    uint32_t offset;        // offset in the track area
+    uint32_t hash;          // hash of the instruction
+    uint32_t window;        // hash of the window starting here (valid if indexed)
+    uint32_t next;          // earlier window in the same bucket (index + 1, 0 = none)
+    uint8_t length;
+    uint8_t channel;
+} p61a_index_op_t;
+
+typedef struct
+{
+    const buffer_t* area;                       // track area the offsets point into
+    buffer_t ops;                               // p61a_index_op_t, single row instructions in written order
+    uint32_t heads[1 << P61A_INDEX_BITS];       // window hash -> last window (index + 1, 0 = none)
+} p61a_index_t;
+
 static size_t build_track(p61a_channel_t* channel, const protracker_pattern_t* pattern, size_t channel_index, uint32_t* usecode)
 {
     for (size_t i = 0; i < PT_PATTERN_ROWS; ++i)
@@ -419,103 +546,1339 @@ static size_t build_track(p61a_channel_t* channel, const protracker_pattern_t* p
     return PT_PATTERN_ROWS;
 }
 
-static void build_patterns(player61a_t* output, const protracker_t* input, const char* options, uint32_t* usecode)
+static uint32_t op_cycles(uint8_t c0)
 {
-    LOG_DEBUG("Converting patterns...\n");
-
-    output->header.pattern_count = input->num_patterns;
+    switch (get_channel_length(&(p61a_channel_t){ { c0, 0, 0 } }))
+    {
+        case 1: return P61A_CYCLES_EMPTY;
+        case 2: return ((c0 & CHANNEL_NOTE_INSTRUMENT) == CHANNEL_NOTE_INSTRUMENT) ? P61A_CYCLES_NOTE : P61A_CYCLES_COMMAND;
+        default: return P61A_CYCLES_ALL;
+    }
+}
 
-    output->song.length = input->song.length;
-    memcpy(output->song.positions, input->song.positions, sizeof(uint8_t) * PT_NUM_POSITIONS);
+/**
+ *
+ * Estimate fetch cycles per row of an encoded track
+ *
+ * Tracks written by encode_track never nest jumps, a jump taken inside a jump ends the outer one.
+ *
+**/
+static void track_cycles(uint32_t* cycles, const uint8_t* data, size_t size, size_t start)
+{
+    memset(cycles, 0, sizeof(uint32_t) * PT_PATTERN_ROWS);
 
-    output->pattern_offsets = malloc(input->num_patterns * sizeof(p61a_pattern_offset_t));
-    memset(output->pattern_offsets, 0, input->num_patterns * sizeof(p61a_pattern_offset_t));
+    size_t position = start;
+    size_t saved = 0;
+    size_t remaining = 0;
+    uint32_t pending = 0;
+    size_t row = 0;
 
-    for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+    for (size_t steps = 0; (row < PT_PATTERN_ROWS) && (position < size) && (steps < PT_PATTERN_ROWS * 2); ++steps)
     {
-        for (size_t i = 0; i < input->num_patterns; ++i)
+        uint8_t c0 = data[position];
+        uint32_t cost = op_cycles(c0);
+        position += get_channel_length(&(p61a_channel_t){ { c0, 0, 0 } });
+
+        uint8_t d0 = 0;
+        size_t target = 0;
+        if ((c0 & CHANNEL_COMPRESSED) && (position < size))
         {
-            p61a_channel_t track[PT_PATTERN_ROWS];
+            d0 = data[position++];
+            cost += P61A_CYCLES_PACKED;
+
+            if (d0 & COMPRESSION_JUMP)
+            {
+                size_t dist = 0;
+                for (size_t i = (d0 & COMPRESSION_JUMP_LONG) ? 2 : 1; i && (position < size); --i)
+                {
+                    dist = (dist << 8) | data[position++];
+                }
+                target = (dist <= position) ? position - dist : size;
+            }
+        }
 
-            size_t length = build_track(track, &(input->patterns[i]), j, usecode);
+        bool done = remaining && (--remaining == 0);
+
+        if (d0 & COMPRESSION_JUMP)
+        {
+            // the jump itself is part of the fetch of the first row at the target
+            pending += cost + P61A_CYCLES_JUMP;
+            if (!done)
+            {
+                saved = position;
+            }
+            position = target;
+            remaining = (d0 & COMPRESSION_DATA_BITS) + 1;
+            continue;
+        }
 
-            size_t offset = buffer_count(&(output->patterns));
+        size_t rows = (c0 == (CHANNEL_EMPTY|CHANNEL_COMPRESSED)) ? 0 : 1;
+        rows += d0 & COMPRESSION_DATA_BITS;
 
-            output->pattern_offsets[i].channels[j] = offset;
+        if (rows)
+        {
+            cycles[row] += pending + cost;
+            pending = 0;
 
-            for (size_t k = 0; k < length; ++k)
+            uint32_t extra = (d0 & COMPRESSION_REPEAT_ROWS) ? P61A_CYCLES_REPEAT : P61A_CYCLES_SKIP;
+            for (size_t i = 1; (i < rows) && (row + i < PT_PATTERN_ROWS); ++i)
             {
-                const p61a_channel_t* channel = &(track[k]);
-                buffer_add(&(output->patterns), channel, get_channel_length(channel));
+                cycles[row + i] += extra;
             }
+            row += rows;
+        }
+        else
+        {
+            pending += cost;
+        }
 
-//            LOG_TRACE("CH %lu,%lu: %lu\n", i, j, buffer_count(&(output->patterns)) - offset);
+        if (done)
+        {
+            position = saved;
+            pending += P61A_CYCLES_RETURN;
         }
     }
 }
 
-static void player61a_create(player61a_t* module)
+/**
+ *
+ * Split a track into instructions, compressing runs of empty and identical rows if requested
+ *
+**/
+static size_t encode_runs(p61a_track_op_t* ops, const p61a_channel_t* track, bool compress)
 {
-    memset(module, 0, sizeof(player61a_t));
+    size_t count = 0;
 
-    buffer_init(&(module->patterns), 1);
-    buffer_init(&(module->samples), 1);
-}
+    for (size_t i = 0; i < PT_PATTERN_ROWS; )
+    {
+        const p61a_channel_t* channel = &(track[i]);
+        p61a_track_op_t* op = &(ops[count++]);
 
-static void player61a_destroy(player61a_t* module)
-{
-    free(module->pattern_offsets);
+        op->length = (uint8_t)get_channel_length(channel);
+        op->rows = 1;
+        memcpy(op->data, channel->data, op->length);
+        ++i;
 
-    buffer_release(&(module->patterns));
-    buffer_release(&(module->samples));
-}
+        if (!compress)
+        {
+            continue;
+        }
 
-#if 0
+        bool empty = channel->data[0] == CHANNEL_EMPTY;
 
-static int8_t deltas[] = {
-    0,1,2,4,8,16,32,64,128,-64,-32,-16,-8,-4,-2,-1
-};
+        size_t same = 0;
+        while ((i + same < PT_PATTERN_ROWS) && (same + empty < COMPRESSION_DATA_BITS) && !memcmp(track[i + same].data, channel->data, P61A_CHANNEL_BYTES))
+        {
+            ++same;
+        }
 
-#endif
+        if (empty)
+        {
+            // 11111111 00nnnnnn: n empty rows, including this one
+            if (same)
+            {
+                op->data[0] = CHANNEL_EMPTY | CHANNEL_COMPRESSED;
+                op->data[1] = (uint8_t)(same + 1);
+                op->length = 2;
+                op->rows = (uint8_t)(same + 1);
+                i += same;
+            }
+            continue;
+        }
 
-static void write_song(buffer_t* buffer, const player61a_t* module, const char* options)
-{
-    if (has_option(options, "sign", false))
-    {
-        LOG_TRACE(" - Adding signature.\n");
-        buffer_add(buffer, signature, strlen(signature));
-    }
+        if (same)
+        {
+            op->data[0] |= CHANNEL_COMPRESSED;
+            op->data[op->length++] = COMPRESSION_REPEAT_ROWS | (uint8_t)same;
+            op->rows += (uint8_t)same;
+            i += same;
+            continue;
+        }
 
-    // header
+        size_t empty_rows = 0;
+        while ((i + empty_rows < PT_PATTERN_ROWS) && (empty_rows < COMPRESSION_DATA_BITS) && (track[i + empty_rows].data[0] == CHANNEL_EMPTY))
+        {
+            ++empty_rows;
+        }
 
-    {
-        p61a_header_t header;
+        // a single empty row is as small uncompressed
+        if (empty_rows > 1)
+        {
+            op->data[0] |= CHANNEL_COMPRESSED;
+            op->data[op->length++] = COMPRESSION_EMPTY_ROWS | (uint8_t)empty_rows;
+            op->rows += (uint8_t)empty_rows;
+            i += empty_rows;
+        }
+    }
 
-        header.sample_offset = end_htobe16(get_sample_offset(module));
-        header.pattern_count = module->header.pattern_count;
-        header.sample_count = module->header.sample_count;
+    return count;
+}
 
-        buffer_add(buffer, &header, sizeof(header));
-    }
+static bool same_op(const p61a_track_op_t* a, const p61a_track_op_t* b)
+{
+    return (a->length == b->length) && !memcmp(a->data, b->data, a->length);
+}
 
-    // sample headers
+static uint32_t hash_op(const uint8_t* data, size_t length)
+{
+    uint32_t hash = 0x811c9dc5u;
+    for (size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ data[i]) * P61A_HASH_BASE;
+    }
+    return hash | 1;
+}
 
-    for (size_t i = 0; i < module->header.sample_count; ++i)
+/**
+ *
+ * Estimate fetch cycles per row of instructions written as they are (see track_cycles)
+ *
+**/
+static void runs_cycles(uint32_t* cycles, const p61a_track_op_t* ops, size_t count)
+{
+    size_t row = 0;
+    for (size_t i = 0; (i < count) && (row < PT_PATTERN_ROWS); ++i)
     {
-        const p61a_sample_t* in = &(module->sample_headers[i]);
-        p61a_sample_t sample;
+        const p61a_track_op_t* op = &(ops[i]);
+        bool packed = op->data[0] & CHANNEL_COMPRESSED;
 
-        bool empty = in->length == 0;
+        cycles[row] = op_cycles(op->data[0]) + (packed ? P61A_CYCLES_PACKED : 0);
 
-        if (!empty)
+        uint32_t extra = (packed && (op->data[op->length - 1] & COMPRESSION_REPEAT_ROWS)) ? P61A_CYCLES_REPEAT : P61A_CYCLES_SKIP;
+        for (size_t j = 1; (j < op->rows) && (row + j < PT_PATTERN_ROWS); ++j)
         {
-            sample.length = end_htobe16(in->length);
-            sample.finetone = in->finetone;
-            sample.volume = in->volume;
-            sample.repeat_offset = end_htobe16(in->repeat_offset);
+            cycles[row + j] = extra;
         }
-        else
-        {
+        row += op->rows;
+    }
+}
+
+static void index_init(p61a_index_t* index, const buffer_t* area)
+{
+    index->area = area;
+    buffer_init(&(index->ops), sizeof(p61a_index_op_t));
+    memset(index->heads, 0, sizeof(index->heads));
+}
+
+static void index_release(p61a_index_t* index)
+{
+    buffer_release(&(index->ops));
+}
+
+/**
+ *
+ * Add the single row instructions of a track written at offset to the index
+ *
+ * Every instruction that ends a window of P61A_MATCH_OPS instructions written back to back gets its
+ * window hashed, so the cost per instruction does not depend on the size of the area.
+ *
+**/
+static void index_track(p61a_index_t* index, const p61a_track_t* track, size_t offset, size_t channel)
+{
+    for (size_t p = 0; p < track->count; ++p)
+    {
+        const p61a_track_op_t* in = &(track->ops[p]);
+        if ((track->offsets[p] == P61A_REPLACED) || (in->rows != 1))
+        {
+            continue;
+        }
+
+        p61a_index_op_t* op = buffer_alloc(&(index->ops), 1);
+        op->offset = (uint32_t)(offset + track->offsets[p]);
+        op->hash = hash_op(in->data, in->length);
+        op->window = 0;
+        op->next = 0;
+        op->length = in->length;
+        op->channel = (uint8_t)channel;
+
+        size_t count = buffer_count(&(index->ops));
+        if (count < P61A_MATCH_OPS)
+        {
+            continue;
+        }
+
+        p61a_index_op_t* first = buffer_get(&(index->ops), count - P61A_MATCH_OPS);
+        uint32_t window = 0;
+        bool adjacent = true;
+
+        for (size_t i = 0; i < P61A_MATCH_OPS; ++i)
+        {
+            adjacent = adjacent && (!i || (first[i].offset == first[i - 1].offset + first[i - 1].length));
+            window = window * P61A_HASH_BASE + first[i].hash;
+        }
+
+        if (adjacent)
+        {
+            uint32_t* head = &(index->heads[window & ((1 << P61A_INDEX_BITS) - 1)]);
+
+            first->window = window;
+            first->next = *head;
+            *head = (uint32_t)(count - P61A_MATCH_OPS + 1);
+        }
+    }
+}
+
+typedef struct
+{
+    size_t ops;
+    size_t saving;
+    size_t target;          // absolute offset in the track area
+    size_t bytes;           // size of the jump instruction
+    bool cross_channel;
+} p61a_jump_t;
+
+static void consider_jump(p61a_jump_t* best, size_t n, size_t bytes, size_t position, size_t target, bool cross_channel)
+{
+    size_t jump = (position + 3 - target <= 0xff) ? 3 : 4;
+    if (n && (bytes > jump) && (bytes - jump > best->saving) && (position + jump - target <= 0xffff))
+    {
+        best->ops = n;
+        best->saving = bytes - jump;
+        best->target = target;
+        best->bytes = jump;
+        best->cross_channel = cross_channel;
+    }
+}
+
+/**
+ *
+ * Find the longest match of the instructions at p among the tracks in the index
+ *
+**/
+static void find_indexed(p61a_jump_t* best, const p61a_index_t* index, const p61a_track_op_t* ops, size_t count, size_t p, uint32_t window, size_t position, size_t channel)
+{
+    size_t total = buffer_count(&(index->ops));
+    const uint8_t* area = buffer_count(index->area) ? buffer_get(index->area, 0) : NULL;
+    uint32_t next = index->heads[window & ((1 << P61A_INDEX_BITS) - 1)];
+
+    for (size_t tries = 0; next && (tries < P61A_MATCH_CANDIDATES); ++tries)
+    {
+        size_t a = next - 1;
+        const p61a_index_op_t* first = buffer_get(&(index->ops), a);
+        next = first->next;
+
+        // windows are chained newest first, the rest is out of reach
+        if (position + 4 - first->offset > 0xffff)
+        {
+            break;
+        }
+        if (first->window != window)
+        {
+            continue;
+        }
+
+        size_t n = 0, bytes = 0;
+        while ((p + n < count) && (a + n < total) && (n < P61A_MAX_JUMP_OPS) && (ops[p + n].rows == 1))
+        {
+            const p61a_index_op_t* op = first + n;
+            if ((n && (op->offset != op[-1].offset + op[-1].length)) ||
+                (op->length != ops[p + n].length) || memcmp(area + op->offset, ops[p + n].data, op->length))
+            {
+                break;
+            }
+            bytes += op->length;
+            ++n;
+        }
+
+        consider_jump(best, n, bytes, position, first->offset, first->channel != channel);
+    }
+}
+
+/**
+ *
+ * Write instructions, replacing sequences that were already written by jumps back to them
+ *
+ * Jumps only cover instructions of one row each, so the jump count means the same whether a
+ * replayer counts rows or instructions, and jump targets never contain jumps themselves. Earlier
+ * rows of the track are always searched, tracks in the index (if any) are matched by content
+ * regardless of their pattern or channel. The track is written at offset base of the track area.
+ *
+**/
+static void encode_jumps(p61a_track_t* track, const p61a_index_t* index, size_t base, size_t channel)
+{
+    const p61a_track_op_t* ops = track->ops;
+    size_t count = track->count;
+    uint8_t* out = track->data;
+    size_t length = 0;
+
+    // rolling hash of the window of P61A_MATCH_OPS instructions starting at each instruction
+    uint32_t hashes[PT_PATTERN_ROWS];
+    uint32_t windows[PT_PATTERN_ROWS];
+    uint32_t power = 1, window = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        hashes[i] = hash_op(ops[i].data, ops[i].length);
+    }
+    for (size_t i = 0; (i < P61A_MATCH_OPS) && (i < count); ++i)
+    {
+        power = i ? power * P61A_HASH_BASE : 1;
+        window = window * P61A_HASH_BASE + hashes[i];
+    }
+    for (size_t i = 0; i + P61A_MATCH_OPS <= count; ++i)
+    {
+        windows[i] = window;
+        if (i + P61A_MATCH_OPS < count)
+        {
+            window = (window - hashes[i] * power) * P61A_HASH_BASE + hashes[i + P61A_MATCH_OPS];
+        }
+    }
+
+    size_t row = 0;
+    track->shared = 0;
+    track->cross_channel = 0;
+
+    for (size_t p = 0; p < count; )
+    {
+        p61a_jump_t best = { 0 };
+
+        for (size_t q = 0; (q < p) && (ops[p].rows == 1); ++q)
+        {
+            if (hashes[q] != hashes[p])
+            {
+                continue;
+            }
+
+            size_t n = 0, bytes = 0;
+            while ((p + n < count) && (q + n < p) && (n < P61A_MAX_JUMP_OPS) &&
+                (track->offsets[q + n] != P61A_REPLACED) && (ops[p + n].rows == 1) && same_op(&(ops[q + n]), &(ops[p + n])))
+            {
+                bytes += ops[p + n].length;
+                ++n;
+            }
+
+            if (n)
+            {
+                consider_jump(&best, n, bytes, base + length, base + track->offsets[q], false);
+            }
+        }
+
+        bool local = best.ops != 0;
+
+        if (index && (p + P61A_MATCH_OPS <= count))
+        {
+            bool single = true;
+            for (size_t i = 0; i < P61A_MATCH_OPS; ++i)
+            {
+                single = single && (ops[p + i].rows == 1);
+            }
+            if (single)
+            {
+                size_t saving = best.saving;
+                find_indexed(&best, index, ops, count, p, windows[p], base + length, channel);
+                local = local && (best.saving == saving);
+            }
+        }
+
+        if (best.ops)
+        {
+            size_t dist = base + length + best.bytes - best.target;
+
+            out[length++] = CHANNEL_EMPTY | CHANNEL_COMPRESSED;
+            if (best.bytes == 3)
+            {
+                out[length++] = COMPRESSION_JUMP | (uint8_t)(best.ops - 1);
+            }
+            else
+            {
+                out[length++] = COMPRESSION_JUMP | COMPRESSION_JUMP_LONG | (uint8_t)(best.ops - 1);
+                out[length++] = (uint8_t)(dist >> 8);
+            }
+            out[length++] = (uint8_t)dist;
+
+            if (!local)
+            {
+                track->shared += best.saving;
+                track->cross_channel += best.cross_channel ? best.saving : 0;
+            }
+
+            // the jump is fetched with the first row at the target, the return with the row after it
+            track->cycles[row] += P61A_CYCLES_EMPTY + P61A_CYCLES_PACKED + P61A_CYCLES_JUMP;
+            row += best.ops;
+            if (row < PT_PATTERN_ROWS)
+            {
+                track->cycles[row] += P61A_CYCLES_RETURN;
+            }
+
+            for (size_t i = 0; i < best.ops; ++i)
+            {
+                track->offsets[p++] = P61A_REPLACED;
+            }
+            continue;
+        }
+
+        track->offsets[p] = (uint16_t)length;
+        memcpy(out + length, ops[p].data, ops[p].length);
+        length += ops[p].length;
+        row += ops[p].rows;
+        ++p;
+    }
+
+    track->length = length;
+}
+
+/**
+ *
+ * Encode a track at the given level, jumps may point into the tracks of index (may be NULL) when
+ * the track is written at offset base
+ *
+**/
+static void encode_track(p61a_track_t* track, const p61a_channel_t* channels, p61a_track_level_t level, const p61a_index_t* index, size_t base, size_t channel)
+{
+    track->count = encode_runs(track->ops, channels, level != TRACK_RAW);
+    track->shared = 0;
+    track->cross_channel = 0;
+
+    memset(track->cycles, 0, sizeof(track->cycles));
+    runs_cycles(track->cycles, track->ops, track->count);
+
+    if (level == TRACK_JUMPS)
+    {
+        encode_jumps(track, index, base, channel);
+        return;
+    }
+
+    track->length = 0;
+    for (size_t i = 0; i < track->count; ++i)
+    {
+        track->offsets[i] = (uint16_t)track->length;
+        memcpy(track->data + track->length, track->ops[i].data, track->ops[i].length);
+        track->length += track->ops[i].length;
+    }
+}
+
+static uint32_t pattern_cycles(const p61a_track_t* const tracks[PT_NUM_CHANNELS])
+{
+    uint32_t worst = 0;
+    for (size_t i = 0; i < PT_PATTERN_ROWS; ++i)
+    {
+        uint32_t cycles = P61A_CYCLES_FRAME;
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            cycles += tracks[j]->cycles[i];
+        }
+        worst = cycles > worst ? cycles : worst;
+    }
+    return worst;
+}
+
+/**
+ *
+ * Pick the encoding of each channel in a pattern, the smallest that keeps every row within
+ * max_cycles (0 = no limit), or the cheapest one if none does
+ *
+ * Returns the estimated cycles of the most expensive row with the chosen encodings
+ *
+**/
+static uint32_t choose_encodings(const p61a_track_t** chosen, const p61a_track_t (*tracks)[TRACK_LEVELS], size_t levels, unsigned long max_cycles)
+{
+    size_t combinations = levels * levels * levels * levels;
+    size_t best_size = SIZE_MAX;
+    uint32_t best_cycles = UINT32_MAX;
+    bool best_fits = false;
+
+    for (size_t c = 0; c < combinations; ++c)
+    {
+        const p61a_track_t* candidate[PT_NUM_CHANNELS];
+        size_t size = 0;
+
+        for (size_t j = 0, k = c; j < PT_NUM_CHANNELS; ++j, k /= levels)
+        {
+            candidate[j] = &(tracks[j][levels - 1 - (k % levels)]);
+            size += candidate[j]->length;
+        }
+
+        uint32_t cycles = pattern_cycles(candidate);
+        bool fits = !max_cycles || (cycles <= max_cycles);
+
+        bool better = fits ?
+            (!best_fits || (size < best_size) || ((size == best_size) && (cycles < best_cycles))) :
+            (!best_fits && ((cycles < best_cycles) || ((cycles == best_cycles) && (size < best_size))));
+
+        if (better)
+        {
+            memcpy(chosen, candidate, sizeof(candidate));
+            best_size = size;
+            best_cycles = cycles;
+            best_fits = fits;
+        }
+    }
+
+    return best_cycles;
+}
+
+typedef struct
+{
+    p61a_channel_t rows[PT_PATTERN_ROWS];
+    p61a_track_t chosen;        // encoding chosen for the pattern (the fallback)
+    p61a_track_t encoded;       // encoding as written
+    uint32_t hash;              // hash of rows
+    size_t offset;              // offset in the track area (SIZE_MAX = not written yet)
+} p61a_track_source_t;
+
+typedef struct
+{
+    size_t tracks;              // tracks pointing at an identical track
+    size_t track_bytes;
+    size_t jump_bytes;          // saved by jumps into other tracks
+    size_t cross_channel;       // part of the above where the other track is in another channel
+    int64_t order_saved;        // saved by the greedy track order over the fixed order
+    int64_t shared_saved;       // saved by writing next to the tracks of other modules
+} p61a_sharing_t;
+
+// greedy track ordering, rows shared with the last track written are looked up in the postings of
+// each row, at most P61A_ORDER_POSTINGS tracks per row are scored
+
+#define P61A_ORDER_POSTINGS     (64)
+
+typedef struct
+{
+    uint32_t hash;          // hash of a row
+    uint32_t track;
+} p61a_posting_t;
+
+// tracks remembered by a store for sharing identical tracks, the instruction index is bounded by
+// the part of the track area after the base (pattern offsets from the base are 16-bit)
+#define P61A_STORE_MAX_TRACKS   (4096)
+
+typedef struct
+{
+    p61a_channel_t rows[PT_PATTERN_ROWS];
+    uint32_t cycles[PT_PATTERN_ROWS];
+    uint32_t hash;              // hash of rows
+    uint32_t offset;            // offset in the track area
+    uint32_t next;              // earlier track in the same bucket (index + 1, 0 = none)
+    uint8_t channel;
+} p61a_written_track_t;
+
+/**
+ *
+ * Track area and what is known about the tracks written to it, for one module or for all songs
+ * of a pack
+ *
+**/
+struct p61a_track_store_s
+{
+    buffer_t* area;
+    size_t base;                // offset pattern offsets are relative to, nothing before it is shared
+    p61a_index_t* index;        // instructions of the area (NULL = tracks are not shared)
+    buffer_t tracks;            // p61a_written_track_t
+    uint32_t* buckets;          // hash of rows -> last track in the bucket (index + 1, 0 = none)
+    size_t bucket_count;
+};
+
+static void store_init(p61a_track_store_t* store, buffer_t* area, bool compress)
+{
+    store->area = area;
+    store->base = 0;
+    store->index = NULL;
+    buffer_init(&(store->tracks), sizeof(p61a_written_track_t));
+    store->bucket_count = 64;
+    store->buckets = calloc(store->bucket_count, sizeof(uint32_t));
+
+    if (compress)
+    {
+        store->index = malloc(sizeof(p61a_index_t));
+        index_init(store->index, area);
+    }
+}
+
+static void store_release(p61a_track_store_t* store)
+{
+    if (store->index)
+    {
+        index_release(store->index);
+        free(store->index);
+    }
+
+    buffer_release(&(store->tracks));
+    free(store->buckets);
+}
+
+/**
+ *
+ * Drop what was written to the track area after base and start addressing tracks from there
+ *
+ * Tracks before the new base are out of reach of the songs written next, so they are no longer
+ * indexed: identical tracks and jump targets are only found from the base on.
+ *
+**/
+static void store_restart(p61a_track_store_t* store, size_t base)
+{
+    buffer_truncate(store->area, base);
+    store->base = base;
+
+    buffer_reset(&(store->tracks));
+    memset(store->buckets, 0, store->bucket_count * sizeof(uint32_t));
+
+    if (store->index)
+    {
+        buffer_reset(&(store->index->ops));
+        memset(store->index->heads, 0, sizeof(store->index->heads));
+    }
+}
+
+static void store_link_track(p61a_track_store_t* store, size_t index)
+{
+    p61a_written_track_t* track = buffer_get(&(store->tracks), index);
+    uint32_t* bucket = &(store->buckets[track->hash & (store->bucket_count - 1)]);
+
+    track->next = *bucket;
+    *bucket = (uint32_t)(index + 1);
+}
+
+static void store_add_track(p61a_track_store_t* store, const p61a_track_source_t* source, size_t channel)
+{
+    size_t index = buffer_count(&(store->tracks));
+    if (index >= P61A_STORE_MAX_TRACKS)
+    {
+        return;
+    }
+
+    p61a_written_track_t* track = buffer_alloc(&(store->tracks), 1);
+    memcpy(track->rows, source->rows, sizeof(track->rows));
+    memcpy(track->cycles, source->encoded.cycles, sizeof(track->cycles));
+    track->hash = source->hash;
+    track->offset = (uint32_t)source->offset;
+    track->channel = (uint8_t)channel;
+
+    if ((index + 1) * 2 > store->bucket_count)
+    {
+        free(store->buckets);
+        store->bucket_count *= 2;
+        store->buckets = calloc(store->bucket_count, sizeof(uint32_t));
+
+        for (size_t i = 0; i <= index; ++i)
+        {
+            store_link_track(store, i);
+        }
+    }
+    else
+    {
+        store_link_track(store, index);
+    }
+}
+
+// every row of the pattern stays within limit if the track in channel replaces the current one
+static bool track_fits(const p61a_track_source_t* pattern, size_t channel, const uint32_t* cycles, uint32_t limit)
+{
+    for (size_t i = 0; i < PT_PATTERN_ROWS; ++i)
+    {
+        uint32_t row = P61A_CYCLES_FRAME + cycles[i];
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            row += (j != channel) ? pattern[j].encoded.cycles[i] : 0;
+        }
+        if (row > limit)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *
+ * Write a track to the track area of a store
+ *
+ * Tracks are matched by content only, a track identical to one written before (in any pattern
+ * or channel) points at it, otherwise jumps may point into any track written before. Both are only
+ * used if the pattern stays within limit, the encoding chosen for the pattern is the fallback.
+ *
+**/
+static void write_track(p61a_track_store_t* store, p61a_track_source_t* sources, size_t t, uint32_t limit, bool compress, p61a_sharing_t* sharing)
+{
+    p61a_track_source_t* source = &(sources[t]);
+    p61a_track_source_t* pattern = &(sources[t - t % PT_NUM_CHANNELS]);
+    size_t channel = t % PT_NUM_CHANNELS;
+    p61a_index_t* index = compress ? store->index : NULL;
+
+    if (index)
+    {
+        for (uint32_t s = store->buckets[source->hash & (store->bucket_count - 1)]; s; )
+        {
+            const p61a_written_track_t* other = buffer_get(&(store->tracks), s - 1);
+            s = other->next;
+
+            if ((other->hash == source->hash) && !memcmp(other->rows, source->rows, sizeof(source->rows)) &&
+                track_fits(pattern, channel, other->cycles, limit))
+            {
+                sharing->tracks++;
+                sharing->track_bytes += source->encoded.length;
+                sharing->cross_channel += (other->channel != channel) ? source->encoded.length : 0;
+
+                memcpy(source->encoded.cycles, other->cycles, sizeof(source->encoded.cycles));
+                source->offset = other->offset;
+                return;
+            }
+        }
+
+        p61a_track_t* jumps = malloc(sizeof(p61a_track_t));
+        encode_track(jumps, source->rows, TRACK_JUMPS, index, buffer_count(store->area), channel);
+
+        if ((jumps->length < source->encoded.length) && track_fits(pattern, channel, jumps->cycles, limit))
+        {
+            sharing->jump_bytes += source->encoded.length - jumps->length;
+            sharing->cross_channel += jumps->cross_channel;
+            source->encoded = *jumps;
+        }
+        free(jumps);
+    }
+
+    source->offset = buffer_count(store->area);
+    buffer_add(store->area, source->encoded.data, source->encoded.length);
+
+    if (index)
+    {
+        index_track(index, &(source->encoded), source->offset, channel);
+        store_add_track(store, source, channel);
+    }
+}
+
+// track written at position n of the fixed order (channel-major)
+static size_t fixed_track(size_t n, size_t num_tracks)
+{
+    size_t num_patterns = num_tracks / PT_NUM_CHANNELS;
+    return (n % num_patterns) * PT_NUM_CHANNELS + n / num_patterns;
+}
+
+/**
+ *
+ * Write all tracks in the given order (indexes into sources), sharing tracks and jumping between
+ * them if compress is set
+ *
+ * Returns the size of the track area
+ *
+**/
+static size_t write_tracks(p61a_track_store_t* store, p61a_track_source_t* sources, size_t num_tracks, const size_t* order, const uint32_t* limits, bool compress, p61a_sharing_t* sharing)
+{
+    memset(sharing, 0, sizeof(p61a_sharing_t));
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        sources[t].encoded = sources[t].chosen;
+        sources[t].offset = SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < num_tracks; ++i)
+    {
+        write_track(store, sources, order[i], limits[order[i] / PT_NUM_CHANNELS], compress, sharing);
+    }
+
+    return buffer_count(store->area);
+}
+
+// write tracks to an area of their own
+static size_t write_module_tracks(buffer_t* area, p61a_track_source_t* sources, size_t num_tracks, const size_t* order, const uint32_t* limits, bool compress, p61a_sharing_t* sharing)
+{
+    p61a_track_store_t store;
+    store_init(&store, area, compress);
+
+    size_t size = write_tracks(&store, sources, num_tracks, order, limits, compress, sharing);
+
+    store_release(&store);
+    return size;
+}
+
+// every track is addressed by a 16-bit offset from base
+static bool tracks_in_reach(const p61a_track_source_t* sources, size_t num_tracks, size_t base)
+{
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        if (sources[t].offset - base > 0xffff)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *
+ * Write the tracks of a song next to the tracks of other songs
+ *
+ * Pattern offsets of the song are relative to the base of the store. If a track would be out of
+ * reach from there, the tracks written are dropped and the song starts a new base at the end of the
+ * area instead, so a pack is not limited to 64 KB of tracks but only to 64 KB per song.
+ *
+**/
+static void write_shared_tracks(p61a_track_store_t* store, p61a_track_source_t* sources, size_t num_tracks, const size_t* order, const uint32_t* limits, bool compress, p61a_sharing_t* sharing)
+{
+    size_t start = buffer_count(store->area);
+    write_tracks(store, sources, num_tracks, order, limits, compress, sharing);
+
+    if (!tracks_in_reach(sources, num_tracks, store->base) && (start > store->base))
+    {
+        LOG_DEBUG(" - Tracks out of reach from offset %lu of the shared track area, new base at offset %lu.\n", store->base, start);
+
+        store_restart(store, start);
+        write_tracks(store, sources, num_tracks, order, limits, compress, sharing);
+    }
+}
+
+static int compare_posting(const void* a, const void* b)
+{
+    const p61a_posting_t* pa = (const p61a_posting_t*)a;
+    const p61a_posting_t* pb = (const p61a_posting_t*)b;
+
+    if (pa->hash != pb->hash)
+    {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->track < pb->track ? -1 : (pa->track > pb->track);
+}
+
+/**
+ *
+ * Order tracks so that tracks sharing rows are written close to each other
+ *
+ * Greedy nearest neighbour: the next track is the one sharing the most distinct non-empty rows with
+ * the last track written (ties go to the lowest pattern), tracks without shared rows follow the
+ * fixed order. Every step scores at most P61A_ORDER_POSTINGS tracks per row and written tracks are
+ * dropped from the postings as they are met, so the time is linear in the number of tracks.
+ *
+**/
+static void order_tracks(size_t* order, const p61a_track_source_t* sources, size_t num_tracks)
+{
+    p61a_posting_t* postings = malloc(num_tracks * PT_PATTERN_ROWS * sizeof(p61a_posting_t));
+    size_t count = 0;
+
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        for (size_t i = 0; i < PT_PATTERN_ROWS; ++i)
+        {
+            const p61a_channel_t* row = &(sources[t].rows[i]);
+            if (row->data[0] != CHANNEL_EMPTY)
+            {
+                postings[count++] = (p61a_posting_t){ hash_op(row->data, P61A_CHANNEL_BYTES), (uint32_t)t };
+            }
+        }
+    }
+
+    qsort(postings, count, sizeof(p61a_posting_t), compare_posting);
+
+    // distinct rows: postings[starts[u]..ends[u]) are the tracks holding row u, rows of track t are
+    // track_rows[rows[t]..rows[t + 1])
+
+    size_t* starts = malloc((count + 1) * sizeof(size_t));
+    size_t* ends = malloc((count + 1) * sizeof(size_t));
+    size_t* rows = calloc(num_tracks + 1, sizeof(size_t));
+    size_t* track_rows = malloc((count + 1) * sizeof(size_t));
+    size_t unique = 0, distinct = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        bool new_row = !i || (postings[i].hash != postings[i - 1].hash);
+        if (!new_row && (postings[i].track == postings[distinct - 1].track))
+        {
+            continue;
+        }
+        if (new_row)
+        {
+            starts[unique++] = distinct;
+        }
+        track_rows[distinct] = unique - 1;
+        rows[postings[i].track + 1]++;
+        postings[distinct++] = postings[i];
+    }
+
+    starts[unique] = distinct;
+    for (size_t u = 0; u < unique; ++u)
+    {
+        ends[u] = starts[u + 1];
+    }
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        rows[t + 1] += rows[t];
+    }
+
+    size_t* fill = malloc((num_tracks + 1) * sizeof(size_t));
+    size_t* by_track = malloc((distinct + 1) * sizeof(size_t));
+
+    memcpy(fill, rows, (num_tracks + 1) * sizeof(size_t));
+    for (size_t i = 0; i < distinct; ++i)
+    {
+        by_track[fill[postings[i].track]++] = track_rows[i];
+    }
+    free(fill);
+    free(track_rows);
+
+    uint32_t* scores = calloc(num_tracks, sizeof(uint32_t));
+    size_t* touched = malloc(num_tracks * sizeof(size_t));
+    bool* written = calloc(num_tracks, sizeof(bool));
+    size_t next_fixed = 0;
+    size_t current = fixed_track(0, num_tracks);
+
+    for (size_t n = 0; n < num_tracks; ++n)
+    {
+        if (n)
+        {
+            size_t touched_count = 0;
+            size_t best = SIZE_MAX;
+
+            for (size_t r = rows[current]; r < rows[current + 1]; ++r)
+            {
+                size_t u = by_track[r];
+                size_t scanned = 0;
+
+                for (size_t i = starts[u]; (i < ends[u]) && (scanned < P61A_ORDER_POSTINGS); )
+                {
+                    size_t t = postings[i].track;
+                    if (written[t])
+                    {
+                        postings[i] = postings[--ends[u]];
+                        continue;
+                    }
+
+                    if (!scores[t]++)
+                    {
+                        touched[touched_count++] = t;
+                    }
+                    ++scanned;
+                    ++i;
+                }
+            }
+
+            for (size_t i = 0; i < touched_count; ++i)
+            {
+                size_t t = touched[i];
+                if ((best == SIZE_MAX) || (scores[t] > scores[best]) || ((scores[t] == scores[best]) && (t < best)))
+                {
+                    best = t;
+                }
+                scores[t] = 0;
+            }
+
+            if (best == SIZE_MAX)
+            {
+                while (written[fixed_track(next_fixed, num_tracks)])
+                {
+                    ++next_fixed;
+                }
+                best = fixed_track(next_fixed, num_tracks);
+            }
+            current = best;
+        }
+
+        written[current] = true;
+        order[n] = current;
+    }
+
+    free(written);
+    free(touched);
+    free(scores);
+    free(by_track);
+    free(rows);
+    free(ends);
+    free(starts);
+    free(postings);
+}
+
+/**
+ *
+ * Convert patterns to tracks, written to the module's own track area or to a shared store (may be
+ * NULL), sharing statistics are returned in result (may be NULL) for the caller to record
+ *
+ * Returns false if a track starts beyond the reach of 16-bit pattern offsets
+ *
+**/
+static bool build_patterns(player61a_t* output, const protracker_t* input, const char* options, uint32_t* usecode, p61a_track_store_t* shared, p61a_sharing_t* result)
+{
+    LOG_DEBUG("Converting patterns...\n");
+
+    bool compress = has_option(options, "compress_patterns", true);
+    unsigned long max_cycles = get_option_value(options, "max_cycles", 0);
+    size_t levels = compress ? TRACK_LEVELS : 1;
+
+    output->header.pattern_count = input->num_patterns;
+
+    output->song.length = input->song.length;
+    memcpy(output->song.positions, input->song.positions, sizeof(uint8_t) * PT_NUM_POSITIONS);
+
+    output->pattern_offsets = malloc(input->num_patterns * sizeof(p61a_pattern_offset_t));
+    memset(output->pattern_offsets, 0, input->num_patterns * sizeof(p61a_pattern_offset_t));
+
+    // encodings are chosen per pattern (all channels are fetched in the same frame), tracks are written per channel
+
+    size_t num_tracks = input->num_patterns * PT_NUM_CHANNELS;
+    p61a_track_source_t* sources = malloc(num_tracks * sizeof(p61a_track_source_t));
+    uint32_t* limits = malloc(input->num_patterns * sizeof(uint32_t));
+    p61a_track_t (*encodings)[TRACK_LEVELS] = malloc(PT_NUM_CHANNELS * sizeof(*encodings));
+    size_t over_budget = 0;
+
+    for (size_t i = 0; i < input->num_patterns; ++i)
+    {
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            p61a_track_source_t* source = &(sources[i * PT_NUM_CHANNELS + j]);
+            build_track(source->rows, protracker_get_pattern(input, i), j, usecode);
+
+            source->hash = hash_op((const uint8_t*)source->rows, sizeof(source->rows));
+
+            for (size_t k = 0; k < levels; ++k)
+            {
+                encode_track(&(encodings[j][k]), source->rows, (p61a_track_level_t)k, NULL, 0, j);
+            }
+        }
+
+        const p61a_track_t* chosen[PT_NUM_CHANNELS];
+        uint32_t cycles = choose_encodings(chosen, encodings, levels, max_cycles);
+
+        if (max_cycles && (cycles > max_cycles))
+        {
+            LOG_DEBUG(" - Pattern %lu needs an estimated %u cycles per frame.\n", i, cycles);
+            ++over_budget;
+        }
+
+        // sharing may not make a pattern more expensive than its own encodings allow
+        limits[i] = !max_cycles ? UINT32_MAX : (cycles > max_cycles ? cycles : (uint32_t)max_cycles);
+
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            sources[i * PT_NUM_CHANNELS + j].chosen = *chosen[j];
+        }
+    }
+
+    free(encodings);
+
+    if (over_budget)
+    {
+        LOG_WARN("%lu patterns exceed max_cycles=%lu with the cheapest encoding.\n", over_budget, max_cycles);
+    }
+
+    size_t* order = malloc(num_tracks * sizeof(size_t));
+    p61a_sharing_t sharing = { 0 };
+
+    // fixed order is channel-major, the greedy order is kept if it is smaller
+
+    for (size_t n = 0; n < num_tracks; ++n)
+    {
+        order[n] = fixed_track(n, num_tracks);
+    }
+
+    if (compress && num_tracks)
+    {
+        buffer_t fixed;
+        buffer_init(&fixed, 1);
+
+        size_t fixed_size = write_module_tracks(&fixed, sources, num_tracks, order, limits, true, &sharing);
+        p61a_sharing_t fixed_sharing = sharing;
+
+        size_t* offsets = malloc(num_tracks * sizeof(size_t));
+        for (size_t t = 0; t < num_tracks; ++t)
+        {
+            offsets[t] = sources[t].offset;
+        }
+
+        size_t* greedy = malloc(num_tracks * sizeof(size_t));
+        order_tracks(greedy, sources, num_tracks);
+
+        size_t size = write_module_tracks(&(output->patterns), sources, num_tracks, greedy, limits, true, &sharing);
+        LOG_DEBUG(" - Track order: %lu bytes, %ld bytes compared to the fixed order.\n", size, (long)size - (long)fixed_size);
+
+        bool keep_fixed = size > fixed_size;
+        if (keep_fixed)
+        {
+            buffer_reset(&(output->patterns));
+            buffer_add(&(output->patterns), buffer_get(&fixed, 0), fixed_size);
+            sharing = fixed_sharing;
+
+            for (size_t t = 0; t < num_tracks; ++t)
+            {
+                sources[t].offset = offsets[t];
+            }
+        }
+        sharing.order_saved = (int64_t)fixed_size - (int64_t)buffer_count(&(output->patterns));
+
+        // the order is chosen on the module's own tracks, then written again next to the shared ones
+        if (shared)
+        {
+            size_t before = buffer_count(shared->area);
+            int64_t order_saved = sharing.order_saved;
+            buffer_reset(&(output->patterns));
+            write_shared_tracks(shared, sources, num_tracks, keep_fixed ? order : greedy, limits, true, &sharing);
+            sharing.order_saved = order_saved;
+
+            LOG_DEBUG(" - %lu bytes added to the shared track area (%lu bytes on its own).\n",
+                buffer_count(shared->area) - before, keep_fixed ? fixed_size : size);
+            sharing.shared_saved = (int64_t)(keep_fixed ? fixed_size : size) - (int64_t)(buffer_count(shared->area) - before);
+        }
+
+        LOG_DEBUG(" - %lu identical tracks shared (%lu bytes), %lu bytes saved by jumps into other tracks, %lu bytes of both across channels.\n",
+            sharing.tracks, sharing.track_bytes, sharing.jump_bytes, sharing.cross_channel);
+
+        free(greedy);
+        free(offsets);
+        buffer_release(&fixed);
+    }
+    else if (shared)
+    {
+        write_shared_tracks(shared, sources, num_tracks, order, limits, compress, &sharing);
+    }
+    else
+    {
+        write_module_tracks(&(output->patterns), sources, num_tracks, order, limits, compress, &sharing);
+    }
+
+    // songs of a pack address their tracks from the base of the shared area
+    size_t base = shared ? shared->base : 0;
+    bool success = true;
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        if (sources[t].offset - base > 0xffff)
+        {
+            LOG_ERROR("Track area exceeds 64 KB, pattern %lu cannot be addressed.\n", t / PT_NUM_CHANNELS);
+            success = false;
+            break;
+        }
+        output->pattern_offsets[t / PT_NUM_CHANNELS].channels[t % PT_NUM_CHANNELS] = (uint16_t)(sources[t].offset - base);
+    }
+
+    free(order);
+    free(limits);
+    free(sources);
+
+    if (result)
+    {
+        *result = sharing;
+    }
+
+    return success;
+}
+
+typedef struct
+{
+    const uint32_t* cycles;
+    size_t num_patterns;
+    uint64_t total;
+} cycles_visitor_t;
+
+static void visit_row_cycles(const replay_t* replay, void* data)
+{
+    cycles_visitor_t* visitor = (cycles_visitor_t*)data;
+
+    // rows of patterns missing from the module are not fetched
+    if (replay->pattern < visitor->num_patterns)
+    {
+        visitor->total += visitor->cycles[replay->pattern * PT_PATTERN_ROWS + replay->row];
+    }
+}
+
+/**
+ *
+ * Estimate replay cycles per frame of encoded patterns
+ *
+**/
+static void estimate_cycles(p61a_cycles_t* result, const player61a_t* encoded, const protracker_t* module)
+{
+    size_t num_patterns = encoded->header.pattern_count;
+    uint32_t* cycles = calloc(num_patterns * PT_PATTERN_ROWS + 1, sizeof(uint32_t));
+
+    const uint8_t* data = buffer_count(&(encoded->patterns)) ? buffer_get(&(encoded->patterns), 0) : NULL;
+    size_t size = buffer_count(&(encoded->patterns));
+
+    for (size_t i = 0; i < num_patterns; ++i)
+    {
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            uint32_t track[PT_PATTERN_ROWS];
+            track_cycles(track, data, size, encoded->pattern_offsets[i].channels[j]);
+
+            for (size_t k = 0; k < PT_PATTERN_ROWS; ++k)
+            {
+                cycles[i * PT_PATTERN_ROWS + k] += track[k];
+            }
+        }
+    }
+
+    uint32_t worst = 0;
+    for (size_t i = 0; i < encoded->song.length; ++i)
+    {
+        size_t pattern = encoded->song.positions[i];
+        for (size_t k = 0; (pattern < num_patterns) && (k < PT_PATTERN_ROWS); ++k)
+        {
+            uint32_t row = cycles[pattern * PT_PATTERN_ROWS + k];
+            worst = row > worst ? row : worst;
+        }
+    }
+
+    cycles_visitor_t visitor = { cycles, num_patterns, 0 };
+    replay_visitor_t callbacks = { visit_row_cycles, NULL, &visitor };
+    replay_t replay;
+    replay_run(module, &callbacks, &replay);
+
+    result->worst = P61A_CYCLES_FRAME + worst;
+    result->average = P61A_CYCLES_FRAME + (replay.ticks ? (double)visitor.total / (double)replay.ticks : 0.0);
+
+    free(cycles);
+}
+
+static void player61a_create(player61a_t* module)
+{
+    memset(module, 0, sizeof(player61a_t));
+
+    buffer_init(&(module->patterns), 1);
+    buffer_init(&(module->samples), 1);
+}
+
+static void player61a_destroy(player61a_t* module)
+{
+    free(module->pattern_offsets);
+
+    buffer_release(&(module->patterns));
+    buffer_release(&(module->samples));
+}
+
+#if 0
+
+static int8_t deltas[] = {
+    0,1,2,4,8,16,32,64,128,-64,-32,-16,-8,-4,-2,-1
+};
+
+#endif
+
+static void write_song(buffer_t* buffer, const player61a_t* module, const char* options)
+{
+    size_t section = buffer_count(buffer);
+
+    if (has_option(options, "sign", false))
+    {
+        LOG_TRACE(" - Adding signature.\n");
+        buffer_add(buffer, signature, strlen(signature));
+    }
+
+    // header
+
+    {
+        p61a_header_t header;
+
+        header.sample_offset = end_htobe16(get_sample_offset(module));
+        header.pattern_count = module->header.pattern_count;
+        header.sample_count = module->header.sample_count;
+
+        buffer_add(buffer, &header, sizeof(header));
+    }
+
+    stats_size("p61a:header", buffer_count(buffer) - section);
+    section = buffer_count(buffer);
+
+    // sample headers
+
+    for (size_t i = 0; i < module->header.sample_count; ++i)
+    {
+        const p61a_sample_t* in = &(module->sample_headers[i]);
+        p61a_sample_t sample;
+
+        bool empty = in->length == 0;
+
+        if (!empty)
+        {
+            sample.length = end_htobe16(in->length);
+            sample.finetone = in->finetone;
+            sample.volume = in->volume;
+            sample.repeat_offset = end_htobe16(in->repeat_offset);
+        }
+        else
+        {
             sample.length = end_htobe16(1);
             sample.finetone = 0;
             sample.volume = 0;
@@ -525,6 +1888,9 @@ static void write_song(buffer_t* buffer, const player61a_t* module, const char*
         buffer_add(buffer, &sample, sizeof(sample));
     }
 
+    stats_size("p61a:sample_headers", buffer_count(buffer) - section);
+    section = buffer_count(buffer);
+
     // pattern offsets
 
     for (size_t i = 0; i < module->header.pattern_count; ++i)
@@ -538,6 +1904,9 @@ static void write_song(buffer_t* buffer, const player61a_t* module, const char*
         buffer_add(buffer, &offset, sizeof(offset));
     }
 
+    stats_size("p61a:pattern_offsets", buffer_count(buffer) - section);
+    section = buffer_count(buffer);
+
     // tune positions
 
     {
@@ -547,6 +1916,9 @@ static void write_song(buffer_t* buffer, const player61a_t* module, const char*
         buffer_add(buffer, &temp, sizeof(temp));
     }
 
+    stats_size("p61a:positions", buffer_count(buffer) - section);
+    section = buffer_count(buffer);
+
     // tracks
 
     size_t pattern_size = buffer_count(&(module->patterns));
@@ -562,6 +1934,8 @@ static void write_song(buffer_t* buffer, const player61a_t* module, const char*
         uint8_t c = 0;
         buffer_add(buffer, &c, 1);
     }
+
+    stats_size("p61a:tracks", buffer_count(buffer) - section);
 }
 
 static void write_samples(buffer_t* buffer, const player61a_t* module)
@@ -571,23 +1945,50 @@ static void write_samples(buffer_t* buffer, const player61a_t* module)
     {
         buffer_add(buffer, buffer_get(&(module->samples), 0), size);
     }
+
+    stats_size("p61a:samples", size);
 }
 
 bool player61a_convert(buffer_t* buffer, const protracker_t* module, const char* options)
 {
     LOG_INFO("Converting to The Player 6.1A...\n");
 
+    init_tables();
+
     player61a_t temp;
     player61a_create(&temp);
     uint32_t usecode = 0;
 
-    build_samples(&temp, module, options, &usecode);
-    build_patterns(&temp, module, options, &usecode);
+    stats_timer_t timer;
 
-    LOG_TRACE("usecode: %08x\n", usecode);
+    stats_start(&timer);
+    build_samples(&temp, module, options, &usecode);
+    stats_stop(&timer, "build_samples");
 
+    // tracks are only part of the song data
     if (has_option(options, "song", true))
     {
+        stats_start(&timer);
+        p61a_sharing_t sharing;
+        if (!build_patterns(&temp, module, options, &usecode, NULL, &sharing))
+        {
+            player61a_destroy(&temp);
+            return false;
+        }
+        stats_stop(&timer, "build_patterns");
+
+        stats_size("p61a:track_order_saved", sharing.order_saved);
+        stats_size("p61a:cross_channel_saved", sharing.cross_channel);
+
+        LOG_TRACE("usecode: %08x\n", usecode);
+
+        if (LOG_ENABLED(LOG_LEVEL_DEBUG))
+        {
+            p61a_cycles_t cycles;
+            estimate_cycles(&cycles, &temp, module);
+            LOG_DEBUG(" - Estimated replay cost: %u cycles per frame (worst), %.0f (average).\n", cycles.worst, cycles.average);
+        }
+
         LOG_DEBUG(" - Writing song data...\n");
         write_song(buffer, &temp, options);
     }
@@ -603,6 +2004,364 @@ bool player61a_convert(buffer_t* buffer, const protracker_t* module, const char*
     return true;
 }
 
+typedef struct
+{
+    uint8_t channels;
+    bool tempo;
+} config_scan_t;
+
+static void scan_config(const protracker_channel_t* channel, uint8_t index, void* data)
+{
+    config_scan_t* scan = (config_scan_t*)data;
+
+    if (channel->data[0] || channel->data[1] || channel->data[2] || channel->data[3])
+    {
+        scan->channels |= 1u << index;
+    }
+
+    protracker_effect_t effect = protracker_get_effect(channel);
+    if ((effect.cmd == PT_CMD_SET_SPEED) && (effect.data.value >= 0x20))
+    {
+        scan->tempo = true;
+    }
+}
+
+void player61a_estimate_cycles(p61a_cycles_t* cycles, const protracker_t* module, const char* options)
+{
+    init_tables();
+
+    player61a_t temp;
+    player61a_create(&temp);
+
+    uint32_t usecode = 0;
+    build_patterns(&temp, module, options, &usecode, NULL, NULL);
+    estimate_cycles(cycles, &temp, module);
+
+    player61a_destroy(&temp);
+}
+
+void player61a_get_config(p61a_config_t* config, const protracker_t* module, const char* options)
+{
+    init_tables();
+
+    // the usecode is collected from the samples and rows exactly as the converter does, tracks are not encoded
+    player61a_t temp;
+    player61a_create(&temp);
+
+    uint32_t usecode = 0;
+    build_samples(&temp, module, "-samples", &usecode);
+
+    player61a_destroy(&temp);
+
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        const protracker_pattern_t* pattern = protracker_get_pattern(module, i);
+        for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
+        {
+            p61a_channel_t rows[PT_PATTERN_ROWS];
+            build_track(rows, pattern, j, &usecode);
+        }
+    }
+
+    config_scan_t scan = { 0, false };
+    protracker_scan_notes(module, scan_config, &scan);
+
+    memset(config, 0, sizeof(p61a_config_t));
+    config->usecode = usecode;
+    config->channels = scan.channels;
+    config->finetune = (usecode & 1) != 0;
+    config->tempo = scan.tempo;
+    config->packed = false;     // samples are written unpacked (see build_samples)
+    config->samples = has_option(options, "samples", true);
+    config->modules = 1;
+
+    LOG_DEBUG("Replayer configuration: usecode $%08x, channels %x\n", config->usecode, config->channels);
+}
+
+void player61a_merge_config(p61a_config_t* config, const p61a_config_t* other)
+{
+    config->usecode |= other->usecode;
+    config->channels |= other->channels;
+    config->finetune = config->finetune || other->finetune;
+    config->tempo = config->tempo || other->tempo;
+    config->packed = config->packed || other->packed;
+    config->samples = config->samples || other->samples;
+    config->modules += other->modules;
+}
+
+void player61a_write_config(buffer_t* buffer, const p61a_config_t* config)
+{
+    size_t channels = 0;
+    for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+    {
+        channels += (config->channels >> i) & 1;
+    }
+
+    char text[1024];
+    int length = snprintf(text, sizeof(text),
+        "; The Player 6.1A configuration for %lu module(s), generated by modpack\n"
+        "\n"
+        "usecode\t\tequ\t$%08x\t; effect handlers used\n"
+        "p61_channels\tequ\t%lu\t\t; channels with pattern data\n"
+        "p61_chanmask\tequ\t%%%u%u%u%u\t\t; channel 4-1\n"
+        "p61_finetune\tequ\t%u\t\t; samples with finetune\n"
+        "p61_tempo\tequ\t%u\t\t; Fxx tempo (CIA timing)\n"
+        "p61_packed\tequ\t%u\t\t; packed samples\n"
+        "p61_samples\tequ\t%u\t\t; samples included in module\n",
+        config->modules,
+        config->usecode,
+        channels,
+        (config->channels >> 3) & 1, (config->channels >> 2) & 1, (config->channels >> 1) & 1, config->channels & 1,
+        config->finetune, config->tempo, config->packed, config->samples);
+
+    buffer_add(buffer, text, (size_t)length < sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t offset;        // offset in the bank
+    uint32_t length;        // bytes
+    uint32_t next;          // earlier sample in the same bucket (index + 1, 0 = none)
+} p61a_bank_sample_t;
+
+#define P61A_PACK_SIGNATURE "P61P"
+#define P61A_PACK_NO_SAMPLE (0xffff)
+
+static const uint16_t pack_no_sample = P61A_PACK_NO_SAMPLE;
+
+void player61a_pack_init(p61a_pack_t* pack)
+{
+    memset(pack, 0, sizeof(p61a_pack_t));
+
+    buffer_init(&(pack->bank), 1);
+    buffer_init(&(pack->samples), sizeof(p61a_bank_sample_t));
+    buffer_init(&(pack->songs), 1);
+    buffer_init(&(pack->song_offsets), sizeof(uint32_t));
+    buffer_init(&(pack->tracks), 1);
+}
+
+void player61a_pack_release(p61a_pack_t* pack)
+{
+    if (pack->track_store)
+    {
+        store_release(pack->track_store);
+        free(pack->track_store);
+    }
+    free(pack->buckets);
+
+    buffer_release(&(pack->bank));
+    buffer_release(&(pack->samples));
+    buffer_release(&(pack->songs));
+    buffer_release(&(pack->song_offsets));
+    buffer_release(&(pack->tracks));
+
+    memset(pack, 0, sizeof(p61a_pack_t));
+}
+
+static void pack_link_sample(p61a_pack_t* pack, size_t index)
+{
+    p61a_bank_sample_t* sample = buffer_get(&(pack->samples), index);
+    uint32_t* bucket = &(pack->buckets[sample->hash & (pack->bucket_count - 1)]);
+
+    sample->next = *bucket;
+    *bucket = (uint32_t)(index + 1);
+}
+
+// index of identical sample data in the bank, added if not there yet
+static size_t pack_sample(p61a_pack_t* pack, const uint8_t* data, size_t length)
+{
+    uint32_t hash = hash_op(data, length);
+
+    for (uint32_t i = pack->buckets[hash & (pack->bucket_count - 1)]; i; )
+    {
+        const p61a_bank_sample_t* sample = buffer_get(&(pack->samples), i - 1);
+        if ((sample->hash == hash) && (sample->length == length) && !memcmp(buffer_get(&(pack->bank), sample->offset), data, length))
+        {
+            return i - 1;
+        }
+        i = sample->next;
+    }
+
+    size_t index = buffer_count(&(pack->samples));
+    p61a_bank_sample_t* sample = buffer_alloc(&(pack->samples), 1);
+
+    sample->hash = hash;
+    sample->offset = (uint32_t)buffer_count(&(pack->bank));
+    sample->length = (uint32_t)length;
+    buffer_add(&(pack->bank), data, length);
+
+    // grow with the number of samples, so lookups stay constant time
+    if ((index + 1) * 2 > pack->bucket_count)
+    {
+        free(pack->buckets);
+        pack->bucket_count *= 2;
+        pack->buckets = calloc(pack->bucket_count, sizeof(uint32_t));
+
+        for (size_t i = 0; i <= index; ++i)
+        {
+            pack_link_sample(pack, i);
+        }
+    }
+    else
+    {
+        pack_link_sample(pack, index);
+    }
+
+    return index;
+}
+
+bool player61a_pack_add(p61a_pack_t* pack, const protracker_t* module, const char* options)
+{
+    LOG_INFO("Adding module to P61A pack...\n");
+
+    init_tables();
+
+    if (!pack->buckets)
+    {
+        pack->bucket_count = 64;
+        pack->buckets = calloc(pack->bucket_count, sizeof(uint32_t));
+
+        pack->track_store = malloc(sizeof(p61a_track_store_t));
+        store_init(pack->track_store, &(pack->tracks), true);
+    }
+
+    player61a_t temp;
+    player61a_create(&temp);
+    uint32_t usecode = 0;
+
+    build_samples(&temp, module, "samples", &usecode);
+
+    p61a_sharing_t sharing;
+    if (!build_patterns(&temp, module, options, &usecode, pack->track_store, &sharing))
+    {
+        player61a_destroy(&temp);
+        return false;
+    }
+
+    stats_size("p61a:track_order_saved", sharing.order_saved);
+    stats_size("p61a:cross_channel_saved", sharing.cross_channel);
+    stats_size("p61a:shared_tracks_saved", sharing.shared_saved);
+
+    size_t section = buffer_count(&(pack->songs));
+    *(uint32_t*)buffer_alloc(&(pack->song_offsets), 1) = (uint32_t)section;
+
+    uint32_t base = end_htobe32((uint32_t)pack->track_store->base);
+    buffer_add(&(pack->songs), &base, sizeof(base));
+
+    uint16_t count = end_htobe16(temp.header.sample_count);
+    buffer_add(&(pack->songs), &count, sizeof(count));
+
+    // sample data was gathered for used samples in sample order (see build_samples)
+    const uint8_t* data = buffer_count(&(temp.samples)) ? buffer_get(&(temp.samples), 0) : NULL;
+    size_t offset = 0;
+    size_t shared = 0;
+
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        size_t length = temp.sample_headers[i].length * 2;
+        if (i >= temp.header.sample_count)
+        {
+            offset += length;
+            continue;
+        }
+
+        if (!length)
+        {
+            buffer_add(&(pack->songs), &pack_no_sample, sizeof(pack_no_sample));
+            continue;
+        }
+
+        size_t samples = buffer_count(&(pack->samples));
+        size_t bank_index = pack_sample(pack, data + offset, length);
+        shared += (bank_index < samples) ? length : 0;
+        offset += length;
+
+        uint16_t value = end_htobe16((uint16_t)bank_index);
+        buffer_add(&(pack->songs), &value, sizeof(value));
+
+        pack->sample_count++;
+        pack->sample_bytes += length;
+    }
+
+    write_song(&(pack->songs), &temp, options);
+    pack->modules++;
+
+    LOG_DEBUG(" - %lu bytes of sample data already in the bank.\n", shared);
+
+    player61a_destroy(&temp);
+
+    return true;
+}
+
+void player61a_pack_write(buffer_t* buffer, const p61a_pack_t* pack)
+{
+    size_t start = buffer_count(buffer);
+    size_t samples = buffer_count(&(pack->samples));
+    size_t songs_size = buffer_count(&(pack->songs));
+    size_t tracks_size = buffer_count(&(pack->tracks));
+    size_t bank_size = buffer_count(&(pack->bank));
+
+    // song sections are word aligned, the track area is padded for the bank
+    size_t directory = 4 + 2 + 2 + 4 + 4 + (pack->modules + samples) * sizeof(uint32_t);
+    size_t tracks = directory + songs_size;
+    size_t bank = tracks + tracks_size + (tracks_size & 1);
+
+    buffer_add(buffer, P61A_PACK_SIGNATURE, 4);
+
+    uint16_t value16 = end_htobe16((uint16_t)pack->modules);
+    buffer_add(buffer, &value16, sizeof(value16));
+    value16 = end_htobe16((uint16_t)samples);
+    buffer_add(buffer, &value16, sizeof(value16));
+
+    uint32_t value32 = end_htobe32((uint32_t)tracks);
+    buffer_add(buffer, &value32, sizeof(value32));
+    value32 = end_htobe32((uint32_t)bank);
+    buffer_add(buffer, &value32, sizeof(value32));
+
+    for (size_t i = 0; i < pack->modules; ++i)
+    {
+        value32 = end_htobe32((uint32_t)(directory + *(const uint32_t*)buffer_get(&(pack->song_offsets), i)));
+        buffer_add(buffer, &value32, sizeof(value32));
+    }
+
+    for (size_t i = 0; i < samples; ++i)
+    {
+        const p61a_bank_sample_t* sample = buffer_get(&(pack->samples), i);
+        value32 = end_htobe32(sample->offset);
+        buffer_add(buffer, &value32, sizeof(value32));
+    }
+
+    if (songs_size)
+    {
+        buffer_add(buffer, buffer_get(&(pack->songs), 0), songs_size);
+    }
+
+    if (tracks_size)
+    {
+        buffer_add(buffer, buffer_get(&(pack->tracks), 0), tracks_size);
+    }
+    if (tracks_size & 1)
+    {
+        uint8_t c = 0;
+        buffer_add(buffer, &c, 1);
+    }
+
+    if (bank_size)
+    {
+        buffer_add(buffer, buffer_get(&(pack->bank), 0), bank_size);
+    }
+
+    LOG_INFO("P61A pack: %lu modules, %lu bytes of tracks, %lu unique of %lu samples, %lu bytes of sample data (%lu bytes shared).\n",
+        pack->modules, tracks_size, samples, pack->sample_count, bank_size, pack->sample_bytes - bank_size);
+
+    stats_size("p61a-pack:songs", songs_size);
+    stats_size("p61a-pack:tracks", tracks_size);
+    stats_size("p61a-pack:bank", bank_size);
+    stats_size("saved:p61a-pack", pack->sample_bytes - bank_size);
+    stats_size("output:p61a-pack", buffer_count(buffer) - start);
+}
+
 static const uint8_t* read_sample_headers(p61a_sample_t* sample_headers, size_t sample_count, const uint8_t* curr, const uint8_t* max)
 {
     LOG_TRACE("Samples:\n");
@@ -692,100 +2451,275 @@ static const uint8_t* read_song_positions(p61a_song_t* song, const uint8_t* curr
     return curr;
 }
 
-static size_t decompress_track(p61a_pattern_t* pattern, size_t channel_index, size_t offset, size_t maxrows, const uint8_t* track, bool deref, const uint8_t* base)
+static void trace_channel(const protracker_channel_t* channel)
+{
+    char buf[32];
+    protracker_channel_to_text(channel, buf, sizeof(buf));
+
+    LOG_TRACE(" %s", buf);
+}
+
+#define P61A_MAX_JUMP_DEPTH     (16)    // nested jumps allowed while decoding a track
+#define P61A_MAX_TRACK_STEPS    (4096)  // instructions allowed per track (guards against jump cycles)
+#define P61A_PARALLEL_PATTERNS  (32)    // decode patterns in parallel from this count on (when built with OpenMP)
+
+typedef struct
+{
+    protracker_channel_t channel;   // decoded channel data
+    uint8_t opcode;         // first byte of the instruction
+    uint8_t length;         // instruction length in bytes (0 = not decoded yet)
+    uint8_t compression;    // compression info (when CHANNEL_COMPRESSED is set)
+    uint16_t target;        // jump target (track area offset)
+} p61a_op_t;
+
+typedef struct
+{
+    const uint8_t* data;    // track area (starts at the first track)
+    size_t size;
+    p61a_op_t* ops;         // decoded instruction per byte offset, filled by validate_track()
+} p61a_tracks_t;
+
+typedef struct
 {
-    LOG_TRACE("decompress_track(%lu, %lu%s)\n", offset, maxrows, deref ? ", deref" : "");
+    size_t position;
+    size_t remaining;       // instructions left in a jump (0 = until the track is complete)
+} p61a_frame_t;
+
+/**
+ *
+ * Decode the instruction at a track offset into the instruction cache, checking it against the track area
+ *
+**/
+static bool decode_op(p61a_tracks_t* tracks, size_t position)
+{
+    p61a_op_t* op = &(tracks->ops[position]);
+    if (op->length)
+    {
+        return true;
+    }
+
+    const uint8_t* curr = tracks->data + position;
+    size_t available = tracks->size - position;
+
+    uint8_t c0 = *curr;
+    size_t length = get_channel_length(&(p61a_channel_t){ { c0, 0, 0 } });
+    if (available < length)
+    {
+        return false;
+    }
+
+    p61a_channel_t channel = { 0 };
+    memcpy(channel.data, curr, length);
 
-    while(offset < PT_PATTERN_ROWS)
+    memset(op, 0, sizeof(p61a_op_t));
+    op->opcode = c0;
+    to_protracker_channel(&(op->channel), &channel);
+
+    if (c0 & CHANNEL_COMPRESSED)
     {
-        uint8_t c0 = *track++, c1 = 0, c2 = 0;
-        p61a_channel_t out = { 0 };
+        if (available < length + 1)
+        {
+            return false;
+        }
+
+        uint8_t d0 = curr[length++];
+        op->compression = d0;
 
-        if ((c0 & CHANNEL_EMPTY) == CHANNEL_EMPTY)
+        if (d0 & COMPRESSION_JUMP)
         {
-            LOG_TRACE(" %02lu %04x: %02x    ", offset, ((track-1)-base) & 0xffff, c0);
-            if (!(c0 & CHANNEL_COMPRESSED))
+            size_t bytes = (d0 & COMPRESSION_JUMP_LONG) ? 2 : 1;
+            if (available < length + bytes)
+            {
+                return false;
+            }
+
+            uint16_t dist = curr[length];
+            if (bytes > 1)
+            {
+                dist = (dist << 8) | curr[length+1];
+            }
+            length += bytes;
+
+            if (dist > position + length)
             {
-                ++offset;
+                return false;
             }
+
+            op->target = (uint16_t)(position + length - dist);
         }
-        else if ((c0 & CHANNEL_NOTE_INSTRUMENT) == CHANNEL_NOTE_INSTRUMENT)
-        {
-            out.data[0] = c0;
-            out.data[1] = c1 = *track++;
+    }
+
+    op->length = (uint8_t)length;
+    return true;
+}
+
+/**
+ *
+ * Rows covered by a decoded instruction, not counting jumps
+ *
+**/
+static size_t op_rows(const p61a_op_t* op)
+{
+    size_t rows = (op->opcode == (CHANNEL_EMPTY|CHANNEL_COMPRESSED)) ? 0 : 1;
+
+    if (!(op->compression & COMPRESSION_JUMP))
+    {
+        rows += op->compression & COMPRESSION_DATA_BITS;
+    }
+
+    return rows;
+}
+
+/**
+ *
+ * Walk a track once with full bounds checking, filling the instruction cache
+ *
+ * Every instruction reachable from the track (including jump targets) is decoded exactly once
+ * over all tracks, so decompress_track() can run without any checks afterwards.
+ *
+**/
+static bool validate_track(p61a_tracks_t* tracks, size_t start, size_t pattern_index, size_t channel_index)
+{
+    if (start >= tracks->size)
+    {
+        LOG_ERROR("Track offset $%04lx of pattern %lu, channel %lu is outside of pattern data.\n", start, pattern_index, channel_index);
+        return false;
+    }
+
+    p61a_frame_t stack[P61A_MAX_JUMP_DEPTH];
+    size_t depth = 0;
 
-            LOG_TRACE(" %02lu %04x: %02x%02x  ", offset, ((track-2)-base) & 0xffff, c0, c1);
+    stack[0].position = start;
+    stack[0].remaining = 0;
+
+    size_t row = 0;
+    for (size_t steps = 0; row < PT_PATTERN_ROWS; ++steps)
+    {
+        p61a_frame_t* frame = &(stack[depth]);
 
-            pattern->rows[offset++].channels[channel_index] = out;
+        if (steps == P61A_MAX_TRACK_STEPS)
+        {
+            LOG_ERROR("Track of pattern %lu, channel %lu does not terminate.\n", pattern_index, channel_index);
+            return false;
         }
-        else if ((c0 & CHANNEL_COMMAND) == CHANNEL_COMMAND)
+
+        if ((frame->position >= tracks->size) || !decode_op(tracks, frame->position))
         {
-            out.data[0] = c0;
-            out.data[1] = c1 = *track++;
+            LOG_ERROR("Premature end of pattern data in pattern %lu, channel %lu (offset $%04lx).\n", pattern_index, channel_index, frame->position);
+            return false;
+        }
 
-            LOG_TRACE(" %02lu %04x: %02x%02x  ", offset, ((track-2)-base) & 0xffff, c0, c1);
+        const p61a_op_t* op = &(tracks->ops[frame->position]);
+        frame->position += op->length;
 
-            pattern->rows[offset++].channels[channel_index] = out;
-        }
-        else
+        row += op_rows(op);
+
+        bool done = frame->remaining && (--frame->remaining == 0);
+
+        if ((op->opcode & CHANNEL_COMPRESSED) && (op->compression & COMPRESSION_JUMP))
         {
-            out.data[0] = c0;
-            out.data[1] = c1 = *track++;
-            out.data[2] = c2 = *track++;
+            if (!done)
+            {
+                if (++depth == P61A_MAX_JUMP_DEPTH)
+                {
+                    LOG_ERROR("Too many nested jumps in pattern %lu, channel %lu.\n", pattern_index, channel_index);
+                    return false;
+                }
+            }
+
+            stack[depth].position = op->target;
+            stack[depth].remaining = (op->compression & COMPRESSION_DATA_BITS) + 1;
+            continue;
+        }
 
-            LOG_TRACE(" %02lu %04x: %02x%02x%02x", offset, ((track-3)-base) & 0xffff, c0, c1, c2);
+        while (done)
+        {
+            if (!depth)
+            {
+                return true;
+            }
 
-            pattern->rows[offset++].channels[channel_index] = out;
+            --depth;
+            done = false;
         }
+    }
+
+    return true;
+}
+
+/**
+ *
+ * Decode a validated track into a pattern
+ *
+**/
+static void decompress_track(protracker_pattern_t* pattern, size_t channel_index, const p61a_tracks_t* tracks, size_t start)
+{
+    LOG_TRACE("decompress_track(%04lx)\n", start);
+
+    p61a_frame_t stack[P61A_MAX_JUMP_DEPTH];
+    size_t depth = 0;
 
-        protracker_channel_t ptc;
+    stack[0].position = start;
+    stack[0].remaining = 0;
 
-        to_protracker_channel(&ptc, &out);
+    size_t row = 0;
+    while (row < PT_PATTERN_ROWS)
+    {
+        p61a_frame_t* frame = &(stack[depth]);
+        const p61a_op_t* op = &(tracks->ops[frame->position]);
+
+        if (LOG_ENABLED(LOG_LEVEL_TRACE))
+        {
+            LOG_TRACE(" %02lu %04lx:", row, frame->position);
+            for (size_t i = 0; i < op->length; ++i)
+            {
+                LOG_TRACE("%02x", tracks->data[frame->position + i]);
+            }
+            trace_channel(&(op->channel));
+        }
 
-        char buf[32];
-        protracker_channel_to_text(&ptc, buf, sizeof(buf));
+        frame->position += op->length;
+
+        uint8_t c0 = op->opcode;
+        if (c0 != (CHANNEL_EMPTY|CHANNEL_COMPRESSED))
+        {
+            pattern->rows[row++].channels[channel_index] = op->channel;
+        }
 
-        LOG_TRACE(" %s", buf);
+        bool done = frame->remaining && (--frame->remaining == 0);
 
         if (c0 & CHANNEL_COMPRESSED)
         {
-            uint8_t d0 = *track++;
-            LOG_TRACE(" %02x", d0);
+            uint8_t d0 = op->compression;
+            uint8_t rows = d0 & COMPRESSION_DATA_BITS;
 
             if (d0 & COMPRESSION_JUMP)
             {
-                uint8_t rows = (d0 & COMPRESSION_DATA_BITS) + 1;
-                uint16_t dist = *track++;
-                LOG_TRACE("%02x", dist);
-                if (d0 & COMPRESSION_JUMP_LONG)
+                LOG_TRACE(" (%s JUMP %u %04x)\n", (d0 & COMPRESSION_JUMP_LONG) ? "LONG" : "SHORT", rows + 1, op->target);
+
+                if (!done)
                 {
-                    uint8_t d2 = *track++;
-                    LOG_TRACE("%02x", d2);
-                    dist = (dist << 8)|d2;
+                    ++depth;
                 }
 
-                LOG_TRACE(" (%s JUMP %u %04x)\n", (d0 & COMPRESSION_JUMP_LONG) ? "LONG" : "SHORT", rows, dist);
-
-                offset = decompress_track(pattern, channel_index, offset, rows, track - dist, true, base);
+                stack[depth].position = op->target;
+                stack[depth].remaining = rows + 1;
+                continue;
             }
             else if (d0 & COMPRESSION_REPEAT_ROWS)
             {
-                uint8_t rows = (d0 & COMPRESSION_DATA_BITS);
-
                 LOG_TRACE(" (REPEAT %d)\n", rows);
 
-                for (size_t i = 0; i < rows; ++i)
+                for (size_t i = 0; i < rows && row < PT_PATTERN_ROWS; ++i)
                 {
-                    pattern->rows[offset++].channels[channel_index] = out;
+                    pattern->rows[row++].channels[channel_index] = op->channel;
                 }
             }
-            else if ((d0 & COMPRESSION_CMD_BITS) == COMPRESSION_EMPTY_ROWS)
+            else
             {
-                uint8_t rows = (d0 & COMPRESSION_DATA_BITS);
-
                 LOG_TRACE(" (EMPTY %d)\n", rows);
 
-                offset += rows;
+                row += rows;
             }
         }
         else
@@ -793,43 +2727,106 @@ static size_t decompress_track(p61a_pattern_t* pattern, size_t channel_index, si
             LOG_TRACE("\n");
         }
 
-        if (maxrows > 0 && ((--maxrows) == 0))
+        if (done)
         {
-            break;
+            if (!depth)
+            {
+                break;
+            }
+
+            --depth;
         }
     }
 
-    LOG_TRACE(" - DONE (%lu)\n", offset);
-
-    return offset;
+    LOG_TRACE(" - DONE (%lu)\n", row);
 }
 
-static const uint8_t* read_patterns(p61a_pattern_t* patterns, p61a_pattern_offset_t* pattern_offsets, size_t pattern_count, const uint8_t* curr, const uint8_t* max)
+typedef struct
 {
-    for (size_t i = 0; i < pattern_count; ++i)
+    p61a_tracks_t tracks;                   // points into the copied track area
+    p61a_pattern_offset_t offsets[256];
+} p61a_source_t;
+
+/**
+ *
+ * Decode patterns on demand (protracker_source_t callback)
+ *
+ * All tracks of the requested patterns are validated first, invalid patterns are left empty.
+ *
+**/
+static bool read_patterns(void* context, protracker_pattern_t* patterns, size_t first, size_t count)
+{
+    p61a_source_t* source = context;
+    p61a_tracks_t* tracks = &(source->tracks);
+
+    if (!tracks->ops)
+    {
+        tracks->ops = calloc(tracks->size ? tracks->size : 1, sizeof(p61a_op_t));
+        if (!tracks->ops)
+        {
+            LOG_ERROR("Failed to allocate instruction cache.\n");
+            return false;
+        }
+    }
+
+    bool valid = true;
+    bool pattern_valid[count];
+    for (size_t i = 0; i < count; ++i)
+    {
+        pattern_valid[i] = true;
+        for (size_t j = 0; j < PT_NUM_CHANNELS && pattern_valid[i]; ++j)
+        {
+            pattern_valid[i] = validate_track(tracks, source->offsets[first + i].channels[j], first + i, j);
+        }
+        valid = valid && pattern_valid[i];
+    }
+
+    // decoding only reads the instruction cache, so patterns are independent (trace output must stay in order)
+    bool trace = LOG_ENABLED(LOG_LEVEL_TRACE);
+
+#if defined(_OPENMP)
+    #pragma omp parallel for schedule(static) if(!trace && count >= P61A_PARALLEL_PATTERNS)
+#endif
+    for (size_t i = 0; i < count; ++i)
     {
-        p61a_pattern_t* pattern = &(patterns[i]);
-        const p61a_pattern_offset_t* offsets = &(pattern_offsets[i]);
+        size_t index = first + i;
+        protracker_pattern_t* pattern = &(patterns[index]);
+
+        memset(pattern, 0, sizeof(protracker_pattern_t));
+        if (!pattern_valid[i])
+        {
+            continue;
+        }
 
         for (size_t j = 0; j < PT_NUM_CHANNELS; ++j)
         {
-            size_t current_row = 0;
-            const uint8_t* track = curr + offsets->channels[j];
+            LOG_TRACE("Pattern #%lu, track #%lu:\n", index, j);
 
-            LOG_TRACE("Pattern #%lu, track #%lu:\n", i,j);
+            decompress_track(pattern, j, tracks, source->offsets[index].channels[j]);
+        }
 
-            decompress_track(pattern, j, 0, 0, curr + offsets->channels[j], false, curr + offsets->channels[j]);
+        if (trace)
+        {
+            protracker_trace_pattern(pattern, index);
         }
     }
 
-    return curr;
+    return valid;
+}
+
+static void release_source(void* context)
+{
+    p61a_source_t* source = context;
+
+    free(source->tracks.ops);
+    free(source);
 }
 
 protracker_t* player61a_load(const buffer_t* buffer)
 {
     LOG_DEBUG("Loading Player 6.1A module...\n");
 
-    p61a_pattern_t* patterns = NULL;
+    init_tables();
 
     protracker_t module;
     protracker_create(&module);
@@ -904,13 +2901,38 @@ protracker_t* player61a_load(const buffer_t* buffer)
 
         // patterns
 
-        p61a_pattern_t* patterns = malloc(sizeof(p61a_pattern_t) * header.pattern_count);
-        memset(patterns, 0, sizeof(p61a_pattern_t) * header.pattern_count);
-        if (!(curr = read_patterns(patterns, pattern_offsets, header.pattern_count, curr, max)))
+        // tracks end where sample data begins
+
+        const uint8_t* tracks_end = raw + header.sample_offset;
+        if (tracks_end < curr || tracks_end > max)
+        {
+            tracks_end = max;
+        }
+
+        // tracks are decoded on first access, keep a copy of the track area
+
+        size_t tracks_size = tracks_end - curr;
+        p61a_source_t* source = malloc(sizeof(p61a_source_t) + tracks_size);
+        module.source = calloc(1, sizeof(protracker_source_t));
+        module.patterns = calloc(header.pattern_count, sizeof(protracker_pattern_t));
+        if (!source || !module.source || !module.patterns)
         {
+            LOG_ERROR("Failed to allocate pattern data.\n");
+            free(source);
             break;
         }
 
+        memset(source, 0, sizeof(p61a_source_t));
+        memcpy(source->offsets, pattern_offsets, sizeof(p61a_pattern_offset_t) * header.pattern_count);
+        memcpy(source + 1, curr, tracks_size);
+        source->tracks.data = (const uint8_t*)(source + 1);
+        source->tracks.size = tracks_size;
+
+        module.source->context = source;
+        module.source->decode = read_patterns;
+        module.source->release = release_source;
+        module.num_patterns = header.pattern_count;
+
         // PT: header
 
         for (size_t i = 0; i < header.sample_count; ++i)
@@ -940,71 +2962,432 @@ protracker_t* player61a_load(const buffer_t* buffer)
         module.song.restart_position = 127;
         memcpy(module.song.positions, song.positions, song.length);
 
-        // PT: Patterns
+        // PT: Sample Data
 
-        module.patterns = malloc(sizeof(protracker_pattern_t) * header.pattern_count);
-        module.num_patterns = header.pattern_count;
+        const uint8_t* samples = raw + header.sample_offset;
+
+        size_t sample_bytes = 0;
+        for (size_t i = 0; i < header.sample_count; ++i)
+        {
+            sample_bytes += sample_headers[i].length * 2;
+        }
 
-        for (size_t i = 0; i < header.pattern_count; ++i)
+        if ((samples > max) || ((size_t)(max - samples) < sample_bytes))
         {
-            const p61a_pattern_t* in_pattern = &(patterns[i]);
-            protracker_pattern_t* out_pattern = &(module.patterns[i]);
+            LOG_ERROR("Premature end of data in sample data.\n");
+            break;
+        }
 
-            LOG_TRACE("Pattern #%lu:\n", i);
+        // record extents and keep the sample area in one block, samples are never copied one by one
 
-            for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+        if (sample_bytes > 0)
+        {
+            module.sample_source = malloc(sample_bytes);
+            if (!module.sample_source)
             {
-                const p61a_pattern_row_t* in_row = &(in_pattern->rows[j]);
-                protracker_pattern_row_t* out_row = &(out_pattern->rows[j]);
+                LOG_ERROR("Failed to allocate sample data.\n");
+                break;
+            }
 
-                LOG_TRACE("%02lu:", j);
+            memcpy(module.sample_source, samples, sample_bytes);
+        }
 
-                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
-                {
-                    const p61a_channel_t* in = &(in_row->channels[k]);
-                    protracker_channel_t* out = &(out_row->channels[k]);
+        for (size_t i = 0, offset = 0; i < header.sample_count; ++i)
+        {
+            module.sample_offsets[i] = (uint32_t)offset;
+            offset += sample_headers[i].length * 2;
+        }
 
-                    to_protracker_channel(out, in);
+        protracker_t* out = malloc(sizeof(protracker_t));
+        *out = module;
 
-                    char buf[32];
-                    protracker_channel_to_text(out, buf, sizeof(buf));
+        return out;
+    }
+    while (false);
 
-                    LOG_TRACE(" %s", buf);
-                }
+    protracker_destroy(&module);
 
-                LOG_TRACE("\n");
-            }
+    return NULL;
+}
+
+static uint16_t read_be16(const uint8_t* data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+unsigned player61a_sniff(const uint8_t* data, size_t size, size_t file_size)
+{
+    size_t signature_length = strlen(signature);
+    bool signed_module = (size >= signature_length) && !memcmp(signature, data, signature_length);
+    if (signed_module)
+    {
+        data += signature_length;
+        size -= signature_length;
+        file_size -= signature_length;
+    }
+
+    // without the signature there is no magic, every table has to be plausible
+
+    if (size < sizeof(p61a_header_t))
+    {
+        return 0;
+    }
+
+    size_t sample_offset = read_be16(data);
+    size_t pattern_count = data[2];
+    size_t sample_count = data[3];
+
+    size_t tables_size = sizeof(p61a_header_t) + sizeof(p61a_sample_t) * sample_count + sizeof(p61a_pattern_offset_t) * pattern_count;
+    if (!pattern_count || (sample_count > PT_NUM_SAMPLES) || (sample_offset <= tables_size) || (sample_offset > file_size) || (size < tables_size))
+    {
+        return 0;
+    }
+
+    const uint8_t* curr = data + sizeof(p61a_header_t);
+
+    size_t sample_bytes = 0;
+    for (size_t i = 0; i < sample_count; ++i, curr += sizeof(p61a_sample_t))
+    {
+        uint16_t length = read_be16(curr);
+        uint16_t repeat_offset = read_be16(curr + 4);
+
+        if ((curr[3] > 64) || ((repeat_offset != 0xffff) && (repeat_offset >= length)))
+        {
+            return 0;
         }
 
-        // PT: Sample Data
+        sample_bytes += length * 2;
+    }
 
-        const uint8_t* samples = raw + header.sample_offset;
-        for (size_t i = 0; i < header.sample_count; ++i)
+    // tracks start after the song positions, so offsets are bounded by the sample offset
+
+    for (size_t i = 0; i < pattern_count * PT_NUM_CHANNELS; ++i, curr += 2)
+    {
+        if (read_be16(curr) >= sample_offset - tables_size)
+        {
+            return 0;
+        }
+    }
+
+    size_t positions = 0;
+    for (; positions < PT_NUM_POSITIONS && (curr + positions) < (data + size); ++positions)
+    {
+        if (curr[positions] == 0xff)
+        {
+            break;
+        }
+
+        if (curr[positions] >= pattern_count)
+        {
+            return 0;
+        }
+    }
+
+    if (((curr + positions) >= (data + size)) || (curr[positions] != 0xff) || !positions)
+    {
+        return signed_module ? 50 : 0;
+    }
+
+    if (signed_module)
+    {
+        return 100;
+    }
+
+    // sample data ends the file, unless samples were written separately
+    return (sample_offset + sample_bytes == file_size) ? 90 : (sample_offset == file_size) ? 70 : 40;
+}
+
+bool player61a_probe(int fd, protracker_info_t* info)
+{
+    memset(info, 0, sizeof(protracker_info_t));
+
+    struct stat st;
+    if (!fstat(fd, &st))
+    {
+        info->file_size = st.st_size;
+    }
+
+    size_t signature_length = strlen(signature);
+
+    uint8_t raw[8];
+    ssize_t size = pread(fd, raw, signature_length + sizeof(p61a_header_t), 0);
+    if ((size < 0) || ((size_t)size < sizeof(p61a_header_t)))
+    {
+        LOG_ERROR("Premature end of data before header.\n");
+        return false;
+    }
+
+    size_t offset = 0;
+    if (((size_t)size == signature_length + sizeof(p61a_header_t)) && !memcmp(signature, raw, signature_length))
+    {
+        offset = signature_length;
+    }
+
+    p61a_header_t header;
+    memcpy(&header, raw + offset, sizeof(header));
+    header.sample_offset = end_be16toh(header.sample_offset);
+
+    if (!header.pattern_count)
+    {
+        LOG_ERROR("Invalid pattern count in header. (%u)\n", header.pattern_count);
+        return false;
+    }
+
+    if (header.sample_count > PT_NUM_SAMPLES)
+    {
+        LOG_ERROR("Invalid sample count in header. (%u > %u)\n", header.sample_count, PT_NUM_SAMPLES);
+        return false;
+    }
+
+    // sample headers, pattern offsets and song positions (up to the terminator) in one read
+
+    uint8_t tables[sizeof(p61a_sample_t) * PT_NUM_SAMPLES + sizeof(p61a_pattern_offset_t) * 255 + PT_NUM_POSITIONS + 1];
+    size_t tables_size = sizeof(p61a_sample_t) * header.sample_count + sizeof(p61a_pattern_offset_t) * header.pattern_count + PT_NUM_POSITIONS + 1;
+
+    size = pread(fd, tables, tables_size, offset + sizeof(p61a_header_t));
+    if (size < 0)
+    {
+        LOG_ERROR("Failed to read sample table.\n");
+        return false;
+    }
+
+    const uint8_t* curr = tables;
+    const uint8_t* max = tables + size;
+
+    p61a_sample_t sample_headers[PT_NUM_SAMPLES];
+    if (!(curr = read_sample_headers(sample_headers, header.sample_count, curr, max)))
+    {
+        return false;
+    }
+
+    p61a_pattern_offset_t pattern_offsets[255];
+    if (!(curr = read_pattern_offsets(pattern_offsets, header.pattern_count, curr, max)))
+    {
+        return false;
+    }
+
+    p61a_song_t song = { 0 };
+    if (!(curr = read_song_positions(&song, curr, max)))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < header.sample_count; ++i)
+    {
+        if (sample_headers[i].length)
+        {
+            ++ info->samples;
+            info->sample_bytes += sample_headers[i].length * 2;
+        }
+    }
+
+    info->song_length = song.length;
+    info->patterns = header.pattern_count;
+    info->expected_size = offset + header.sample_offset + info->sample_bytes;
+
+    return true;
+}
+
+// channel as it comes back from a P61A round-trip (periods outside of the note table are dropped,
+// effects go through the same encode/decode tables as the converter)
+static void normalize_channel(protracker_channel_t* out, const protracker_channel_t* in)
+{
+    uint8_t sample = protracker_get_sample(in);
+    uint16_t period = protracker_get_period(in);
+    p61a_effect_t effect = encode_effects[((in->data[2] & 0x0f) << 8) | in->data[3]];
+
+    memset(out, 0, sizeof(protracker_channel_t));
+    protracker_set_sample(out, sample);
+    protracker_set_period(out, note_from_period[period] ? period : 0);
+
+    if (effect.has_command)
+    {
+        out->data[2] |= decode_commands[effect.cmd & 0x0f];
+        out->data[3] = effect.value;
+    }
+}
+
+// bit n set if row n differs, rows are 16 bytes so one SSE2 compare covers a row
+static uint64_t compare_rows(const protracker_pattern_t* a, const protracker_pattern_t* b)
+{
+    uint64_t rows = 0;
+    for (size_t i = 0; i < PT_PATTERN_ROWS; ++i)
+    {
+#if defined(__SSE2__)
+        __m128i row_a = _mm_loadu_si128((const __m128i*)&(a->rows[i]));
+        __m128i row_b = _mm_loadu_si128((const __m128i*)&(b->rows[i]));
+        bool differs = _mm_movemask_epi8(_mm_cmpeq_epi8(row_a, row_b)) != 0xffff;
+#else
+        bool differs = memcmp(&(a->rows[i]), &(b->rows[i]), sizeof(protracker_pattern_row_t)) != 0;
+#endif
+        rows |= (uint64_t)differs << i;
+    }
+    return rows;
+}
+
+static size_t roundtrip_patterns(const protracker_t* module, const protracker_t* result)
+{
+    size_t mismatches = 0;
+
+    if (module->num_patterns != result->num_patterns)
+    {
+        LOG_ERROR("Round-trip: pattern count %lu != %lu.\n", module->num_patterns, result->num_patterns);
+        return 1;
+    }
+
+    if ((module->song.length != result->song.length) || memcmp(module->song.positions, result->song.positions, module->song.length))
+    {
+        LOG_ERROR("Round-trip: song positions differ.\n");
+        ++ mismatches;
+    }
+
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        const protracker_pattern_t* in = protracker_get_pattern(module, i);
+        const protracker_pattern_t* out = protracker_get_pattern(result, i);
+
+        protracker_pattern_t expected;
+        for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
         {
-            const p61a_sample_t* sample = &(sample_headers[i]);
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                normalize_channel(&(expected.rows[j].channels[k]), &(in->rows[j].channels[k]));
+            }
+        }
 
-            if (!sample->length)
+        uint64_t rows = compare_rows(&expected, out);
+        for (size_t j = 0; rows && (j < PT_PATTERN_ROWS); ++j)
+        {
+            if (!(rows & (1ull << j)))
             {
                 continue;
             }
 
-            size_t bytes = sample->length * 2;
-            uint8_t* out = module.sample_data[i] = malloc(bytes);
-            memcpy(out, samples, bytes);
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                const protracker_channel_t* a = &(expected.rows[j].channels[k]);
+                const protracker_channel_t* b = &(out->rows[j].channels[k]);
+                if (memcmp(a, b, sizeof(protracker_channel_t)))
+                {
+                    char text_a[16], text_b[16];
+                    protracker_channel_to_text(a, text_a, sizeof(text_a));
+                    protracker_channel_to_text(b, text_b, sizeof(text_b));
+                    LOG_ERROR("Round-trip: pattern %lu, row %lu, channel %lu: %s != %s.\n", i, j, k + 1, text_a, text_b);
+                    ++ mismatches;
+                }
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+static size_t roundtrip_samples(const protracker_t* module, const protracker_t* result)
+{
+    size_t mismatches = 0;
+
+    bool usage[PT_NUM_SAMPLES];
+    protracker_get_used_samples(module, usage);
 
-            samples += bytes;
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        if (!usage[i])
+        {
+            continue;
         }
 
-        free(patterns);
-        protracker_t* out = malloc(sizeof(protracker_t));
-        *out = module;
+        const protracker_sample_t* in = &(module->sample_headers[i]);
+        const protracker_sample_t* out = &(result->sample_headers[i]);
 
-        return out;
+        // expected header, empty samples are stored as one silent word
+        protracker_sample_t expected;
+        memset(&expected, 0, sizeof(expected));
+
+        bool looped = in->length && (in->repeat_length > 1);
+        expected.length = !in->length ? 1 : (looped ? in->repeat_offset + in->repeat_length : in->length);
+        expected.finetone = !in->length ? 0 : in->finetone & 0x0f;
+        expected.volume = !in->length ? 0 : (in->volume > 64 ? 64 : in->volume);
+        expected.repeat_offset = looped ? in->repeat_offset : 0;
+        expected.repeat_length = looped ? in->repeat_length : 1;
+
+        if ((out->length != expected.length) || (out->finetone != expected.finetone) || (out->volume != expected.volume) ||
+            (out->repeat_offset != expected.repeat_offset) || (out->repeat_length != expected.repeat_length))
+        {
+            LOG_ERROR("Round-trip: sample #%lu header differs (length %u/%u, finetune %u/%u, volume %u/%u, repeat %u+%u/%u+%u).\n", i + 1,
+                expected.length, out->length, expected.finetone, out->finetone, expected.volume, out->volume,
+                expected.repeat_offset, expected.repeat_length, out->repeat_offset, out->repeat_length);
+            ++ mismatches;
+            continue;
+        }
+
+        // data past the original length is padding
+        const uint8_t* data_in = protracker_get_sample_data(module, i);
+        const uint8_t* data_out = protracker_get_sample_data(result, i);
+
+        size_t bytes = expected.length * 2;
+        size_t common = (in->length < expected.length ? in->length : expected.length) * 2;
+
+        bool equal = data_out && (!common || !memcmp(data_in, data_out, common));
+        for (size_t j = common; equal && (j < bytes); ++j)
+        {
+            equal = !data_out[j];
+        }
+
+        if (!equal)
+        {
+            LOG_ERROR("Round-trip: sample #%lu data differs.\n", i + 1);
+            ++ mismatches;
+        }
+    }
+
+    return mismatches;
+}
+
+size_t player61a_roundtrip(const protracker_t* module, const char* options)
+{
+    LOG_DEBUG("Round-trip through The Player 6.1A...\n");
+
+    init_tables();
+
+    // song and sample data are always needed to reload the module
+    char roundtrip_options[64];
+    snprintf(roundtrip_options, sizeof(roundtrip_options), "%s,%s,max_cycles=%lu",
+        has_option(options, "sign", false) ? "sign" : "-sign",
+        has_option(options, "compress_patterns", true) ? "compress_patterns" : "-compress_patterns",
+        get_option_value(options, "max_cycles", 0));
+
+    buffer_t buffer;
+    buffer_init(&buffer, 1);
+
+    size_t mismatches = 0;
+    protracker_t* result = NULL;
+
+    do
+    {
+        if (!player61a_convert(&buffer, module, roundtrip_options))
+        {
+            LOG_ERROR("Round-trip: conversion failed.\n");
+            mismatches = 1;
+            break;
+        }
+
+        result = player61a_load(&buffer);
+        if (!result || !protracker_materialize(result))
+        {
+            LOG_ERROR("Round-trip: converted module failed to load.\n");
+            mismatches = 1;
+            break;
+        }
+
+        mismatches = roundtrip_patterns(module, result) + roundtrip_samples(module, result);
     }
     while (false);
 
-    free(patterns);
-    protracker_destroy(&module);
+    if (result)
+    {
+        protracker_free(result);
+    }
+    buffer_release(&buffer);
 
-    return NULL;
+    return mismatches;
 }
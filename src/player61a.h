@@ -75,6 +75,175 @@ typedef struct
     buffer_t samples;
 } player61a_t;
 
+/**
+ *
+ * Replayer configuration of one or more converted modules (see player61a_get_config)
+ *
+**/
+typedef struct
+{
+    uint32_t usecode;       // bit n set if the replayer needs the handler for P61A command n (En: bit 16+n, bit 0: finetune)
+    uint8_t channels;       // bit n set if channel n has pattern data
+    bool finetune;          // samples with finetune
+    bool tempo;             // Fxx with tempo values (CIA timing)
+    bool packed;            // 4-bit or delta packed samples
+    bool samples;           // sample data included in the module file
+    size_t modules;         // number of modules merged into the configuration
+} p61a_config_t;
+
+/**
+ *
+ * Estimated 68000 cycles per frame spent by the replayer (pattern fetch and fixed per-frame work)
+ *
+**/
+typedef struct
+{
+    uint32_t worst;         // most expensive frame of the patterns in the song
+    double average;         // average over the frames played until the song ends (see replay_run)
+} p61a_cycles_t;
+
 bool player61a_convert(buffer_t* buffer, const protracker_t* module, const char* opts);
+
+/**
+ *
+ * Estimate replay cost of a module as player61a_convert would encode its patterns
+ *
+ * The estimate comes from a cost model of the replayer's fetch per instruction and compression
+ * info, effect processing is not included. Use the max_cycles=N option to limit the worst case
+ * when converting.
+ *
+**/
+void player61a_estimate_cycles(p61a_cycles_t* cycles, const protracker_t* module, const char* options);
+
+/**
+ *
+ * Get the replayer configuration for a module as player61a_convert would convert it
+ *
+**/
+void player61a_get_config(p61a_config_t* config, const protracker_t* module, const char* options);
+
+/**
+ *
+ * Merge a configuration into another (union of all features), for packs of modules played by one
+ * replayer (an empty configuration can be used as the start)
+ *
+**/
+void player61a_merge_config(p61a_config_t* config, const p61a_config_t* other);
+
+/**
+ *
+ * Write a configuration as assembler equates (include file for the replayer source)
+ *
+**/
+void player61a_write_config(buffer_t* buffer, const p61a_config_t* config);
+typedef struct p61a_track_store_s p61a_track_store_t;
+
+/**
+ *
+ * Pack of modules sharing one sample bank and one track area (see player61a_pack_add)
+ *
+**/
+typedef struct
+{
+    buffer_t tracks;            // track area of all songs
+    p61a_track_store_t* track_store;    // index of the track area
+
+    buffer_t bank;              // unique sample data
+    buffer_t samples;           // p61a_bank_sample_t, one per unique sample
+    buffer_t songs;             // song sections, in the order the modules were added
+    buffer_t song_offsets;      // uint32_t offset of each song section in songs
+
+    uint32_t* buckets;          // sample hash -> last sample in the bucket (index + 1, 0 = none)
+    size_t bucket_count;
+
+    size_t modules;
+    size_t sample_count;        // samples of all modules (before sharing)
+    size_t sample_bytes;
+} p61a_pack_t;
+
+void player61a_pack_init(p61a_pack_t* pack);
+void player61a_pack_release(p61a_pack_t* pack);
+
+/**
+ *
+ * Convert a module and add it to a pack
+ *
+ * Sample data is hashed by content and stored once in the bank for all modules, the song section
+ * of the module (P61A without tracks and sample data) is preceded by the bank index of each of its
+ * samples. Tracks are written to the track area shared by all songs, pattern offsets of a song
+ * are relative to its base in the area: a track identical to one of a song with the same base is
+ * written once, others may jump into the tracks of earlier songs after the base. A song whose
+ * tracks would be more than 64 KB from the base starts a new base at the end of the area.
+ *
+ * Adding a module takes time in proportion to its own size only.
+ *
+ * options - Export options as for player61a_convert ('samples' and 'song' are ignored)
+ *
+ * Returns false if the tracks of the module alone exceed 64 KB
+ *
+**/
+bool player61a_pack_add(p61a_pack_t* pack, const protracker_t* module, const char* options);
+
+/**
+ *
+ * Write a pack (all values big endian, offsets from the start of the pack)
+ *
+ *  'P61P'
+ *  uint16_t module count
+ *  uint16_t bank sample count
+ *  uint32_t offset of the track area
+ *  uint32_t offset of the bank
+ *  uint32_t offset of each song section
+ *  uint32_t offset of each bank sample (from the start of the bank)
+ *
+ *  song sections:
+ *   uint32_t base of the song's tracks (from the start of the track area)
+ *   uint16_t sample count
+ *   uint16_t bank index of each sample (0xffff = unused)
+ *   P61A song data without tracks, pattern offsets are relative to the base (word aligned)
+ *
+ *  track area (word aligned)
+ *  bank: sample data
+ *
+**/
+void player61a_pack_write(buffer_t* buffer, const p61a_pack_t* pack);
+
 protracker_t* player61a_load(const buffer_t* buffer);
 
+/**
+ *
+ * Check how likely data is a P61A module (see protracker_sniff)
+ *
+ * Uses the signature if present, otherwise the plausibility of the header, sample table, pattern
+ * offsets and song positions (P61A_SNIFF_SIZE bytes cover all of them).
+ *
+**/
+#define P61A_SNIFF_SIZE (4 + sizeof(p61a_header_t) + sizeof(p61a_sample_t) * PT_NUM_SAMPLES + sizeof(p61a_pattern_offset_t) * 255 + PT_NUM_POSITIONS + 1)
+
+unsigned player61a_sniff(const uint8_t* data, size_t size, size_t file_size);
+
+/**
+ *
+ * Read module information from the header, sample table, pattern offsets and song positions
+ * of a file without loading it (see protracker_probe)
+ *
+**/
+bool player61a_probe(int fd, protracker_info_t* info);
+
+
+/**
+ *
+ * Convert a module to P61A in memory, reload it and compare the result with the original
+ *
+ * Song positions, patterns, sample headers and sample data are compared after applying the changes
+ * the format makes on purpose (volumes clamped to 64, periods outside of the note table dropped,
+ * 8xy -> E8y, EC0 -> C00, E0x filter bits, effects without parameters removed, looped samples
+ * ending at the loop end). Mismatches are logged with pattern/row/channel coordinates.
+ *
+ * module - ProTracker module (patterns are decoded on access)
+ * options - Export options ('sign' and 'compress_patterns' are honoured)
+ *
+ * Returns number of mismatches (0 = identical)
+ *
+**/
+size_t player61a_roundtrip(const protracker_t* module, const char* options);
@@ -1,14 +1,21 @@
 #include "protracker.h"
 #include "buffer.h"
 #include "options.h"
+#include "replay.h"
 #include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "endianness.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static uint16_t octaves[5][12] = {
     { 1712,1616,1525,1440,1357,1281,1209,1141,1077,1017, 961, 907 },    // 0
     {  856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453 },    // 1
@@ -21,24 +28,35 @@ static char* notes[] = {
     "C-","C#","D-","D#","E-","F-","F#","G-","G#","A-","A#","B-"
 };
 
+// period -> (octave * 12 + note) + 1, 0 if the period is not a note
+static uint8_t period_notes[0x1000];
+static bool period_notes_initialized = false;
+
 void protracker_channel_to_text(const protracker_channel_t* channel, char* out, size_t buflen)
 {
+    if (!period_notes_initialized)
+    {
+        for (size_t i = 0; i < 5; ++i)
+        {
+            for (size_t j = 0; j < 12; ++j)
+            {
+                period_notes[octaves[i][j]] = (uint8_t)(i * 12 + j + 1);
+            }
+        }
+        period_notes_initialized = true;
+    }
+
     uint8_t sample = protracker_get_sample(channel);
     uint16_t period = protracker_get_period(channel);
     protracker_effect_t effect = protracker_get_effect(channel);
 
     if (sample > 0 && period > 0)
     {
-        for (size_t i = 0; i < 5; ++i)
+        uint8_t note = period_notes[period];
+        if (note)
         {
-            for (size_t j = 0; j < 12; ++j)
-            {
-                if (octaves[i][j] == period)
-                {
-                    snprintf(out, buflen, "%s%ld%02X%1X%1X%1X", notes[j], i, sample, effect.cmd, effect.data.ext.cmd, effect.data.ext.value);
-                    return;
-                }
-            }
+            snprintf(out, buflen, "%s%d%02X%1X%1X%1X", notes[(note-1) % 12], (note-1) / 12, sample, effect.cmd, effect.data.ext.cmd, effect.data.ext.value);
+            return;
         }
 
         snprintf(out, buflen, "???%02X%1X%1X%1X", sample, effect.cmd, effect.data.ext.cmd, effect.data.ext.value);
@@ -49,6 +67,28 @@ void protracker_channel_to_text(const protracker_channel_t* channel, char* out,
     }
 }
 
+void protracker_trace_pattern(const protracker_pattern_t* pattern, size_t index)
+{
+    LOG_TRACE("Pattern #%lu:\n", index);
+    for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+    {
+        const protracker_pattern_row_t* row = &(pattern->rows[j]);
+
+        LOG_TRACE(" #%02lu:", j);
+
+        for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+        {
+            char channel_string[32];
+
+            protracker_channel_to_text(&(row->channels[k]), channel_string, sizeof(channel_string));
+
+            LOG_TRACE(" %s", channel_string);
+        }
+
+        LOG_TRACE("\n");
+    }
+}
+
 static void process_sample_header(protracker_sample_t* sample, const uint8_t* in, size_t index)
 {
     memcpy(sample, in, sizeof(protracker_sample_t));
@@ -69,51 +109,65 @@ static void process_sample_header(protracker_sample_t* sample, const uint8_t* in
     );
 }
 
-static const uint8_t* process_sample_data(protracker_t* module, const uint8_t* in, const uint8_t* max)
+static void trace_sample_data(const uint8_t* data, size_t bytes, size_t index)
 {
-    size_t i;
-    for (i = 0; i < PT_NUM_SAMPLES; ++i)
+    for (size_t i = 0; i < 256 && i < bytes; ++i)
     {
-        const protracker_sample_t* sample = &(module->sample_headers[i]);
-
-        if (in > max)
+        if ((i & 15) == 0)
         {
-            LOG_ERROR("Premature end of data before sample #%lu.\n", (i+1));
-            break;
+            LOG_TRACE("\n%04X:", i);
         }
 
-        if (!sample->length)
-        {
-            continue;
-        }
+        LOG_TRACE("%02X", data[i]);
+    }
+    LOG_TRACE("\n");
+
+    LOG_TRACE(" #%lu - %u bytes\n", index+1, bytes);
+}
 
-        size_t bytes = sample->length * 2;
+static const uint8_t* process_sample_data(protracker_t* module, const uint8_t* in, const uint8_t* max)
+{
+    // record extents and keep the whole sample area in one block, samples are never copied one by one
 
-        uint8_t* data = module->sample_data[i] = malloc(bytes);
-        if (!data)
-        {
-            return NULL;
-        }
+    size_t bytes = 0;
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        module->sample_offsets[i] = (uint32_t)bytes;
+        bytes += module->sample_headers[i].length * 2;
+    }
 
-        memcpy(data, in, bytes);
+    if (!bytes)
+    {
+        return in;
+    }
+
+    uint8_t* data = module->sample_source = calloc(1, bytes);
+    if (!data)
+    {
+        return NULL;
+    }
+
+    // data missing at the end of the sample area stays silent
+    size_t available = (max > in) ? (size_t)(max - in) : 0;
+    if (available < bytes)
+    {
+        LOG_WARN("%lu bytes of sample data missing, padded with silence.\n", bytes - available);
+        bytes = available;
+    }
+    memcpy(data, in, bytes);
 
-        for (size_t i = 0; i < 256 && i < bytes; ++i)
+    if (LOG_ENABLED(LOG_LEVEL_TRACE))
+    {
+        for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
         {
-            if ((i & 15) == 0)
+            if (module->sample_headers[i].length)
             {
-                LOG_TRACE("\n%04X:", i);
+                trace_sample_data(data + module->sample_offsets[i], module->sample_headers[i].length * 2, i);
             }
-
-            LOG_TRACE("%02X", data[i]);
         }
-        LOG_TRACE("\n");
-
-        LOG_TRACE(" #%lu - %u bytes\n", i+1, bytes);
-
-        in += bytes;
     }
 
-    return (i == PT_NUM_SAMPLES) ? in : NULL;
+    return in + bytes;
 }
 
 protracker_t* protracker_load(const buffer_t* buffer)
@@ -201,40 +255,30 @@ protracker_t* protracker_load(const buffer_t* buffer)
         module.num_patterns = max_pattern + 1;
         module.patterns = malloc(module.num_patterns * sizeof(protracker_pattern_t));
 
-        for (size_t i = 0; i < module.num_patterns; ++i)
+        size_t i;
+        for (i = 0; i < module.num_patterns; ++i)
         {
-            if (curr > max)
+            if (curr + sizeof(protracker_pattern_t) > max)
             {
-                LOG_ERROR("Premature end of data before pattern %lu.\n", i);
+                LOG_ERROR("Premature end of data in pattern %lu.\n", i);
                 break;
             }
 
             memcpy(&module.patterns[i], curr, sizeof(protracker_pattern_t));
 
-            LOG_TRACE("Pattern #%lu:\n", i);
-            for(size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+            if (LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                const protracker_pattern_row_t* pos = &(module.patterns[i].rows[j]);
-
-                LOG_TRACE(" #%02lu:", j);
-
-                for(size_t k = 0; k < PT_NUM_CHANNELS; ++k)
-                {
-                    const protracker_channel_t* channel = &(pos->channels[k]);
-
-                    char channel_string[32];
-
-                    protracker_channel_to_text(channel, channel_string, sizeof(channel_string));
-
-                    LOG_TRACE(" %s", channel_string);
-                }
-
-                LOG_TRACE("\n");
+                protracker_trace_pattern(&module.patterns[i], i);
             }
 
             curr += sizeof(protracker_pattern_t);
         }
 
+        if (i < module.num_patterns)
+        {
+            break;
+        }
+
         LOG_TRACE("Sample Data:\n");
         const uint8_t* end = process_sample_data(&module, curr, max);
 
@@ -274,6 +318,115 @@ protracker_t* protracker_load(const buffer_t* buffer)
     return NULL;
 }
 
+unsigned protracker_sniff(const uint8_t* data, size_t size, size_t file_size)
+{
+    if (size < PT_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    const uint8_t* magic = data + PT_HEADER_SIZE - 4;
+    if (memcmp("M.K.", magic, 4) && memcmp("M!K!", magic, 4) && memcmp("FLT4", magic, 4) && memcmp("4CHN", magic, 4))
+    {
+        return 0;
+    }
+
+    // the magic word is strong evidence, implausible headers or sizes only lower confidence
+
+    unsigned confidence = 100;
+
+    const uint8_t* samples = data + sizeof(protracker_header_t);
+    size_t sample_bytes = 0;
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        const uint8_t* sample = samples + i * sizeof(protracker_sample_t);
+        sample_bytes += ((sample[22] << 8) | sample[23]) * 2;
+
+        if ((sample[24] > 0x0f) || (sample[25] > 64))
+        {
+            confidence = 60;
+        }
+    }
+
+    const uint8_t* song = samples + PT_NUM_SAMPLES * sizeof(protracker_sample_t);
+    uint8_t max_pattern = 0;
+    for (size_t i = 0; i < PT_NUM_POSITIONS; ++i)
+    {
+        max_pattern = max_pattern < song[2+i] ? song[2+i] : max_pattern;
+    }
+
+    if (!song[0] || song[0] > PT_NUM_POSITIONS)
+    {
+        confidence = 60;
+    }
+
+    if (PT_HEADER_SIZE + (max_pattern + 1) * sizeof(protracker_pattern_t) + sample_bytes != file_size)
+    {
+        confidence = confidence > 80 ? 80 : confidence;
+    }
+
+    return confidence;
+}
+
+bool protracker_probe(int fd, protracker_info_t* info)
+{
+    memset(info, 0, sizeof(protracker_info_t));
+
+    struct stat st;
+    if (!fstat(fd, &st))
+    {
+        info->file_size = st.st_size;
+    }
+
+    uint8_t raw[PT_HEADER_SIZE];
+    if (pread(fd, raw, sizeof(raw), 0) != sizeof(raw))
+    {
+        LOG_ERROR("Premature end of data before pattern data.\n");
+        return false;
+    }
+
+    const uint8_t* curr = raw;
+
+    memcpy(info->name, curr, sizeof(protracker_header_t));
+    curr += sizeof(protracker_header_t);
+
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        protracker_sample_t sample;
+        process_sample_header(&sample, curr, i);
+        curr += sizeof(protracker_sample_t);
+
+        if (sample.length)
+        {
+            ++ info->samples;
+            info->sample_bytes += sample.length * 2;
+        }
+    }
+
+    protracker_song_t song;
+    memcpy(&song, curr, sizeof(protracker_song_t));
+    curr += sizeof(protracker_song_t);
+
+    if (memcmp("M.K.", curr, 4) && memcmp("M!K!", curr, 4) && memcmp("FLT4", curr, 4) && memcmp("4CHN", curr, 4))
+    {
+        LOG_ERROR("Could not find magic word, is this a ProTracker module?\n");
+        return false;
+    }
+
+    // same as protracker_load(): every position counts, not only the ones in the song
+    uint8_t max_pattern = 0;
+    for (size_t i = 0; i < PT_NUM_POSITIONS; ++i)
+    {
+        max_pattern = max_pattern < song.positions[i] ? song.positions[i] : max_pattern;
+    }
+
+    info->song_length = song.length;
+    info->patterns = max_pattern + 1;
+    info->expected_size = PT_HEADER_SIZE + info->patterns * sizeof(protracker_pattern_t) + info->sample_bytes;
+
+    return true;
+}
+
 bool protracker_convert(buffer_t* buffer, const protracker_t* module, const char* options)
 {
     LOG_INFO("Exporting ProTracker module\n");
@@ -304,7 +457,7 @@ bool protracker_convert(buffer_t* buffer, const protracker_t* module, const char
 
     for (size_t i = 0; i < module->num_patterns; ++i)
     {
-        const protracker_pattern_t* pattern = &(module->patterns[i]);
+        const protracker_pattern_t* pattern = protracker_get_pattern(module, i);
         buffer_add(buffer, pattern, sizeof(protracker_pattern_t));
     }
 
@@ -319,7 +472,7 @@ bool protracker_convert(buffer_t* buffer, const protracker_t* module, const char
             continue;
         }
 
-        buffer_add(buffer, module->sample_data[i], sample->length * 2);
+        buffer_add(buffer, protracker_get_sample_data(module, i), sample->length * 2);
     }
 
     return true;
@@ -330,9 +483,28 @@ void protracker_create(protracker_t* module)
     memset(module, 0, sizeof(protracker_t));
 }
 
+static void release_source(protracker_t* module)
+{
+    protracker_source_t* source = module->source;
+    if (!source)
+    {
+        return;
+    }
+
+    if (source->release)
+    {
+        source->release(source->context);
+    }
+    free(source);
+
+    module->source = NULL;
+}
+
 void protracker_destroy(protracker_t* module)
 {
+    release_source(module);
     free(module->patterns);
+    free(module->sample_source);
     for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
     {
         free(module->sample_data[i]);
@@ -384,147 +556,837 @@ void protracker_set_effect(protracker_channel_t* channel, const protracker_effec
     channel->data[3] = effect->data.value;
 }
 
-typedef struct
-{
-    bool* usage;
-} sample_usage_data;
+#if defined(__SSE2__)
+
+// 16 channels (4 rows) per iteration; each 32-bit lane holds one channel in memory order
 
-void sample_usage_filter(const protracker_channel_t* channel, uint8_t index, void* data)
+static void decode_channels_sse2(const uint8_t* in, uint16_t* periods, uint8_t* samples, uint8_t* commands, uint8_t* params)
 {
-    sample_usage_data* internal = (sample_usage_data*)data;
-    uint8_t sample = protracker_get_sample(channel);
+    const __m128i mask_0f = _mm_set1_epi32(0x0f);
+    const __m128i mask_10 = _mm_set1_epi32(0x10);
+    const __m128i mask_ff = _mm_set1_epi32(0xff);
 
-    if (sample > 0)
+    __m128i p[4], s[4], c[4], b[4];
+    for (size_t i = 0; i < 4; ++i)
     {
-        internal->usage[sample - 1] = true;
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 16));
+
+        p[i] = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, mask_0f), 8), _mm_and_si128(_mm_srli_epi32(v, 8), mask_ff));
+        s[i] = _mm_or_si128(_mm_and_si128(v, mask_10), _mm_and_si128(_mm_srli_epi32(v, 20), mask_0f));
+        c[i] = _mm_and_si128(_mm_srli_epi32(v, 16), mask_0f);
+        b[i] = _mm_srli_epi32(v, 24);
     }
+
+    _mm_storeu_si128((__m128i*)(periods + 0), _mm_packs_epi32(p[0], p[1]));
+    _mm_storeu_si128((__m128i*)(periods + 8), _mm_packs_epi32(p[2], p[3]));
+    _mm_storeu_si128((__m128i*)samples, _mm_packus_epi16(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3])));
+    _mm_storeu_si128((__m128i*)commands, _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3])));
+    _mm_storeu_si128((__m128i*)params, _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), _mm_packs_epi32(b[2], b[3])));
 }
 
-size_t protracker_get_used_samples(const protracker_t* module, bool* usage)
+static void encode_channels_sse2(uint8_t* out, const uint16_t* periods, const uint8_t* samples, const uint8_t* commands, const uint8_t* params)
 {
-    memset(usage, 0, sizeof(bool) * PT_NUM_SAMPLES);
-
-    sample_usage_data usage_data = { usage };
-    protracker_scan_notes(module, sample_usage_filter, &usage_data);
-
-    size_t count = 0;
-    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask_0f = _mm_set1_epi32(0x0f);
+    const __m128i mask_10 = _mm_set1_epi32(0x10);
+    const __m128i mask_ff = _mm_set1_epi32(0xff);
+
+    __m128i p16[2] = {
+        _mm_loadu_si128((const __m128i*)(periods + 0)),
+        _mm_loadu_si128((const __m128i*)(periods + 8))
+    };
+    __m128i s8 = _mm_loadu_si128((const __m128i*)samples);
+    __m128i c8 = _mm_loadu_si128((const __m128i*)commands);
+    __m128i b8 = _mm_loadu_si128((const __m128i*)params);
+
+    __m128i s16[2] = { _mm_unpacklo_epi8(s8, zero), _mm_unpackhi_epi8(s8, zero) };
+    __m128i c16[2] = { _mm_unpacklo_epi8(c8, zero), _mm_unpackhi_epi8(c8, zero) };
+    __m128i b16[2] = { _mm_unpacklo_epi8(b8, zero), _mm_unpackhi_epi8(b8, zero) };
+
+    for (size_t i = 0; i < 4; ++i)
     {
-        if (usage[i])
+        __m128i p, s, c, b;
+        if (i & 1)
         {
-            ++ count;
+            p = _mm_unpackhi_epi16(p16[i >> 1], zero);
+            s = _mm_unpackhi_epi16(s16[i >> 1], zero);
+            c = _mm_unpackhi_epi16(c16[i >> 1], zero);
+            b = _mm_unpackhi_epi16(b16[i >> 1], zero);
+        }
+        else
+        {
+            p = _mm_unpacklo_epi16(p16[i >> 1], zero);
+            s = _mm_unpacklo_epi16(s16[i >> 1], zero);
+            c = _mm_unpacklo_epi16(c16[i >> 1], zero);
+            b = _mm_unpacklo_epi16(b16[i >> 1], zero);
         }
-    }
 
-    return count;
+        __m128i v = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), mask_0f), _mm_and_si128(s, mask_10));
+        v = _mm_or_si128(v, _mm_slli_epi32(_mm_and_si128(p, mask_ff), 8));
+        v = _mm_or_si128(v, _mm_slli_epi32(_mm_and_si128(s, mask_0f), 20));
+        v = _mm_or_si128(v, _mm_slli_epi32(_mm_and_si128(c, mask_0f), 16));
+        v = _mm_or_si128(v, _mm_slli_epi32(b, 24));
+
+        _mm_storeu_si128((__m128i*)(out + i * 16), v);
+    }
 }
 
-size_t protracker_get_pattern_count(const protracker_t* module)
+#endif
+
+const uint8_t* protracker_get_sample_data(const protracker_t* module, size_t index)
 {
-    uint8_t max_pattern = 0;
+    if (!module->sample_headers[index].length)
+    {
+        return NULL;
+    }
 
-    for (uint8_t i = 0; i < module->song.length; ++i)
+    if (module->sample_data[index])
     {
-        if (module->song.positions[i] > max_pattern)
-            max_pattern = module->song.positions[i];
+        return module->sample_data[index];
     }
 
-    return max_pattern+1;
+    return module->sample_source ? module->sample_source + module->sample_offsets[index] : NULL;
 }
 
-void protracker_remove_unused_patterns(protracker_t* module)
+const protracker_pattern_t* protracker_get_pattern(const protracker_t* module, size_t index)
 {
-    size_t used_patterns = protracker_get_pattern_count(module);
-    size_t total_patterns = module->num_patterns;
-
-    LOG_DEBUG("Removing unused patterns...\n");
-
-    for (size_t i = module->song.length; i < PT_NUM_POSITIONS; ++i)
+    if (index >= module->num_patterns)
     {
-        module->song.positions[i] = 0;
+        return NULL;
     }
 
-    size_t num_patterns = 0;
-    for (size_t i = 0; i < module->num_patterns; ++i)
+    protracker_source_t* source = module->source;
+    if (source && !(source->decoded[index >> 3] & (1 << (index & 7))))
     {
-        bool used = false;
-        for (size_t j = 0, m = module->song.length; j < m; ++j)
+        // decoding does not change the observable state of the module, the decoder reports errors
+        if (!source->decode(source->context, module->patterns, index, 1))
         {
-            if (module->song.positions[j] == i)
-            {
-                used = true;
-                break;
-            }
+            ((protracker_t*)module)->patterns_invalid = true;
         }
+        source->decoded[index >> 3] |= 1 << (index & 7);
+    }
 
-        size_t pattern_index = num_patterns;
-        if (!used)
-        {
-            LOG_TRACE(" #%lu - not used, removing...\n", i);
-        }
-        else
-        {
-            ++ num_patterns;
-        }
+    return &(module->patterns[index]);
+}
 
-        if (pattern_index == i)
+bool protracker_materialize(const protracker_t* module)
+{
+    protracker_source_t* source = module->source;
+    if (!source)
+    {
+        return !module->patterns_invalid;
+    }
+
+    // decode each run of patterns that has not been accessed yet in one call
+    bool valid = true;
+    size_t index = 0;
+    while (index < module->num_patterns)
+    {
+        if (source->decoded[index >> 3] & (1 << (index & 7)))
         {
+            ++index;
             continue;
         }
 
-        module->patterns[pattern_index] = module->patterns[i];
-
-        for (size_t j = 0; j < PT_NUM_POSITIONS; ++j)
+        size_t first = index;
+        while ((index < module->num_patterns) && !(source->decoded[index >> 3] & (1 << (index & 7))))
         {
-            size_t curr_index = module->song.positions[j];
-            if (curr_index == i)
-            {
-                module->song.positions[j] -= (i - pattern_index);
-            }
+            ++index;
         }
+
+        valid = source->decode(source->context, module->patterns, first, index - first) && valid;
     }
 
-    module->num_patterns = num_patterns;
+    // decoding does not change the observable state of the module
+    ((protracker_t*)module)->patterns_invalid |= !valid;
+    release_source((protracker_t*)module);
+
+    return !module->patterns_invalid;
 }
 
-void protracker_remove_unused_samples(protracker_t* module)
+bool protracker_decode_patterns(const protracker_t* module, protracker_decoded_t* decoded)
 {
-    LOG_DEBUG("Removing unused samples...\n");
+    size_t count = module->num_patterns * PT_PATTERN_ROWS * PT_NUM_CHANNELS;
 
-    bool used[PT_NUM_SAMPLES];
-    size_t sample_count = protracker_get_used_samples(module, used);
+    memset(decoded, 0, sizeof(protracker_decoded_t));
+    if (!count)
+    {
+        return true;
+    }
 
-    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    // single block: periods first to keep them aligned
+    uint8_t* block = malloc(count * (sizeof(uint16_t) + 3));
+    if (!block)
     {
-        if (used[i] || !module->sample_headers[i].length)
-        {
-            continue;
-        }
+        return false;
+    }
 
-        LOG_TRACE(" #%lu - not used, removing...\n", (i+1));
+    decoded->count = count;
+    decoded->periods = (uint16_t*)block;
+    decoded->samples = block + count * sizeof(uint16_t);
+    decoded->commands = decoded->samples + count;
+    decoded->params = decoded->commands + count;
 
-        free(module->sample_data[i]);
-        module->sample_data[i] = NULL;
-        module->sample_headers[i].length = 0;
-        module->sample_headers[i].repeat_offset = 0;
-        module->sample_headers[i].repeat_length = 0;
+    protracker_materialize(module);
+
+    const protracker_channel_t* in = (const protracker_channel_t*)module->patterns;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= count; i += 16)
+    {
+        decode_channels_sse2(in[i].data, &(decoded->periods[i]), &(decoded->samples[i]), &(decoded->commands[i]), &(decoded->params[i]));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        protracker_effect_t effect = protracker_get_effect(&(in[i]));
+
+        decoded->periods[i] = protracker_get_period(&(in[i]));
+        decoded->samples[i] = protracker_get_sample(&(in[i]));
+        decoded->commands[i] = effect.cmd;
+        decoded->params[i] = effect.data.value;
     }
+
+    return true;
 }
 
-void protracker_trim_samples(protracker_t* module)
+void protracker_encode_patterns(protracker_t* module, const protracker_decoded_t* decoded)
 {
-    LOG_DEBUG("Trimming samples...\n");
+    protracker_invalidate(module);
+    protracker_materialize(module);
 
-    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    protracker_channel_t* out = (protracker_channel_t*)module->patterns;
+    size_t count = decoded->count;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= count; i += 16)
     {
-        protracker_sample_t* sample = &(module->sample_headers[i]);
-        if (!sample->length || sample->repeat_length > 1)
-        {
-            continue;
-        }
+        encode_channels_sse2(out[i].data, &(decoded->periods[i]), &(decoded->samples[i]), &(decoded->commands[i]), &(decoded->params[i]));
+    }
+#endif
 
-        const uint8_t* data = module->sample_data[i];
-        ssize_t sample_end;
+    for (; i < count; ++i)
+    {
+        protracker_effect_t effect;
+        effect.cmd = decoded->commands[i];
+        effect.data.value = decoded->params[i];
+
+        memset(&(out[i]), 0, sizeof(protracker_channel_t));
+        protracker_set_period(&(out[i]), decoded->periods[i]);
+        protracker_set_sample(&(out[i]), decoded->samples[i]);
+        protracker_set_effect(&(out[i]), &effect);
+    }
+}
+
+void protracker_decoded_release(protracker_decoded_t* decoded)
+{
+    free(decoded->periods);
+    memset(decoded, 0, sizeof(protracker_decoded_t));
+}
+
+// Accumulate usage of 16 channels: sample/command bits and the max period
+
+#if defined(__SSE2__)
+
+static void usage_channels_sse2(const uint8_t* in, protracker_usage_t* usage, __m128i* max_period)
+{
+    const __m128i mask_0f = _mm_set1_epi32(0x0f);
+    const __m128i mask_10 = _mm_set1_epi32(0x10);
+    const __m128i mask_ff = _mm_set1_epi32(0xff);
+    const __m128i mask_effect = _mm_set1_epi32(0xff0f0000);
+    const __m128i no_command = _mm_set1_epi32(16);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i p[4], s[4], c[4], b[4];
+    for (size_t i = 0; i < 4; ++i)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i * 16));
+
+        p[i] = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, mask_0f), 8), _mm_and_si128(_mm_srli_epi32(v, 8), mask_ff));
+        s[i] = _mm_or_si128(_mm_and_si128(v, mask_10), _mm_and_si128(_mm_srli_epi32(v, 20), mask_0f));
+        b[i] = _mm_srli_epi32(v, 24);
+
+        // channels without effect map to command 16, which falls outside the command mask
+        __m128i empty = _mm_cmpeq_epi32(_mm_and_si128(v, mask_effect), zero);
+        c[i] = _mm_or_si128(_mm_and_si128(empty, no_command), _mm_andnot_si128(empty, _mm_and_si128(_mm_srli_epi32(v, 16), mask_0f)));
+    }
+
+    *max_period = _mm_max_epi16(*max_period, _mm_max_epi16(_mm_packs_epi32(p[0], p[1]), _mm_packs_epi32(p[2], p[3])));
+
+    uint8_t samples[16], commands[16], params[16];
+    _mm_storeu_si128((__m128i*)samples, _mm_packus_epi16(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3])));
+    _mm_storeu_si128((__m128i*)commands, _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3])));
+    _mm_storeu_si128((__m128i*)params, _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]), _mm_packs_epi32(b[2], b[3])));
+
+    uint32_t sample_bits = 0, command_bits = 0, extended_bits = 0;
+    for (size_t i = 0; i < 16; ++i)
+    {
+        sample_bits |= 1u << samples[i];
+        command_bits |= 1u << commands[i];
+        extended_bits |= (commands[i] == PT_CMD_EXTENDED) ? (1u << (params[i] >> 4)) : 0;
+    }
+
+    usage->samples |= sample_bits;
+    usage->commands |= (uint16_t)command_bits;
+    usage->extended |= (uint16_t)extended_bits;
+}
+
+#endif
+
+static void usage_channels(const protracker_channel_t* in, size_t count, protracker_usage_t* usage)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint16_t period = protracker_get_period(&(in[i]));
+        protracker_effect_t effect = protracker_get_effect(&(in[i]));
+
+        usage->samples |= 1u << protracker_get_sample(&(in[i]));
+        usage->max_period = period > usage->max_period ? period : usage->max_period;
+
+        if (effect.cmd || effect.data.value)
+        {
+            usage->commands |= 1u << effect.cmd;
+            if (effect.cmd == PT_CMD_EXTENDED)
+            {
+                usage->extended |= 1u << effect.data.ext.cmd;
+            }
+        }
+    }
+}
+
+protracker_usage_t protracker_get_usage(const protracker_t* module)
+{
+    if (module->usage_valid)
+    {
+        return module->usage;
+    }
+
+    protracker_usage_t usage = { 0 };
+
+    // every pattern is scanned once, no matter how often the song references it
+    bool scanned[256] = { false };
+
+#if defined(__SSE2__)
+    __m128i max_period = _mm_setzero_si128();
+#endif
+
+    for (size_t i = 0, n = module->song.length; i < n; ++i)
+    {
+        uint8_t index = module->song.positions[i];
+        if (scanned[index] || index >= module->num_patterns)
+        {
+            continue;
+        }
+        scanned[index] = true;
+
+        const protracker_channel_t* channels = protracker_get_pattern(module, index)->rows[0].channels;
+        size_t count = PT_PATTERN_ROWS * PT_NUM_CHANNELS;
+        size_t j = 0;
+
+#if defined(__SSE2__)
+        for (; j + 16 <= count; j += 16)
+        {
+            usage_channels_sse2(channels[j].data, &usage, &max_period);
+        }
+#endif
+
+        usage_channels(&(channels[j]), count - j, &usage);
+    }
+
+#if defined(__SSE2__)
+    uint16_t periods[8];
+    _mm_storeu_si128((__m128i*)periods, max_period);
+    for (size_t i = 0; i < 8; ++i)
+    {
+        usage.max_period = periods[i] > usage.max_period ? periods[i] : usage.max_period;
+    }
+#endif
+
+    // the cache does not change the observable state of the module
+    protracker_t* cache = (protracker_t*)module;
+    cache->usage = usage;
+    cache->usage_valid = true;
+
+    return usage;
+}
+
+void protracker_invalidate(protracker_t* module)
+{
+    module->usage_valid = false;
+}
+
+size_t protracker_get_used_samples(const protracker_t* module, bool* usage)
+{
+    uint32_t samples = protracker_get_usage(module).samples;
+
+    size_t count = 0;
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        usage[i] = (samples & (1u << (i + 1))) != 0;
+        if (usage[i])
+        {
+            ++ count;
+        }
+    }
+
+    return count;
+}
+
+size_t protracker_get_size(const protracker_t* module)
+{
+    size_t size = sizeof(protracker_header_t) + sizeof(protracker_sample_t) * PT_NUM_SAMPLES + sizeof(protracker_song_t) + 4;
+
+    size += module->num_patterns * sizeof(protracker_pattern_t);
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        size += module->sample_headers[i].length * 2;
+    }
+
+    return size;
+}
+
+size_t protracker_get_pattern_count(const protracker_t* module)
+{
+    uint8_t max_pattern = 0;
+
+    for (uint8_t i = 0; i < module->song.length; ++i)
+    {
+        if (module->song.positions[i] > max_pattern)
+            max_pattern = module->song.positions[i];
+    }
+
+    return max_pattern+1;
+}
+
+void protracker_remove_unused_patterns(protracker_t* module)
+{
+    size_t used_patterns = protracker_get_pattern_count(module);
+    size_t total_patterns = module->num_patterns;
+
+    LOG_DEBUG("Removing unused patterns...\n");
+
+    protracker_invalidate(module);
+    protracker_materialize(module);
+
+    for (size_t i = module->song.length; i < PT_NUM_POSITIONS; ++i)
+    {
+        module->song.positions[i] = 0;
+    }
+
+    size_t num_patterns = 0;
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        bool used = false;
+        for (size_t j = 0, m = module->song.length; j < m; ++j)
+        {
+            if (module->song.positions[j] == i)
+            {
+                used = true;
+                break;
+            }
+        }
+
+        size_t pattern_index = num_patterns;
+        if (!used)
+        {
+            LOG_TRACE(" #%lu - not used, removing...\n", i);
+        }
+        else
+        {
+            ++ num_patterns;
+        }
+
+        if (pattern_index == i)
+        {
+            continue;
+        }
+
+        module->patterns[pattern_index] = module->patterns[i];
+
+        for (size_t j = 0; j < PT_NUM_POSITIONS; ++j)
+        {
+            size_t curr_index = module->song.positions[j];
+            if (curr_index == i)
+            {
+                module->song.positions[j] -= (i - pattern_index);
+            }
+        }
+    }
+
+    module->num_patterns = num_patterns;
+}
+
+// FNV-1a over 64-bit words (size is a multiple of 8)
+static uint64_t hash_bytes(const void* data, size_t size)
+{
+    const uint8_t* curr = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, curr + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+size_t protracker_remove_identical_patterns(protracker_t* module)
+{
+    size_t num_patterns = module->num_patterns;
+
+    LOG_DEBUG("Removing identical patterns...\n");
+
+    if (num_patterns < 2)
+    {
+        return 0;
+    }
+
+    protracker_invalidate(module);
+    protracker_materialize(module);
+
+    // open addressing, at most half full
+    size_t slots = 1;
+    while (slots < num_patterns * 2)
+    {
+        slots <<= 1;
+    }
+
+    size_t* table = calloc(slots, sizeof(size_t));              // kept pattern index + 1 (0 = free)
+    uint64_t* hashes = malloc(num_patterns * sizeof(uint64_t)); // hash per kept pattern
+    size_t* remap = malloc(num_patterns * sizeof(size_t));      // old index -> new index
+
+    size_t count = 0;
+    if (table && hashes && remap)
+    {
+        // patterns are compacted while hashing, kept patterns only ever move down
+        for (size_t i = 0; i < num_patterns; ++i)
+        {
+            uint64_t hash = hash_bytes(&(module->patterns[i]), sizeof(protracker_pattern_t));
+            size_t slot = hash & (slots - 1);
+            size_t found = SIZE_MAX;
+
+            for (; table[slot]; slot = (slot + 1) & (slots - 1))
+            {
+                size_t other = table[slot] - 1;
+                if ((hashes[other] == hash) && !memcmp(&(module->patterns[other]), &(module->patterns[i]), sizeof(protracker_pattern_t)))
+                {
+                    found = other;
+                    break;
+                }
+            }
+
+            if (found != SIZE_MAX)
+            {
+                LOG_TRACE(" #%lu equals #%lu, merging...\n", i, found);
+                remap[i] = found;
+                continue;
+            }
+
+            if (count != i)
+            {
+                module->patterns[count] = module->patterns[i];
+            }
+
+            hashes[count] = hash;
+            table[slot] = count + 1;
+            remap[i] = count++;
+        }
+
+        for (size_t i = 0; i < PT_NUM_POSITIONS; ++i)
+        {
+            if (module->song.positions[i] < num_patterns)
+            {
+                module->song.positions[i] = (uint8_t)remap[module->song.positions[i]];
+            }
+        }
+
+        module->num_patterns = count;
+    }
+    else
+    {
+        LOG_ERROR("Failed to allocate pattern hash table.\n");
+        count = num_patterns;
+    }
+
+    free(table);
+    free(hashes);
+    free(remap);
+
+    return num_patterns - count;
+}
+
+typedef struct
+{
+    uint8_t position;
+    uint8_t row;
+} flow_state_t;
+
+typedef struct
+{
+    bool visited[PT_NUM_POSITIONS][PT_PATTERN_ROWS];
+    flow_state_t pending[PT_NUM_POSITIONS * PT_PATTERN_ROWS];
+    size_t num_pending;
+    size_t length;                      // song length
+} flow_t;
+
+// queue a (position, entry row) state unless it was seen before, positions past the end wrap to 0
+static void flow_push(flow_t* flow, size_t position, size_t row)
+{
+    position = position < flow->length ? position : 0;
+    if (flow->visited[position][row])
+    {
+        return;
+    }
+
+    flow->visited[position][row] = true;
+    flow->pending[flow->num_pending].position = (uint8_t)position;
+    flow->pending[flow->num_pending].row = (uint8_t)row;
+    ++ flow->num_pending;
+}
+
+size_t protracker_remove_unreachable_rows(protracker_t* module)
+{
+    LOG_DEBUG("Removing unreachable rows...\n");
+
+    size_t length = module->song.length;
+    if (!length || !module->num_patterns)
+    {
+        return 0;
+    }
+
+    protracker_decoded_t decoded;
+    if (!protracker_decode_patterns(module, &decoded))
+    {
+        LOG_ERROR("Failed to allocate decoded pattern data.\n");
+        return 0;
+    }
+
+    uint8_t* commands = decoded.commands;
+    uint8_t* params = decoded.params;
+
+    // worklist over (position, entry row), each state is walked once
+
+    bool* reachable = calloc(module->num_patterns * PT_PATTERN_ROWS, sizeof(bool));
+    flow_t* flow = calloc(1, sizeof(flow_t));
+
+    if (!reachable || !flow)
+    {
+        LOG_ERROR("Failed to allocate reachability data.\n");
+        free(reachable);
+        free(flow);
+        protracker_decoded_release(&decoded);
+        return 0;
+    }
+
+    // E6x loop starts are kept across patterns, a loop without an E60 in its own pattern returns
+    // to a row set by any earlier E60 of the channel (or row 0)
+    uint64_t loop_rows[PT_NUM_CHANNELS];
+    for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+    {
+        loop_rows[k] = 1;
+    }
+
+    for (size_t i = 0; i < decoded.count; ++i)
+    {
+        if ((commands[i] == PT_CMD_EXTENDED) && (params[i] == (PT_ECMD_LOOP_PATTERN << 4)))
+        {
+            loop_rows[i % PT_NUM_CHANNELS] |= 1ull << ((i / PT_NUM_CHANNELS) % PT_PATTERN_ROWS);
+        }
+    }
+
+    // replayers can start the song at any position (subsongs), or restart at the restart position
+    flow->length = length;
+    for (size_t i = 0; i < length; ++i)
+    {
+        flow_push(flow, i, 0);
+    }
+
+    while (flow->num_pending)
+    {
+        flow_state_t state = flow->pending[--flow->num_pending];
+        size_t pattern = module->song.positions[state.position];
+        if (pattern >= module->num_patterns)
+        {
+            continue;
+        }
+
+        // most recent E60 per channel inside this walk (-1 = set before the pattern was entered)
+        int loop_start[PT_NUM_CHANNELS] = { -1, -1, -1, -1 };
+
+        size_t row;
+        bool jumped = false;
+        for (row = state.row; row < PT_PATTERN_ROWS && !jumped; ++row)
+        {
+            reachable[pattern * PT_PATTERN_ROWS + row] = true;
+
+            int next_position = -1, next_row = -1;
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                size_t index = PT_DECODED_INDEX(pattern, row, k);
+                uint8_t param = params[index];
+
+                switch (commands[index])
+                {
+                    case PT_CMD_POS_JUMP:
+                    {
+                        // Bxx clears a break row set by an earlier channel
+                        next_position = param;
+                        next_row = 0;
+                    }
+                    break;
+
+                    case PT_CMD_PATTERN_BREAK:
+                    {
+                        next_row = (param >> 4) * 10 + (param & 0x0f);  // decimal
+                        next_row = next_row < PT_PATTERN_ROWS ? next_row : 0;
+                    }
+                    break;
+
+                    case PT_CMD_EXTENDED:
+                    {
+                        if ((param >> 4) != PT_ECMD_LOOP_PATTERN)
+                        {
+                            break;
+                        }
+
+                        if (!(param & 0x0f))
+                        {
+                            loop_start[k] = (int)row;
+                        }
+                        else if (loop_start[k] < 0)
+                        {
+                            // the loop start comes from an earlier pattern
+                            for (size_t r = 0; r < PT_PATTERN_ROWS; ++r)
+                            {
+                                if (loop_rows[k] & (1ull << r))
+                                {
+                                    flow_push(flow, state.position, r);
+                                }
+                            }
+                        }
+                    }
+                    break;
+                }
+            }
+
+            if (next_position >= 0 || next_row >= 0)
+            {
+                size_t position = next_position >= 0 ? (size_t)next_position : state.position + 1u;
+                flow_push(flow, position, next_row >= 0 ? next_row : 0);
+                jumped = true;
+            }
+        }
+
+        if (!jumped)
+        {
+            flow_push(flow, state.position + 1u, 0);
+        }
+    }
+
+    // blank rows of patterns used by the song that are never played
+
+    bool used[256] = { false };
+    for (size_t i = 0; i < length; ++i)
+    {
+        used[module->song.positions[i]] = true;
+    }
+
+    size_t removed = 0, patterns = 0;
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        if (!used[i])
+        {
+            continue;
+        }
+
+        size_t pattern_removed = 0;
+        for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+        {
+            if (reachable[i * PT_PATTERN_ROWS + j])
+            {
+                continue;
+            }
+
+            bool empty = true;
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                size_t index = PT_DECODED_INDEX(i, j, k);
+                empty = empty && !decoded.periods[index] && !decoded.samples[index] && !commands[index] && !params[index];
+
+                decoded.periods[index] = decoded.samples[index] = commands[index] = params[index] = 0;
+            }
+
+            if (!empty)
+            {
+                ++ pattern_removed;
+            }
+        }
+
+        if (pattern_removed)
+        {
+            LOG_TRACE(" #%lu - %lu unreachable rows cleared\n", i, pattern_removed);
+            removed += pattern_removed;
+            ++ patterns;
+        }
+    }
+
+    if (removed)
+    {
+        protracker_encode_patterns(module, &decoded);
+    }
+
+    LOG_INFO("%lu unreachable rows cleared in %lu patterns.\n", removed, patterns);
+
+    free(reachable);
+    free(flow);
+    protracker_decoded_release(&decoded);
+
+    return removed;
+}
+
+void protracker_remove_unused_samples(protracker_t* module)
+{
+    LOG_DEBUG("Removing unused samples...\n");
+
+    bool used[PT_NUM_SAMPLES];
+    size_t sample_count = protracker_get_used_samples(module, used);
+
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        if (used[i] || !module->sample_headers[i].length)
+        {
+            continue;
+        }
+
+        LOG_TRACE(" #%lu - not used, removing...\n", (i+1));
+
+        free(module->sample_data[i]);
+        module->sample_data[i] = NULL;
+        module->sample_headers[i].length = 0;
+        module->sample_headers[i].repeat_offset = 0;
+        module->sample_headers[i].repeat_length = 0;
+    }
+}
+
+void protracker_trim_samples(protracker_t* module)
+{
+    LOG_DEBUG("Trimming samples...\n");
+
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        protracker_sample_t* sample = &(module->sample_headers[i]);
+        if (!sample->length || sample->repeat_length > 1)
+        {
+            continue;
+        }
+
+        const uint8_t* data = protracker_get_sample_data(module, i);
+        ssize_t sample_end;
 
         for (sample_end = (sample->length) - 1; sample_end >= 0; --sample_end)
         {
@@ -535,88 +1397,809 @@ void protracker_trim_samples(protracker_t* module)
             }
         }
 
-        size_t sample_length = (sample_end + 1);
-        if (sample_length == sample->length)
-        {
-            continue;
-        }
+        size_t sample_length = (sample_end + 1);
+        if (sample_length == sample->length)
+        {
+            continue;
+        }
+
+        LOG_TRACE(" #%lu - %lu -> %lu bytes (%lu bytes saved)\n", (i + 1), sample->length * 2, sample_length * 2, (sample->length - sample_length) * 2);
+        sample->length = sample_length;
+    }
+}
+
+static uint64_t decoded_entry(const protracker_decoded_t* decoded, size_t index)
+{
+    return ((uint64_t)decoded->periods[index] << 24) | ((uint64_t)decoded->samples[index] << 16) | ((uint64_t)decoded->commands[index] << 8) | decoded->params[index];
+}
+
+static bool same_track(const protracker_decoded_t* decoded, size_t a, size_t b)
+{
+    for (size_t j = 0; j < PT_PATTERN_ROWS * PT_NUM_CHANNELS; j += PT_NUM_CHANNELS)
+    {
+        if (decoded_entry(decoded, a + j) != decoded_entry(decoded, b + j))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *
+ * Find the first track (one channel of a pattern) of the decoded view equal to each track (hash
+ * table), tracks with a zero filter entry are only equal to themselves (filter may be NULL)
+ *
+**/
+static bool find_duplicates(size_t* first, const protracker_decoded_t* decoded, size_t num_tracks, const uint64_t* filter)
+{
+    size_t slots = 1;
+    while (slots < num_tracks * 2)
+    {
+        slots <<= 1;
+    }
+
+    size_t* table = calloc(slots, sizeof(size_t));              // track index + 1 (0 = free)
+    uint64_t* hashes = malloc((num_tracks + 1) * sizeof(uint64_t));
+    if (!table || !hashes)
+    {
+        free(table);
+        free(hashes);
+        return false;
+    }
+
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        size_t base = PT_DECODED_INDEX(t / PT_NUM_CHANNELS, 0, t % PT_NUM_CHANNELS);
+
+        first[t] = t;
+        if (filter && !filter[t])
+        {
+            continue;
+        }
+
+        // four rows at a time in independent lanes
+        uint64_t lanes[4] = { 0xcbf29ce484222325ull, 0xcbf29ce484222325ull, 0xcbf29ce484222325ull, 0xcbf29ce484222325ull };
+        for (size_t j = 0; j < PT_PATTERN_ROWS * PT_NUM_CHANNELS; j += 4 * PT_NUM_CHANNELS)
+        {
+            for (size_t l = 0; l < 4; ++l)
+            {
+                lanes[l] = (lanes[l] ^ decoded_entry(decoded, base + j + l * PT_NUM_CHANNELS)) * 0x100000001b3ull;
+            }
+        }
+
+        uint64_t hash = hash_bytes(lanes, sizeof(lanes));
+        hashes[t] = hash;
+
+        size_t slot = hash & (slots - 1);
+        for (; table[slot]; slot = (slot + 1) & (slots - 1))
+        {
+            size_t other = table[slot] - 1;
+            if ((hashes[other] == hash) && same_track(decoded, PT_DECODED_INDEX(other / PT_NUM_CHANNELS, 0, other % PT_NUM_CHANNELS), base))
+            {
+                first[t] = other;
+                break;
+            }
+        }
+
+        if (first[t] == t)
+        {
+            table[slot] = t + 1;
+        }
+    }
+
+    free(table);
+    free(hashes);
+    return true;
+}
+
+// tracks and patterns that equal an earlier one, patterns are equal if all their tracks are
+static void count_matches(const protracker_decoded_t* decoded, size_t num_patterns, size_t* tracks, size_t* patterns)
+{
+    size_t num_tracks = num_patterns * PT_NUM_CHANNELS;
+    size_t* first = malloc((num_tracks + 1) * sizeof(size_t));
+
+    *tracks = *patterns = 0;
+    if (!first || !find_duplicates(first, decoded, num_tracks, NULL))
+    {
+        free(first);
+        return;
+    }
+
+    for (size_t t = 0; t < num_tracks; ++t)
+    {
+        *tracks += first[t] != t;
+    }
+
+    size_t slots = 1;
+    while (slots < num_patterns * 2)
+    {
+        slots <<= 1;
+    }
+
+    size_t* table = calloc(slots, sizeof(size_t));              // pattern index + 1 (0 = free)
+    for (size_t i = 0; table && (i < num_patterns); ++i)
+    {
+        const size_t* key = &(first[i * PT_NUM_CHANNELS]);
+        size_t slot = hash_bytes(key, PT_NUM_CHANNELS * sizeof(size_t)) & (slots - 1);
+
+        for (; table[slot]; slot = (slot + 1) & (slots - 1))
+        {
+            if (!memcmp(&(first[(table[slot] - 1) * PT_NUM_CHANNELS]), key, PT_NUM_CHANNELS * sizeof(size_t)))
+            {
+                break;
+            }
+        }
+
+        if (table[slot])
+        {
+            ++ *patterns;
+        }
+        else
+        {
+            table[slot] = i + 1;
+        }
+    }
+
+    free(table);
+    free(first);
+}
+
+static uint8_t break_row(uint8_t param)
+{
+    uint8_t row = (param >> 4) * 10 + (param & 0x0f);   // decimal
+    return row < PT_PATTERN_ROWS ? row : 0;
+}
+
+// where Bxx/Dxx of a row continue the song (channels in skip are ignored), 0 = no change
+static uint16_t row_flow(const uint8_t* commands, const uint8_t* params, unsigned skip)
+{
+    int position = -1;      // 0x100 = next position
+    uint8_t row = 0;
+
+    for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+    {
+        if (skip & (1u << k))
+        {
+            continue;
+        }
+
+        if (commands[k] == PT_CMD_POS_JUMP)
+        {
+            position = params[k];
+            row = 0;
+        }
+        else if (commands[k] == PT_CMD_PATTERN_BREAK)
+        {
+            position = position < 0 ? 0x100 : position;
+            row = break_row(params[k]);
+        }
+    }
+
+    return position < 0 ? 0 : (uint16_t)(((position + 1) << 6) | row);
+}
+
+/**
+ *
+ * Rewrite an effect to its normal form, following the rules to_p61a_channel applies, without
+ * changing how it plays
+ *
+**/
+static void canonical_effect(uint8_t* cmd, uint8_t* param)
+{
+    uint8_t ext = *param >> 4;
+    uint8_t value = *param & 0x0f;
+
+    switch (*cmd)
+    {
+        case PT_CMD_SLIDE_UP:
+        case PT_CMD_SLIDE_DOWN:
+        {
+            if (!*param)
+            {
+                *cmd = 0;
+            }
+        }
+        break;
+
+        case PT_CMD_8:  // 8xy -> E8y (neither is played)
+        {
+            *cmd = PT_CMD_EXTENDED;
+            *param = (PT_ECMD_E8 << 4) | value;
+        }
+        break;
+
+        case PT_CMD_SET_VOLUME:
+        {
+            *param = *param > 64 ? 64 : *param;
+        }
+        break;
+
+        case PT_CMD_PATTERN_BREAK:
+        {
+            uint8_t row = break_row(*param);
+            *param = (uint8_t)(((row / 10) << 4) | (row % 10));
+        }
+        break;
+
+        case PT_CMD_EXTENDED:
+        {
+            switch (ext)
+            {
+                case PT_ECMD_FILTER:                    // only bit 0 switches the filter
+                {
+                    *param = (PT_ECMD_FILTER << 4) | (value & 1);
+                }
+                break;
+
+                case PT_ECMD_CUT_SAMPLE:                // EC0 -> C00
+                {
+                    if (!value)
+                    {
+                        *cmd = PT_CMD_SET_VOLUME;
+                        *param = 0;
+                    }
+                }
+                break;
+
+                case PT_ECMD_FINESLIDE_UP:
+                case PT_ECMD_FINESLIDE_DOWN:
+                case PT_ECMD_RETRIGGER_SAMPLE:
+                case PT_ECMD_FINE_VOLUME_SLIDE_UP:
+                case PT_ECMD_FINE_VOLUME_SLIDE_DOWN:
+                case PT_ECMD_DELAY_SAMPLE:
+                {
+                    if (!value)
+                    {
+                        *cmd = *param = 0;
+                    }
+                }
+                break;
+            }
+        }
+        break;
+    }
+}
+
+// (command << 8 | parameter) -> canonical_effect() of it, in the same form
+static uint16_t canonical_effects[0x1000];
+static bool canonical_effects_initialized = false;
 
-        LOG_TRACE(" #%lu - %lu -> %lu bytes (%lu bytes saved)\n", (i + 1), sample->length * 2, sample_length * 2, (sample->length - sample_length) * 2);
-        sample->length = sample_length;
+static void init_canonical_effects(void)
+{
+    if (canonical_effects_initialized)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < 0x1000; ++i)
+    {
+        uint8_t cmd = (uint8_t)(i >> 8);
+        uint8_t param = (uint8_t)(i & 0xff);
+        canonical_effect(&cmd, &param);
+        canonical_effects[i] = (uint16_t)((cmd << 8) | param);
     }
+
+    canonical_effects_initialized = true;
 }
 
-void protracker_clean_effects(protracker_t* module, const char* options)
+/**
+ *
+ * Speed and tempo a row is entered with, over every way the song plays it
+ *
+**/
+typedef struct
 {
-    LOG_DEBUG("Cleaning effects...\n");
+    bool played;
+    bool speed_varies;          // entered with different speeds
+    bool tempo_varies;
+    uint8_t speed;              // speed and tempo of the first way the row was entered
+    uint8_t tempo;
+} speed_entry_t;
 
-    bool clean_e8 = has_option(options, "clean:e8", false);
+typedef struct
+{
+    speed_entry_t* states;              // per (position, row)
+    uint64_t* loops;                    // per (position, row) and channel, rows an E6x may return to
+    bool* queued;
+    flow_state_t* pending;
+    size_t num_pending;
+    size_t length;                      // song length
+} speed_flow_t;
+
+// merge a way a row is entered into what is known about it, returns true if that changed
+static bool join_entry(speed_entry_t* entry, const speed_entry_t* in)
+{
+    if (!entry->played)
+    {
+        *entry = *in;
+        return true;
+    }
 
-    for (size_t i = 0; i < module->num_patterns; ++i)
+    bool speed_varies = entry->speed_varies || in->speed_varies || (entry->speed != in->speed);
+    bool tempo_varies = entry->tempo_varies || in->tempo_varies || (entry->tempo != in->tempo);
+    bool changed = (speed_varies != entry->speed_varies) || (tempo_varies != entry->tempo_varies);
+
+    entry->speed_varies = speed_varies;
+    entry->tempo_varies = tempo_varies;
+    return changed;
+}
+
+// merge a way a (position, row) state is reached, positions past the end wrap to 0, returns true if
+// the state changed
+static bool speed_flow_join(speed_flow_t* flow, size_t position, size_t row, const speed_entry_t* in, const uint64_t* loops)
+{
+    size_t state = position * PT_PATTERN_ROWS + row;
+    bool changed = join_entry(&(flow->states[state]), in);
+
+    for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
     {
-        protracker_pattern_t* pattern = &(module->patterns[i]);
+        uint64_t* rows = &(flow->loops[state * PT_NUM_CHANNELS + k]);
+        changed = changed || ((*rows | loops[k]) != *rows);
+        *rows |= loops[k];
+    }
 
-        for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+    return changed;
+}
+
+// queue a state unless it is already known to be reached like this
+static void speed_flow_push(speed_flow_t* flow, size_t position, size_t row, const speed_entry_t* in, const uint64_t* loops)
+{
+    position = position < flow->length ? position : 0;
+    size_t state = position * PT_PATTERN_ROWS + row;
+
+    if (!speed_flow_join(flow, position, row, in, loops) || flow->queued[state])
+    {
+        return;
+    }
+
+    flow->queued[state] = true;
+    flow->pending[flow->num_pending].position = (uint8_t)position;
+    flow->pending[flow->num_pending].row = (uint8_t)row;
+    ++ flow->num_pending;
+}
+
+/**
+ *
+ * Collect the speed and tempo every pattern row is entered with (entries, one per pattern row)
+ *
+ * Follows the song row by row like protracker_remove_unreachable_rows, from row 0 of every position
+ * (entered with the default speed and tempo), as Fxx only takes effect when a row is entered. Each
+ * (position, row) state keeps the speed and tempo it is entered with and the rows each channel's
+ * E6x may loop back to (E60 loop starts are kept across patterns). A state is only followed again
+ * when that grows, so every state is walked a bounded number of times.
+ *
+**/
+static bool find_entry_speeds(const protracker_t* module, const protracker_decoded_t* decoded, speed_entry_t* entries)
+{
+    size_t length = module->song.length;
+    size_t num_states = length * PT_PATTERN_ROWS;
+
+    speed_flow_t flow = { 0 };
+    flow.length = length;
+    flow.states = calloc(num_states + 1, sizeof(speed_entry_t));
+    flow.loops = calloc(num_states * PT_NUM_CHANNELS + 1, sizeof(uint64_t));
+    flow.queued = calloc(num_states + 1, sizeof(bool));
+    flow.pending = malloc((num_states + 1) * sizeof(flow_state_t));
+
+    bool success = flow.states && flow.loops && flow.queued && flow.pending;
+    if (success && length)
+    {
+        const uint8_t* commands = decoded->commands;
+        const uint8_t* params = decoded->params;
+
+        // any position can start a subsong, as in protracker_remove_unreachable_rows
+        speed_entry_t start = { true, false, false, REPLAY_DEFAULT_SPEED, REPLAY_DEFAULT_TEMPO };
+        uint64_t start_loops[PT_NUM_CHANNELS] = { 1, 1, 1, 1 };
+        for (size_t i = 0; i < length; ++i)
         {
-            protracker_pattern_row_t* row = &(pattern->rows[j]);
+            speed_flow_push(&flow, i, 0, &start, start_loops);
+        }
 
-            bool has_break = false;
-            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+        while (flow.num_pending)
+        {
+            flow_state_t state = flow.pending[--flow.num_pending];
+            size_t position = state.position;
+            size_t row = state.row;
+            flow.queued[position * PT_PATTERN_ROWS + row] = false;
+
+            speed_entry_t current = flow.states[position * PT_PATTERN_ROWS + row];
+            uint64_t loops[PT_NUM_CHANNELS];
+            memcpy(loops, &(flow.loops[(position * PT_PATTERN_ROWS + row) * PT_NUM_CHANNELS]), sizeof(loops));
+
+            size_t pattern = module->song.positions[position];
+
+            // rows of patterns missing from the module are played empty
+            if (pattern >= module->num_patterns)
             {
-                protracker_channel_t* channel = &(row->channels[k]);
-                protracker_effect_t effect = protracker_get_effect(channel);
+                speed_flow_push(&flow, position + 1u, 0, &current, loops);
+                continue;
+            }
+
+            // follow the rows while the next one is reached in a new way
+            for (;;)
+            {
+                join_entry(&(entries[pattern * PT_PATTERN_ROWS + row]), &current);
+
+                int next_position = -1, next_row = -1;
+                unsigned loop_back = 0;
+                bool stopped = false;
 
-                switch (effect.cmd)
+                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
                 {
-                    case PT_CMD_POS_JUMP:
-                    case PT_CMD_PATTERN_BREAK:
+                    size_t index = PT_DECODED_INDEX(pattern, row, k);
+                    uint8_t param = params[index];
+
+                    switch (commands[index])
                     {
-                        if (has_break)
+                        case PT_CMD_SET_SPEED:
+                        {
+                            if (!param)
+                            {
+                                stopped = true;
+                            }
+                            else if (param < 0x20)
+                            {
+                                current.speed = param;
+                                current.speed_varies = false;
+                            }
+                            else
+                            {
+                                current.tempo = param;
+                                current.tempo_varies = false;
+                            }
+                        }
+                        break;
+
+                        case PT_CMD_POS_JUMP:
+                        {
+                            next_position = param;
+                            next_row = 0;
+                        }
+                        break;
+
+                        case PT_CMD_PATTERN_BREAK:
+                        {
+                            next_position = next_position < 0 ? (int)position + 1 : next_position;
+                            next_row = break_row(param);
+                        }
+                        break;
+
+                        case PT_CMD_EXTENDED:
                         {
-                            LOG_TRACE(" (P:%lu,R:%lu,C:%lu) - Removed POS. JUMP/PAT. BREAK\n", i, j, k);
-                            memset(&effect, 0, sizeof(effect));
+                            if ((param >> 4) != PT_ECMD_LOOP_PATTERN)
+                            {
+                                break;
+                            }
+
+                            if (!(param & 0x0f))
+                            {
+                                loops[k] = 1ull << row;
+                            }
+                            else
+                            {
+                                loop_back |= 1u << k;
+                            }
                         }
-                        has_break = true;
+                        break;
                     }
+                }
+
+                // F00 ends the song
+                if (stopped)
+                {
                     break;
+                }
 
-                    case PT_CMD_EXTENDED:
+                if (next_position >= 0)
+                {
+                    speed_flow_push(&flow, (size_t)next_position, (size_t)next_row, &current, loops);
+                    break;
+                }
+
+                // loops are entered with the speed and tempo set by the row that loops back
+                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+                {
+                    for (size_t r = 0; (loop_back & (1u << k)) && (r < PT_PATTERN_ROWS); ++r)
                     {
-                        switch (effect.data.ext.cmd)
+                        if (loops[k] & (1ull << r))
                         {
-                            case PT_ECMD_E8:
-                            {
-                                if (clean_e8)
-                                {
-                                    LOG_TRACE(" (P:%lu,R:%lu,C:%lu) - Removed E8x\n", i, j, k);
-                                    memset(&effect, 0, sizeof(effect));
-                                }
-                            }
-                            break;
+                            speed_flow_push(&flow, position, r, &current, loops);
                         }
                     }
+                }
+
+                if (++row == PT_PATTERN_ROWS)
+                {
+                    speed_flow_push(&flow, position + 1u, 0, &current, loops);
                     break;
                 }
 
-                protracker_set_effect(channel, &effect);
+                if (!speed_flow_join(&flow, position, row, &current, loops))
+                {
+                    break;
+                }
             }
         }
     }
+
+    free(flow.states);
+    free(flow.loops);
+    free(flow.queued);
+    free(flow.pending);
+
+    return success;
 }
 
+/**
+ *
+ * Remove Fxx that set the speed or tempo a row is always entered with
+ *
+ * Rows are only changed if every way the song plays them (see find_entry_speeds) enters them with
+ * that speed or tempo, and no other channel sets it in the same row. Identical tracks are changed
+ * alike (only where the Fxx is redundant in all of them), so they stay identical.
+ *
+**/
+static size_t remove_redundant_speed(const protracker_t* module, protracker_decoded_t* decoded)
+{
+    size_t num_tracks = module->num_patterns * PT_NUM_CHANNELS;
+    speed_entry_t* entries = calloc(module->num_patterns * PT_PATTERN_ROWS + 1, sizeof(speed_entry_t));
+    uint64_t* redundant = malloc((num_tracks + 1) * sizeof(uint64_t));    // rows per track
+    uint64_t* speeds = calloc(num_tracks + 1, sizeof(uint64_t));         // rows per track with an Fxx
+    size_t* first = malloc((num_tracks + 1) * sizeof(size_t));
 
-typedef struct
+    uint8_t* commands = decoded->commands;
+    uint8_t* params = decoded->params;
+
+    size_t removed = 0;
+    do
+    {
+        if (!entries || !redundant || !speeds || !first)
+        {
+            LOG_ERROR("Failed to allocate speed analysis.\n");
+            break;
+        }
+
+        bool any = false;
+        for (size_t i = 0; i < module->num_patterns; ++i)
+        {
+            for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+            {
+                size_t base = PT_DECODED_INDEX(i, j, 0);
+                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+                {
+                    bool speed = (commands[base + k] == PT_CMD_SET_SPEED) && params[base + k];
+                    speeds[i * PT_NUM_CHANNELS + k] |= (uint64_t)speed << j;
+                    any = any || speed;
+                }
+            }
+        }
+
+        if (!any)
+        {
+            break;
+        }
+
+        // identical tracks have their Fxx on the same rows, tracks without any are never changed
+        if (!find_entry_speeds(module, decoded, entries) || !find_duplicates(first, decoded, num_tracks, speeds))
+        {
+            LOG_ERROR("Failed to allocate speed analysis.\n");
+            break;
+        }
+
+        for (size_t t = 0; t < num_tracks; ++t)
+        {
+            redundant[t] = ~0ull;
+        }
+
+        for (size_t i = 0; i < module->num_patterns; ++i)
+        {
+            const uint64_t* pattern_speeds = &(speeds[i * PT_NUM_CHANNELS]);
+            uint64_t rows = pattern_speeds[0] | pattern_speeds[1] | pattern_speeds[2] | pattern_speeds[3];
+
+            for (size_t j = 0; rows && (j < PT_PATTERN_ROWS); ++j)
+            {
+                if (!(rows & (1ull << j)))
+                {
+                    continue;
+                }
+
+                const speed_entry_t* entry = &(entries[i * PT_PATTERN_ROWS + j]);
+                size_t base = PT_DECODED_INDEX(i, j, 0);
+
+                size_t row_speeds = 0, row_tempos = 0;
+                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+                {
+                    if ((commands[base + k] == PT_CMD_SET_SPEED) && params[base + k])
+                    {
+                        row_speeds += params[base + k] < 0x20;
+                        row_tempos += params[base + k] >= 0x20;
+                    }
+                }
+
+                for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+                {
+                    uint8_t value = params[base + k];
+                    if ((commands[base + k] != PT_CMD_SET_SPEED) || !value)
+                    {
+                        continue;
+                    }
+
+                    // rows that are never played are left alone
+                    bool is_redundant = entry->played && ((value < 0x20) ?
+                        ((row_speeds == 1) && !entry->speed_varies && (entry->speed == value)) :
+                        ((row_tempos == 1) && !entry->tempo_varies && (entry->tempo == value)));
+
+                    if (!is_redundant)
+                    {
+                        redundant[first[i * PT_NUM_CHANNELS + k]] &= ~(1ull << j);
+                    }
+                }
+            }
+        }
+
+        for (size_t t = 0; t < num_tracks; ++t)
+        {
+            uint64_t rows = redundant[first[t]] & speeds[t];
+            size_t i = t / PT_NUM_CHANNELS, k = t % PT_NUM_CHANNELS;
+
+            for (size_t j = 0; rows && (j < PT_PATTERN_ROWS); ++j)
+            {
+                if (!(rows & (1ull << j)))
+                {
+                    continue;
+                }
+
+                size_t index = PT_DECODED_INDEX(i, j, k);
+                LOG_TRACE(" (P:%lu,R:%lu,C:%lu) - Removed redundant F%02X\n", i, j, k, params[index]);
+
+                commands[index] = params[index] = 0;
+                rows &= ~(1ull << j);
+                ++removed;
+            }
+        }
+    }
+    while (false);
+
+    free(entries);
+    free(redundant);
+    free(speeds);
+    free(first);
+
+    return removed;
+}
+
+void protracker_clean_effects(protracker_t* module, const char* options)
+{
+    LOG_DEBUG("Cleaning effects...\n");
+
+    bool clean_e8 = has_option(options, "clean:e8", false);
+
+    protracker_decoded_t decoded;
+    if (!protracker_decode_patterns(module, &decoded))
+    {
+        LOG_ERROR("Failed to allocate decoded pattern data.\n");
+        return;
+    }
+
+    // only reported, skipped unless it is logged
+    bool report = LOG_ENABLED(LOG_LEVEL_INFO);
+
+    size_t tracks_before = 0, patterns_before = 0;
+    if (report)
+    {
+        count_matches(&decoded, module->num_patterns, &tracks_before, &patterns_before);
+    }
+
+    init_canonical_effects();
+
+    uint8_t* commands = decoded.commands;
+    uint8_t* params = decoded.params;
+
+    for (size_t i = 0; i < module->num_patterns; ++i)
+    {
+        for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
+        {
+            size_t first = PT_DECODED_INDEX(i, j, 0);
+            bool has_delay = false;
+            unsigned flows = 0;     // channels with Bxx/Dxx
+
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                size_t index = first + k;
+
+                // EE0 cancels an EEx on an earlier channel
+                bool delay = (commands[index] == PT_CMD_EXTENDED) && ((params[index] >> 4) == PT_ECMD_DELAY_PATTERN);
+                if (delay && !(params[index] & 0x0f) && !has_delay)
+                {
+                    commands[index] = params[index] = 0;
+                }
+                has_delay = has_delay || delay;
+
+                uint16_t effect = canonical_effects[(commands[index] << 8) | params[index]];
+                commands[index] = (uint8_t)(effect >> 8);
+                params[index] = (uint8_t)(effect & 0xff);
+
+                if (clean_e8 && (commands[index] == PT_CMD_EXTENDED) && ((params[index] >> 4) == PT_ECMD_E8))
+                {
+                    LOG_TRACE(" (P:%lu,R:%lu,C:%lu) - Removed E8x\n", i, j, k);
+                    commands[index] = params[index] = 0;
+                }
+
+                flows |= ((commands[index] == PT_CMD_POS_JUMP) || (commands[index] == PT_CMD_PATTERN_BREAK)) << k;
+            }
+
+            if (!flows)
+            {
+                continue;
+            }
+
+            // drop Bxx/Dxx that do not change where the song continues
+            unsigned skip = 0;
+            uint16_t flow = row_flow(&(commands[first]), &(params[first]), skip);
+
+            for (size_t k = 0; k < PT_NUM_CHANNELS; ++k)
+            {
+                size_t index = first + k;
+                if (!(flows & (1u << k)))
+                {
+                    continue;
+                }
+
+                if (row_flow(&(commands[first]), &(params[first]), skip | (1u << k)) == flow)
+                {
+                    LOG_TRACE(" (P:%lu,R:%lu,C:%lu) - Removed POS. JUMP/PAT. BREAK\n", i, j, k);
+                    commands[index] = params[index] = 0;
+                    skip |= 1u << k;
+                }
+            }
+        }
+    }
+
+    size_t speeds = remove_redundant_speed(module, &decoded);
+
+    size_t tracks_after = 0, patterns_after = 0;
+    if (report)
+    {
+        count_matches(&decoded, module->num_patterns, &tracks_after, &patterns_after);
+    }
+
+    protracker_encode_patterns(module, &decoded);
+    protracker_decoded_release(&decoded);
+
+    LOG_INFO("Canonical effects: identical tracks %lu -> %lu, identical patterns %lu -> %lu (%lu Fxx removed).\n",
+        tracks_before, tracks_after, patterns_before, patterns_after, speeds);
+}
+
+/**
+ *
+ * Rewrite sample numbers in all patterns through a lookup table (PT_NUM_SAMPLES+1 entries)
+ *
+**/
+static void remap_samples(protracker_t* module, const uint8_t* table)
 {
-    uint8_t src, dest;
-} sample_replace_data;
+    protracker_decoded_t decoded;
+    if (!protracker_decode_patterns(module, &decoded))
+    {
+        LOG_ERROR("Failed to allocate decoded pattern data.\n");
+        return;
+    }
+
+    uint8_t* samples = decoded.samples;
+    for (size_t i = 0, n = decoded.count; i < n; ++i)
+    {
+        samples[i] = table[samples[i] & 0x1f];
+    }
 
-void sample_replace_filter(protracker_channel_t* channel, uint8_t index, void* data)
+    protracker_encode_patterns(module, &decoded);
+    protracker_decoded_release(&decoded);
+}
+
+static void identity_sample_table(uint8_t* table)
 {
-    sample_replace_data* internal = (sample_replace_data*)data;
-    uint8_t sample = protracker_get_sample(channel);
-    if (sample == internal->src)
+    for (size_t i = 0; i <= PT_NUM_SAMPLES; ++i)
     {
-        protracker_set_sample(channel, internal->dest);
+        table[i] = (uint8_t)i;
     }
 }
 
@@ -624,6 +2207,10 @@ void protracker_remove_identical_samples(protracker_t* module)
 {
     LOG_DEBUG("Removing identical samples...\n");
 
+    uint8_t table[PT_NUM_SAMPLES+1];
+    identity_sample_table(table);
+    bool merged = false;
+
     for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
     {
         const protracker_sample_t* src = &(module->sample_headers[i]);
@@ -648,18 +2235,15 @@ void protracker_remove_identical_samples(protracker_t* module)
                 continue;
             }
 
-            if (memcmp(module->sample_data[i], module->sample_data[j], src->length * 2))
+            if (memcmp(protracker_get_sample_data(module, i), protracker_get_sample_data(module, j), src->length * 2))
             {
                 continue;
             }
 
             LOG_TRACE(" #%lu equals #%lu, merging...\n", (i+1), (j+1));
 
-            sample_replace_data replace_data = {
-                (j+1), (i+1)
-            };
-
-            protracker_transform_notes(module, sample_replace_filter, &replace_data);
+            table[j+1] = (uint8_t)(i+1);
+            merged = true;
 
             free(module->sample_data[j]);
             module->sample_data[j] = NULL;
@@ -668,21 +2252,10 @@ void protracker_remove_identical_samples(protracker_t* module)
             module->sample_headers[j].repeat_length = 0;
         }
     }
-}
-
-typedef struct
-{
-    uint8_t sample, delta;
-} compact_sample_data;
-
-static void compact_sample_filter(protracker_channel_t* channel, uint8_t index, void* data)
-{
-    compact_sample_data* internal = (compact_sample_data*)data;
-    uint8_t sample = protracker_get_sample(channel);
 
-    if (sample == internal->sample)
+    if (merged)
     {
-        protracker_set_sample(channel, sample-internal->delta);
+        remap_samples(module, table);
     }
 }
 
@@ -693,6 +2266,10 @@ void protracker_compact_sample_indexes(protracker_t* module)
     bool used[PT_NUM_SAMPLES];
     size_t sample_count = protracker_get_used_samples(module, used);
 
+    uint8_t table[PT_NUM_SAMPLES+1];
+    identity_sample_table(table);
+    bool moved = false;
+
     for (size_t i = 0, sample_offset = 0; i < PT_NUM_SAMPLES; ++i)
     {
         size_t sample_index = sample_offset;
@@ -726,9 +2303,10 @@ void protracker_compact_sample_indexes(protracker_t* module)
 
         memcpy(&(module->sample_headers[sample_index]), &(module->sample_headers[i]), sizeof(protracker_sample_t));
         module->sample_data[sample_index] = module->sample_data[i];
+        module->sample_offsets[sample_index] = module->sample_offsets[i];
 
-        compact_sample_data compact_data = { (uint8_t)(i+1), i - sample_index };
-        protracker_transform_notes(module, compact_sample_filter, &compact_data);
+        table[i+1] = (uint8_t)(sample_index+1);
+        moved = true;
     }
 
     for (size_t i = sample_count; i < PT_NUM_SAMPLES; ++i)
@@ -736,10 +2314,18 @@ void protracker_compact_sample_indexes(protracker_t* module)
         memset(&(module->sample_headers[i]), 0, sizeof(protracker_sample_t));
         module->sample_data[i] = 0;
     }
+
+    if (moved)
+    {
+        remap_samples(module, table);
+    }
 }
 
 void protracker_transform_notes(protracker_t* module, void (*transform)(protracker_channel_t*, uint8_t index, void* data), void* data)
 {
+    protracker_invalidate(module);
+    protracker_materialize(module);
+
     for (size_t i = 0, n = module->song.length; i < n; ++i)
     {
         protracker_pattern_t* pattern = &(module->patterns[module->song.positions[i]]);
@@ -762,7 +2348,11 @@ void protracker_scan_notes(const protracker_t* module, void (*scan)(const protra
 {
     for (size_t i = 0, n = module->song.length; i < n; ++i)
     {
-        const protracker_pattern_t* pattern = &(module->patterns[module->song.positions[i]]);
+        const protracker_pattern_t* pattern = protracker_get_pattern(module, module->song.positions[i]);
+        if (!pattern)
+        {
+            continue;
+        }
 
         for (size_t j = 0; j < PT_PATTERN_ROWS; ++j)
         {
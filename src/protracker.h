@@ -95,24 +95,121 @@ typedef struct __attribute__((__packed__))
     protracker_pattern_row_t rows[PT_PATTERN_ROWS];
 } protracker_pattern_t;
 
+typedef struct
+{
+    uint32_t samples;       // bit n set if sample n is referenced (bit 0: channels without sample)
+    uint16_t commands;      // bit n set if effect command n is used (command or parameter non-zero)
+    uint16_t extended;      // bit n set if extended command En is used
+    uint16_t max_period;
+} protracker_usage_t;
+
+/**
+ *
+ * Encoded pattern data retained by a loader and decoded on first access (see protracker_get_pattern)
+ *
+ * decode - Decode patterns first..first+count-1 into the pattern array, returns false on invalid data
+ *          (invalid patterns are left empty)
+ * release - Free the loader context
+ *
+**/
+typedef struct
+{
+    void* context;
+    bool (*decode)(void* context, protracker_pattern_t* patterns, size_t first, size_t count);
+    void (*release)(void* context);
+
+    uint8_t decoded[256 / 8];   // bit n set if pattern n has been decoded
+} protracker_source_t;
+
 typedef struct __attribute__((__packed__))
 {
     protracker_header_t header;
 
     protracker_song_t song;
 
-    protracker_pattern_t* patterns;
+    protracker_pattern_t* patterns;     // access through protracker_get_pattern() unless materialized
     size_t num_patterns;
+    protracker_source_t* source;        // pending pattern data (NULL when all patterns are decoded)
+    bool patterns_invalid;              // a pattern failed to decode and was left empty
 
     protracker_sample_t sample_headers[PT_NUM_SAMPLES];
-    uint8_t* sample_data[PT_NUM_SAMPLES];
+    uint8_t* sample_data[PT_NUM_SAMPLES];       // owned sample data, access through protracker_get_sample_data()
+    uint8_t* sample_source;                     // sample area copied from the file by the loader
+    uint32_t sample_offsets[PT_NUM_SAMPLES];    // sample data in sample_source (when sample_data is NULL)
+
+    protracker_usage_t usage;   // cached, see protracker_get_usage()
+    bool usage_valid;
 } protracker_t;
 
+/**
+ *
+ * Decoded (structure-of-arrays) view of all pattern data
+ *
+ * Every array holds one entry per channel, laid out pattern by pattern, row by row, channel by
+ * channel (see PT_DECODED_INDEX). The view is a copy; changes are written back with
+ * protracker_encode_patterns().
+ *
+**/
+typedef struct
+{
+    size_t count;           // number of entries (num_patterns * PT_PATTERN_ROWS * PT_NUM_CHANNELS)
+
+    uint16_t* periods;
+    uint8_t* samples;
+    uint8_t* commands;
+    uint8_t* params;
+} protracker_decoded_t;
+
+#define PT_DECODED_INDEX(pattern, row, channel) ((((pattern) * PT_PATTERN_ROWS) + (row)) * PT_NUM_CHANNELS + (channel))
+
+/**
+ *
+ * Module information gathered from headers only (see protracker_probe)
+ *
+**/
+typedef struct
+{
+    char name[21];
+    size_t samples;             // samples with data
+    size_t sample_bytes;        // total sample data in bytes (uncompressed)
+    size_t song_length;
+    size_t patterns;            // patterns stored in the file
+    size_t file_size;
+    size_t expected_size;       // file size implied by the headers (0 if unknown)
+} protracker_info_t;
+
+#define PT_HEADER_SIZE (sizeof(protracker_header_t) + sizeof(protracker_sample_t) * PT_NUM_SAMPLES + sizeof(protracker_song_t) + 4)
+
 void protracker_create(protracker_t* module);
 void protracker_destroy(protracker_t* module);
 void protracker_free(protracker_t* module);
 
 protracker_t* protracker_load(const buffer_t* buffer);
+
+/**
+ *
+ * Check how likely data is a ProTracker module
+ *
+ * data - Start of the file (PT_HEADER_SIZE bytes are enough)
+ * size - Bytes available in data
+ * file_size - Size of the whole file
+ *
+ * Returns confidence from 0 (not a module) to 100
+ *
+**/
+unsigned protracker_sniff(const uint8_t* data, size_t size, size_t file_size);
+
+/**
+ *
+ * Read module information from the headers of a file without loading it
+ *
+ * fd - File descriptor (must support pread, only the first PT_HEADER_SIZE bytes are read)
+ * info - Output information
+ *
+ * Returns false if the headers are invalid
+ *
+**/
+bool protracker_probe(int fd, protracker_info_t* info);
 bool protracker_convert(buffer_t* buffer, const protracker_t* module, const char* opts);
 
 uint8_t protracker_get_sample(const protracker_channel_t* channel);
@@ -123,6 +220,86 @@ void protracker_set_sample(protracker_channel_t* channel, uint8_t sample);
 void protracker_set_period(protracker_channel_t* channel, uint16_t period);
 void protracker_set_effect(protracker_channel_t* channel, const protracker_effect_t* effect);
 
+/**
+ *
+ * Get sample data, either owned by the sample or referencing the sample area of the loaded file
+ *
+ * module - ProTracker module
+ * index - Sample index (0..PT_NUM_SAMPLES-1)
+ *
+ * Returns NULL if the sample is empty
+ *
+**/
+const uint8_t* protracker_get_sample_data(const protracker_t* module, size_t index);
+
+/**
+ *
+ * Get a pattern, decoding it from the loader's source data on first access
+ *
+ * A pattern that fails to decode is reported by the loader, left empty and flags the module
+ * (patterns_invalid).
+ *
+ * module - ProTracker module
+ * index - Pattern index
+ *
+ * Returns NULL if the index is out of range
+ *
+**/
+const protracker_pattern_t* protracker_get_pattern(const protracker_t* module, size_t index);
+
+/**
+ *
+ * Decode all pending patterns and drop the source data, after which module->patterns can be
+ * accessed directly (all protracker_* transforms do this themselves)
+ *
+ * Returns false if any pattern failed to decode
+ *
+**/
+bool protracker_materialize(const protracker_t* module);
+
+/**
+ *
+ * Decode all patterns into a structure-of-arrays view
+ *
+ * module - ProTracker module
+ * decoded - Output view (release with protracker_decoded_release)
+ *
+ * Returns false if allocation failed
+ *
+**/
+bool protracker_decode_patterns(const protracker_t* module, protracker_decoded_t* decoded);
+
+/**
+ *
+ * Re-pack a decoded view into the pattern data of a module
+ *
+**/
+void protracker_encode_patterns(protracker_t* module, const protracker_decoded_t* decoded);
+
+/**
+ *
+ * Release memory held by a decoded view
+ *
+**/
+void protracker_decoded_release(protracker_decoded_t* decoded);
+
+/**
+ *
+ * Get sample, effect and period usage of all patterns referenced by the song
+ *
+ * The result is cached on the module until protracker_invalidate() is called.
+ *
+**/
+protracker_usage_t protracker_get_usage(const protracker_t* module);
+
+/**
+ *
+ * Drop cached analysis results, must be called after pattern data or song positions were modified
+ * (all protracker_* transforms do this themselves)
+ *
+**/
+void protracker_invalidate(protracker_t* module);
+
 /**
  *
  * Get sample usage in tune
@@ -135,6 +312,15 @@ void protracker_set_effect(protracker_channel_t* channel, const protracker_effec
 **/
 size_t protracker_get_used_samples(const protracker_t* module, bool* usage);
 
+/**
+ *
+ * module - ProTracker module
+ *
+ * returns size of the module in bytes when exported as ProTracker module
+ *
+**/
+size_t protracker_get_size(const protracker_t* module);
+
 /**
  *
  * module - ProTracker module
@@ -151,6 +337,30 @@ size_t protracker_get_pattern_count(const protracker_t* module);
 **/
 void protracker_remove_unused_patterns(protracker_t* module);
 
+/**
+ *
+ * Merge byte-identical patterns, rewriting song positions to the first of each
+ *
+ * Patterns are found through a hash table, so the cost is linear in the number of patterns.
+ *
+ * Returns number of patterns removed
+ *
+**/
+size_t protracker_remove_identical_patterns(protracker_t* module);
+
+/**
+ *
+ * Clear rows that are never played
+ *
+ * Follows the song from row 0 of every position (a replayer may start a subsong at any of them)
+ * through Bxx/Dxx (including Dxx entry rows) and E6x loops, and blanks the rows skipped by Bxx/Dxx
+ * that are never entered.
+ *
+ * Returns number of rows cleared
+ *
+**/
+size_t protracker_remove_unreachable_rows(protracker_t* module);
+
 /**
  *
  * Remove samples from module that are not by any pattern (sample index is preserved)
@@ -183,6 +393,14 @@ void protracker_trim_samples(protracker_t* module);
  *
  * Clean effects, removing unnecessary effects and downgrading them to simpler variations
  *
+ * Every effect is rewritten to one normal form (the rules the P61A converter applies), so rows that
+ * play the same become byte-identical: no-op slides, retriggers and delays are removed, Cxx is
+ * clamped to 64, 8xy becomes E8y, EC0 becomes C00, Dxx rows are written in decimal, and Bxx/Dxx or
+ * Fxx that do not change playback are removed. Identical tracks and patterns before and after are
+ * reported.
+ *
+ * options - "clean:e8" also removes E8x
+ *
 **/
 void protracker_clean_effects(protracker_t* module, const char* options);
 
@@ -210,3 +428,13 @@ void protracker_scan_notes(const protracker_t* module, void (*scan)(const protra
  *
 **/
 void protracker_channel_to_text(const protracker_channel_t* channel, char *out, size_t buflen);
+
+/**
+ *
+ * Dump a pattern at trace level (formats every channel, so guard calls with LOG_ENABLED)
+ *
+ * pattern - Pattern to dump
+ * index - Pattern index (for the heading)
+ *
+**/
+void protracker_trace_pattern(const protracker_pattern_t* pattern, size_t index);
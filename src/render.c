@@ -0,0 +1,238 @@
+#include "render.h"
+#include "replay.h"
+#include "endianness.h"
+#include "log.h"
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define RENDER_MIN_RATE (8000)
+#define RENDER_MAX_RATE (192000)
+
+// longest tick (tempo 32) at the highest rate, rounded up to a multiple of 8 frames
+#define RENDER_MAX_TICK_FRAMES (((RENDER_MAX_RATE * 5) / (2 * 32) + 8) & ~7)
+
+typedef struct
+{
+    const int8_t* data;     // sample data (NULL = silent)
+    uint32_t end;           // end of the part currently played in bytes
+    uint32_t loop_start;    // loop in bytes (loop_length 0 = no loop)
+    uint32_t loop_length;
+
+    uint64_t pos;           // 32.32 fixed point position in bytes
+    uint64_t step;          // 32.32 fixed point bytes per output frame
+    int16_t volume;         // 0-64
+} render_voice_t;
+
+typedef struct
+{
+    render_voice_t voices[PT_NUM_CHANNELS];
+
+    int16_t channels[PT_NUM_CHANNELS][RENDER_MAX_TICK_FRAMES];
+} render_state_t;
+
+static void start_voice(render_voice_t* voice, const protracker_t* module, const replay_channel_t* channel)
+{
+    voice->data = NULL;
+
+    const uint8_t* data = channel->sample ? protracker_get_sample_data(module, channel->sample - 1) : NULL;
+    if (!data)
+    {
+        return;
+    }
+
+    const protracker_sample_t* sample = &(module->sample_headers[channel->sample - 1]);
+    uint32_t length = sample->length * 2;
+    uint32_t loop_start = sample->repeat_offset * 2;
+    uint32_t loop_end = loop_start + sample->repeat_length * 2;
+
+    loop_end = loop_end < length ? loop_end : length;
+
+    voice->data = (const int8_t*)data;
+    voice->loop_start = loop_start;
+    voice->loop_length = (sample->repeat_length > 1) && (loop_end > loop_start) ? loop_end - loop_start : 0;
+    voice->end = voice->loop_length ? loop_end : length;       // ProTracker plays looped samples up to the loop end
+    voice->pos = (uint64_t)channel->start << 32;
+}
+
+static void resample_voice(render_voice_t* voice, int16_t* out, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        if (!voice->data || !voice->step)
+        {
+            memset(out + i, 0, (count - i) * sizeof(int16_t));
+            return;
+        }
+
+        uint64_t end = (uint64_t)voice->end << 32;
+        if (voice->pos >= end)
+        {
+            if (!voice->loop_length)
+            {
+                voice->data = NULL;
+                continue;
+            }
+
+            voice->pos = ((uint64_t)voice->loop_start << 32) + (voice->pos - end) % ((uint64_t)voice->loop_length << 32);
+            voice->end = voice->loop_start + voice->loop_length;
+            continue;
+        }
+
+        // frames until the end of the current part
+        uint64_t frames = (end - voice->pos + voice->step - 1) / voice->step;
+        size_t n = (frames < count - i) ? (size_t)frames : count - i;
+
+        const int8_t* data = voice->data;
+        int16_t volume = voice->volume;
+        uint64_t pos = voice->pos, step = voice->step;
+
+        for (size_t j = 0; j < n; ++j)
+        {
+            out[i + j] = (int16_t)(data[pos >> 32] * volume);
+            pos += step;
+        }
+
+        voice->pos = pos;
+        i += n;
+    }
+}
+
+// left = channel 1 + 4, right = channel 2 + 3 (each channel is sample * volume, 14 bits)
+static void mix_frames(const render_state_t* state, int16_t* out, size_t count)
+{
+    const int16_t* c0 = state->channels[0];
+    const int16_t* c1 = state->channels[1];
+    const int16_t* c2 = state->channels[2];
+    const int16_t* c3 = state->channels[3];
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i left = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(c0 + i)), _mm_loadu_si128((const __m128i*)(c3 + i)));
+        __m128i right = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(c1 + i)), _mm_loadu_si128((const __m128i*)(c2 + i)));
+
+        left = _mm_slli_epi16(left, 1);
+        right = _mm_slli_epi16(right, 1);
+
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi16(left, right));
+        _mm_storeu_si128((__m128i*)(out + i * 2 + 8), _mm_unpackhi_epi16(left, right));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        out[i * 2] = (int16_t)((c0[i] + c3[i]) * 2);
+        out[i * 2 + 1] = (int16_t)((c1[i] + c2[i]) * 2);
+    }
+}
+
+bool render_pcm(buffer_t* buffer, const protracker_t* module, unsigned rate)
+{
+    if ((rate < RENDER_MIN_RATE) || (rate > RENDER_MAX_RATE))
+    {
+        LOG_ERROR("Sample rate %u out of range (%u-%u).\n", rate, RENDER_MIN_RATE, RENDER_MAX_RATE);
+        return false;
+    }
+
+    render_state_t* state = calloc(1, sizeof(render_state_t));
+    if (!state)
+    {
+        LOG_ERROR("Failed to allocate render state.\n");
+        return false;
+    }
+
+    replay_t replay;
+    replay_init(&replay, module);
+
+    // frames per tick are rate * 2.5 / tempo, the remainder is carried over
+    size_t remainder = 0;
+    size_t frames_total = 0;
+
+    while ((replay.ticks < REPLAY_MAX_TICKS) && replay_tick(&replay))
+    {
+        for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+        {
+            const replay_channel_t* channel = &(replay.channels[i]);
+            render_voice_t* voice = &(state->voices[i]);
+
+            if (channel->trigger)
+            {
+                start_voice(voice, module, channel);
+            }
+
+            voice->volume = channel->output_volume;
+            voice->step = channel->output_period ? ((uint64_t)REPLAY_PAL_CLOCK << 32) / ((uint64_t)channel->output_period * rate) : 0;
+        }
+
+        remainder += (size_t)rate * 5;
+        size_t frames = remainder / (replay.tempo * 2u);
+        remainder -= frames * replay.tempo * 2u;
+
+        for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+        {
+            resample_voice(&(state->voices[i]), state->channels[i], frames);
+        }
+
+        int16_t* out = buffer_alloc(buffer, frames * 2 * sizeof(int16_t));
+        mix_frames(state, out, frames);
+
+        for (size_t i = 0; i < frames * 2; ++i)
+        {
+            out[i] = (int16_t)end_htole16((uint16_t)out[i]);
+        }
+
+        frames_total += frames;
+    }
+
+    LOG_DEBUG("Rendered %lu frames (%.3f seconds).\n", frames_total, replay.seconds);
+
+    free(state);
+    return true;
+}
+
+static void put_le16(uint8_t* out, uint16_t value)
+{
+    value = end_htole16(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+static void put_le32(uint8_t* out, uint32_t value)
+{
+    value = end_htole32(value);
+    memcpy(out, &value, sizeof(value));
+}
+
+bool render_wav(buffer_t* buffer, const protracker_t* module, unsigned rate)
+{
+    size_t header = buffer_count(buffer);
+    buffer_alloc(buffer, 44);
+
+    if (!render_pcm(buffer, module, rate))
+    {
+        return false;
+    }
+
+    uint32_t data_size = (uint32_t)(buffer_count(buffer) - header - 44);
+    uint8_t* out = buffer_get(buffer, header);
+
+    memcpy(out, "RIFF", 4);
+    put_le32(out + 4, 36 + data_size);
+    memcpy(out + 8, "WAVEfmt ", 8);
+    put_le32(out + 16, 16);                 // format chunk size
+    put_le16(out + 20, 1);                  // PCM
+    put_le16(out + 22, 2);                  // channels
+    put_le32(out + 24, rate);
+    put_le32(out + 28, rate * 2 * 2);       // bytes per second
+    put_le16(out + 32, 2 * 2);              // bytes per frame
+    put_le16(out + 34, 16);                 // bits per sample
+    memcpy(out + 36, "data", 4);
+    put_le32(out + 40, data_size);
+
+    return true;
+}
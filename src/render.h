@@ -0,0 +1,30 @@
+#pragma once
+
+#include "protracker.h"
+#include "buffer.h"
+
+#define RENDER_DEFAULT_RATE (44100)
+
+/**
+ *
+ * Render a module to 16-bit stereo PCM (interleaved, little endian)
+ *
+ * Channels are resampled like Paula does (nearest sample at clock / period), channels 1 and 4 are
+ * mixed to the left and channels 2 and 3 to the right. The song is played until it loops or stops
+ * (see replay_run).
+ *
+ * buffer - Output buffer (byte elements), samples are appended
+ * module - ProTracker module
+ * rate - Output sample rate in Hz (8000-192000)
+ *
+ * Returns false if the rate is out of range
+ *
+**/
+bool render_pcm(buffer_t* buffer, const protracker_t* module, unsigned rate);
+
+/**
+ *
+ * Render a module to a WAV file (see render_pcm)
+ *
+**/
+bool render_wav(buffer_t* buffer, const protracker_t* module, unsigned rate);
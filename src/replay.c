@@ -0,0 +1,794 @@
+#include "replay.h"
+#include "log.h"
+
+#include <string.h>
+
+#define REPLAY_NOTES (36)
+
+// ProTracker period table (finetune 0, octaves 1-3)
+static const uint16_t base_periods[REPLAY_NOTES] = {
+    856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+    428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+    214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113
+};
+
+static const uint8_t vibrato_sine[32] = {
+      0,  24,  49,  74,  97, 120, 141, 161, 180, 197, 212, 224, 235, 244, 250, 253,
+    255, 253, 250, 244, 235, 224, 212, 197, 180, 161, 141, 120,  97,  74,  49,  24
+};
+
+// periods per finetune (0-7 = 0..+7, 8-15 = -8..-1), derived from the base table in 1/8 semitone steps
+static uint16_t tuned_periods[16][REPLAY_NOTES];
+
+// period -> note index + 1 in the base table, 0 if the period is not a note
+static uint8_t period_notes[0x1000];
+static bool tables_initialized = false;
+
+static void init_tables(void)
+{
+    if (tables_initialized)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < REPLAY_NOTES; ++i)
+    {
+        period_notes[base_periods[i]] = (uint8_t)(i + 1);
+    }
+
+    for (size_t i = 0; i < 16; ++i)
+    {
+        int finetune = i < 8 ? (int)i : (int)i - 16;
+
+        // 2^(-1/96) and 2^(1/96)
+        double factor = 1.0;
+        double step = finetune > 0 ? 0.9928057204912689 : 1.007246412223704;
+        for (int j = 0; j < (finetune > 0 ? finetune : -finetune); ++j)
+        {
+            factor *= step;
+        }
+
+        for (size_t j = 0; j < REPLAY_NOTES; ++j)
+        {
+            tuned_periods[i][j] = (uint16_t)(base_periods[j] * factor + 0.5);
+        }
+    }
+
+    tables_initialized = true;
+}
+
+// periods outside of the note table are played as they are
+static uint16_t tune_period(uint16_t period, uint8_t finetune)
+{
+    uint8_t note = period < sizeof(period_notes) ? period_notes[period] : 0;
+    return note ? tuned_periods[finetune][note - 1] : period;
+}
+
+// note index of the first table entry at or below the period (like ProTracker's table search)
+static size_t find_note(uint16_t period, uint8_t finetune)
+{
+    const uint16_t* table = tuned_periods[finetune];
+    for (size_t i = 0; i < REPLAY_NOTES; ++i)
+    {
+        if (table[i] <= period)
+        {
+            return i;
+        }
+    }
+
+    return REPLAY_NOTES - 1;
+}
+
+static uint8_t clamp_volume(int volume)
+{
+    return (uint8_t)(volume < 0 ? 0 : (volume > 64 ? 64 : volume));
+}
+
+static uint16_t clamp_period(int period)
+{
+    return (uint16_t)(period < REPLAY_MIN_PERIOD ? REPLAY_MIN_PERIOD : (period > REPLAY_MAX_PERIOD ? REPLAY_MAX_PERIOD : period));
+}
+
+static void trigger(replay_channel_t* channel, uint32_t start)
+{
+    channel->trigger = true;
+    channel->start = start;
+
+    if (!(channel->vibrato_wave & 4))
+    {
+        channel->vibrato_pos = 0;
+    }
+    if (!(channel->tremolo_wave & 4))
+    {
+        channel->tremolo_pos = 0;
+    }
+}
+
+// waveform amplitude (0-255) at a vibrato/tremolo position (0-63)
+static int waveform(uint8_t wave, uint8_t pos)
+{
+    switch (wave & 3)
+    {
+        case 1:
+        {
+            int ramp = (pos & 31) << 3;
+            return (pos & 32) ? 255 - ramp : ramp;
+        }
+        case 2:
+            return 255;
+        default:
+            return vibrato_sine[pos & 31];
+    }
+}
+
+static void volume_slide(replay_channel_t* channel)
+{
+    uint8_t up = channel->param >> 4, down = channel->param & 0x0f;
+    channel->volume = clamp_volume(up ? channel->volume + up : channel->volume - down);
+}
+
+static void tone_portamento(replay_channel_t* channel)
+{
+    uint16_t target = channel->porta_target;
+    if (target && channel->porta_speed)
+    {
+        if (channel->period < target)
+        {
+            int period = channel->period + channel->porta_speed;
+            channel->period = (uint16_t)(period > target ? target : period);
+        }
+        else if (channel->period > target)
+        {
+            int period = channel->period - channel->porta_speed;
+            channel->period = (uint16_t)(period < target ? target : period);
+        }
+    }
+
+    channel->output_period = channel->glissando ? tuned_periods[channel->finetune][find_note(channel->period, channel->finetune)] : channel->period;
+}
+
+static void vibrato(replay_channel_t* channel)
+{
+    uint8_t pos = channel->vibrato_pos;
+    int delta = (waveform(channel->vibrato_wave, pos) * (channel->vibrato_param & 0x0f)) >> 7;
+
+    channel->output_period = (uint16_t)((pos & 32) ? channel->period - delta : channel->period + delta);
+    channel->vibrato_pos = (pos + (channel->vibrato_param >> 4)) & 63;
+}
+
+static void tremolo(replay_channel_t* channel)
+{
+    uint8_t pos = channel->tremolo_pos;
+    int delta = (waveform(channel->tremolo_wave, pos) * (channel->tremolo_param & 0x0f)) >> 6;
+
+    channel->output_volume = clamp_volume((pos & 32) ? channel->volume - delta : channel->volume + delta);
+    channel->tremolo_pos = (pos + (channel->tremolo_param >> 4)) & 63;
+}
+
+// effects running on every tick but the first one of a row (and on the first tick of EEx repeats)
+static void update_channel(replay_t* replay, replay_channel_t* channel)
+{
+    uint8_t param = channel->param;
+    uint8_t ext = param >> 4, value = param & 0x0f;
+
+    channel->output_period = channel->period;
+
+    switch (channel->cmd)
+    {
+        case PT_CMD_ARPEGGIO:
+        {
+            size_t step = replay->tick % 3;
+            if (param && step)
+            {
+                size_t note = find_note(channel->period, channel->finetune) + (step == 1 ? ext : value);
+                channel->output_period = tuned_periods[channel->finetune][note < REPLAY_NOTES ? note : REPLAY_NOTES - 1];
+            }
+        }
+        break;
+
+        case PT_CMD_SLIDE_UP:
+            channel->output_period = channel->period = clamp_period(channel->period - param);
+            break;
+
+        case PT_CMD_SLIDE_DOWN:
+            channel->output_period = channel->period = clamp_period(channel->period + param);
+            break;
+
+        case PT_CMD_SLIDE_TO_NOTE:
+            tone_portamento(channel);
+            break;
+
+        case PT_CMD_VIBRATO:
+            vibrato(channel);
+            break;
+
+        case PT_CMD_CONTINUE_SLIDE:
+            tone_portamento(channel);
+            volume_slide(channel);
+            break;
+
+        case PT_CMD_CONTINUE_VIBRATO:
+            vibrato(channel);
+            volume_slide(channel);
+            break;
+
+        case PT_CMD_VOLUME_SLIDE:
+            volume_slide(channel);
+            break;
+
+        case PT_CMD_EXTENDED:
+        {
+            if ((ext == PT_ECMD_RETRIGGER_SAMPLE) && value && !(replay->tick % value))
+            {
+                trigger(channel, 0);
+            }
+            else if ((ext == PT_ECMD_CUT_SAMPLE) && (replay->tick == value))
+            {
+                channel->volume = 0;
+            }
+            else if ((ext == PT_ECMD_DELAY_SAMPLE) && (replay->tick == value) && channel->delayed_period)
+            {
+                channel->output_period = channel->period = channel->delayed_period;
+                channel->delayed_period = 0;
+                trigger(channel, 0);
+            }
+        }
+        break;
+    }
+
+    channel->output_volume = channel->volume;
+    if (channel->cmd == PT_CMD_TREMOLO)
+    {
+        tremolo(channel);
+    }
+}
+
+// new note and effects on the first tick of a row
+static void start_channel(replay_t* replay, replay_channel_t* channel, const protracker_channel_t* data)
+{
+    const protracker_t* module = replay->module;
+
+    uint8_t sample = protracker_get_sample(data);
+    uint16_t period = protracker_get_period(data);
+    protracker_effect_t effect = protracker_get_effect(data);
+
+    uint8_t cmd = effect.cmd, param = effect.data.value;
+    uint8_t ext = param >> 4, value = param & 0x0f;
+
+    channel->cmd = cmd;
+    channel->param = param;
+    channel->delayed_period = 0;
+
+    if (sample && sample <= PT_NUM_SAMPLES)
+    {
+        const protracker_sample_t* header = &(module->sample_headers[sample - 1]);
+        channel->sample = sample;
+        channel->volume = clamp_volume(header->volume);
+        channel->finetune = header->finetone & 0x0f;
+    }
+
+    if ((cmd == PT_CMD_EXTENDED) && (ext == PT_ECMD_SET_FINETUNE_VALUE))
+    {
+        channel->finetune = value;
+    }
+
+    if ((cmd == PT_CMD_SET_SAMPLE_OFS) && param)
+    {
+        channel->offset_param = param;
+    }
+
+    if (period)
+    {
+        uint16_t tuned = tune_period(period, channel->finetune);
+
+        if ((cmd == PT_CMD_SLIDE_TO_NOTE) || (cmd == PT_CMD_CONTINUE_SLIDE))
+        {
+            channel->porta_target = tuned;
+        }
+        else if ((cmd == PT_CMD_EXTENDED) && (ext == PT_ECMD_DELAY_SAMPLE) && value)
+        {
+            channel->delayed_period = tuned;
+        }
+        else
+        {
+            channel->period = tuned;
+            trigger(channel, (cmd == PT_CMD_SET_SAMPLE_OFS) ? (uint32_t)channel->offset_param << 8 : 0);
+        }
+    }
+
+    switch (cmd)
+    {
+        case PT_CMD_SLIDE_TO_NOTE:
+        {
+            if (param)
+            {
+                channel->porta_speed = param;
+            }
+        }
+        break;
+
+        case PT_CMD_VIBRATO:
+        case PT_CMD_TREMOLO:
+        {
+            uint8_t* memory = (cmd == PT_CMD_VIBRATO) ? &(channel->vibrato_param) : &(channel->tremolo_param);
+            if (value)
+            {
+                *memory = (*memory & 0xf0) | value;
+            }
+            if (ext)
+            {
+                *memory = (*memory & 0x0f) | (ext << 4);
+            }
+        }
+        break;
+
+        case PT_CMD_POS_JUMP:
+        {
+            replay->next_position = param;
+            replay->next_row = 0;
+        }
+        break;
+
+        case PT_CMD_SET_VOLUME:
+        {
+            channel->volume = clamp_volume(param);
+        }
+        break;
+
+        case PT_CMD_PATTERN_BREAK:
+        {
+            int row = (param >> 4) * 10 + (param & 0x0f);  // decimal
+
+            if (replay->next_position < 0)
+            {
+                replay->next_position = replay->position + 1;
+            }
+            replay->next_row = row < PT_PATTERN_ROWS ? row : 0;
+        }
+        break;
+
+        case PT_CMD_SET_SPEED:
+        {
+            if (!param)
+            {
+                replay->stopped = true;
+            }
+            else if (param < 0x20)
+            {
+                replay->speed = param;
+            }
+            else
+            {
+                replay->tempo = param;
+            }
+        }
+        break;
+
+        case PT_CMD_EXTENDED:
+        {
+            switch (ext)
+            {
+                case PT_ECMD_FINESLIDE_UP:
+                    channel->period = clamp_period(channel->period - value);
+                    break;
+
+                case PT_ECMD_FINESLIDE_DOWN:
+                    channel->period = clamp_period(channel->period + value);
+                    break;
+
+                case PT_ECMD_SET_GLISSANDO:
+                    channel->glissando = value != 0;
+                    break;
+
+                case PT_ECMD_SET_VIBRATO_WAVEFORM:
+                    channel->vibrato_wave = value;
+                    break;
+
+                case PT_ECMD_SET_TREMOLO_WAVEFORM:
+                    channel->tremolo_wave = value;
+                    break;
+
+                case PT_ECMD_FINE_VOLUME_SLIDE_UP:
+                    channel->volume = clamp_volume(channel->volume + value);
+                    break;
+
+                case PT_ECMD_FINE_VOLUME_SLIDE_DOWN:
+                    channel->volume = clamp_volume(channel->volume - value);
+                    break;
+
+                case PT_ECMD_CUT_SAMPLE:
+                {
+                    if (!value)
+                    {
+                        channel->volume = 0;
+                    }
+                }
+                break;
+
+                case PT_ECMD_DELAY_PATTERN:
+                    replay->delay = value;
+                    break;
+
+                case PT_ECMD_LOOP_PATTERN:
+                {
+                    if (!value)
+                    {
+                        channel->loop_row = replay->row;
+                    }
+                    else if (!channel->loop_count)
+                    {
+                        channel->loop_count = value;
+                        replay->loop_row = channel->loop_row;
+                    }
+                    else if (-- channel->loop_count)
+                    {
+                        replay->loop_row = channel->loop_row;
+                    }
+                }
+                break;
+            }
+        }
+        break;
+    }
+
+    channel->output_period = channel->period;
+    channel->output_volume = channel->volume;
+}
+
+// enter the row at the current position, returns false if it was played before
+static bool enter_row(replay_t* replay)
+{
+    const protracker_t* module = replay->module;
+
+    if ((replay->position >= module->song.length) || (replay->visited[replay->position] & (1ull << replay->row)))
+    {
+        return false;
+    }
+
+    replay->visited[replay->position] |= 1ull << replay->row;
+    replay->pattern = module->song.positions[replay->position];
+    replay->next_position = -1;
+    replay->next_row = -1;
+    replay->loop_row = -1;
+    ++ replay->rows;
+
+    const protracker_pattern_t* pattern = protracker_get_pattern(module, replay->pattern);
+    for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+    {
+        static const protracker_channel_t empty = { { 0, 0, 0, 0 } };
+        start_channel(replay, &(replay->channels[i]), pattern ? &(pattern->rows[replay->row].channels[i]) : &empty);
+    }
+
+    return true;
+}
+
+static void advance_row(replay_t* replay)
+{
+    if (replay->next_position >= 0)
+    {
+        replay->position = (uint8_t)replay->next_position;
+        replay->row = (uint8_t)replay->next_row;
+    }
+    else if (replay->loop_row >= 0)
+    {
+        // rows inside the loop are played again on purpose
+        for (int i = replay->loop_row; i <= replay->row; ++i)
+        {
+            replay->visited[replay->position] &= ~(1ull << i);
+        }
+        replay->row = (uint8_t)replay->loop_row;
+    }
+    else if (++ replay->row >= PT_PATTERN_ROWS)
+    {
+        replay->row = 0;
+        ++ replay->position;
+    }
+
+    if (replay->position >= replay->module->song.length)
+    {
+        replay->position = 0;
+    }
+}
+
+void replay_init(replay_t* replay, const protracker_t* module)
+{
+    init_tables();
+
+    memset(replay, 0, sizeof(replay_t));
+
+    replay->module = module;
+    replay->speed = REPLAY_DEFAULT_SPEED;
+    replay->tempo = REPLAY_DEFAULT_TEMPO;
+    replay->next_position = -1;
+    replay->next_row = -1;
+    replay->loop_row = -1;
+}
+
+bool replay_tick(replay_t* replay)
+{
+    if (replay->ended)
+    {
+        return false;
+    }
+
+    replay->entered = false;
+
+    if (!replay->ticks)
+    {
+        replay->entered = true;
+    }
+    else if (++ replay->tick >= replay->speed)
+    {
+        replay->tick = 0;
+
+        if (replay->delay)
+        {
+            -- replay->delay;
+            replay->repeat = true;
+        }
+        else
+        {
+            replay->repeat = false;
+            replay->entered = true;
+            advance_row(replay);
+        }
+    }
+
+    for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+    {
+        replay->channels[i].trigger = false;
+    }
+
+    if (replay->entered)
+    {
+        if (!enter_row(replay))
+        {
+            replay->entered = false;
+            replay->ended = true;
+            return false;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+        {
+            update_channel(replay, &(replay->channels[i]));
+        }
+    }
+
+    ++ replay->ticks;
+    replay->seconds += replay_tick_seconds(replay);
+
+    // F00 ends the song after the first tick of its row
+    if (replay->stopped)
+    {
+        replay->ended = true;
+    }
+
+    return true;
+}
+
+double replay_tick_seconds(const replay_t* replay)
+{
+    return 2.5 / replay->tempo;
+}
+
+bool replay_run(const protracker_t* module, const replay_visitor_t* visitor, replay_t* result)
+{
+    replay_t replay;
+    replay_init(&replay, module);
+
+    while ((replay.ticks < REPLAY_MAX_TICKS) && replay_tick(&replay))
+    {
+        if (visitor && visitor->row && replay.entered)
+        {
+            visitor->row(&replay, visitor->data);
+        }
+        if (visitor && visitor->tick)
+        {
+            visitor->tick(&replay, visitor->data);
+        }
+    }
+
+    bool ended = replay.ended;
+    if (!ended)
+    {
+        LOG_WARN("Song did not end within %u ticks.\n", REPLAY_MAX_TICKS);
+    }
+
+    if (result)
+    {
+        memcpy(result, &replay, sizeof(replay_t));
+    }
+
+    return ended;
+}
+
+double replay_duration(const protracker_t* module)
+{
+    replay_t replay;
+    replay_run(module, NULL, &replay);
+
+    return replay.seconds;
+}
+
+// bytes of a sample that can be played (looped samples stop at the loop end)
+static size_t played_length(const protracker_sample_t* sample)
+{
+    size_t length = sample->length * 2;
+    if (sample->repeat_length > 1)
+    {
+        size_t loop_end = (sample->repeat_offset + sample->repeat_length) * 2;
+        length = loop_end < length ? loop_end : length;
+    }
+    return length;
+}
+
+static bool is_zero(const uint8_t* data, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        if (data[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// sample indexes are 1-31, 0 = no sample
+static bool samples_equal(const protracker_t* a, size_t index_a, const protracker_t* b, size_t index_b)
+{
+    const uint8_t* data_a = index_a ? protracker_get_sample_data(a, index_a - 1) : NULL;
+    const uint8_t* data_b = index_b ? protracker_get_sample_data(b, index_b - 1) : NULL;
+
+    size_t length_a = data_a ? played_length(&(a->sample_headers[index_a - 1])) : 0;
+    size_t length_b = data_b ? played_length(&(b->sample_headers[index_b - 1])) : 0;
+
+    bool loop_a = data_a && (a->sample_headers[index_a - 1].repeat_length > 1);
+    bool loop_b = data_b && (b->sample_headers[index_b - 1].repeat_length > 1);
+
+    if (loop_a != loop_b)
+    {
+        return false;
+    }
+
+    if (loop_a)
+    {
+        return (length_a == length_b) &&
+            (a->sample_headers[index_a - 1].repeat_offset == b->sample_headers[index_b - 1].repeat_offset) &&
+            !memcmp(data_a, data_b, length_a);
+    }
+
+    size_t common = length_a < length_b ? length_a : length_b;
+    if (common && memcmp(data_a, data_b, common))
+    {
+        return false;
+    }
+
+    return (length_a > common) ? is_zero(data_a + common, length_a - common) : is_zero(data_b + common, length_b - common);
+}
+
+// samples that play anything but silence (index 1-31, 0 = no sample)
+static void find_audible_samples(const protracker_t* module, bool* audible)
+{
+    audible[0] = false;
+    for (size_t i = 0; i < PT_NUM_SAMPLES; ++i)
+    {
+        const uint8_t* data = protracker_get_sample_data(module, i);
+        audible[i + 1] = data && !is_zero(data, played_length(&(module->sample_headers[i])));
+    }
+}
+
+static bool differs(replay_difference_t* difference, int channel, const char* what, int expected, int actual)
+{
+    if (expected == actual)
+    {
+        return false;
+    }
+
+    difference->channel = channel;
+    difference->what = what;
+    difference->expected = expected;
+    difference->actual = actual;
+    return true;
+}
+
+bool replay_compare(const protracker_t* a, const protracker_t* b, replay_difference_t* difference)
+{
+    replay_t replay_a, replay_b;
+    replay_init(&replay_a, a);
+    replay_init(&replay_b, b);
+
+    // 0 = not compared yet, 1 = equal, 2 = different
+    uint8_t equal[PT_NUM_SAMPLES + 1][PT_NUM_SAMPLES + 1];
+    memset(equal, 0, sizeof(equal));
+
+    // channel plays an audible sample
+    bool active_a[PT_NUM_CHANNELS] = { false };
+    bool active_b[PT_NUM_CHANNELS] = { false };
+
+    bool audible_a[PT_NUM_SAMPLES + 1], audible_b[PT_NUM_SAMPLES + 1];
+    find_audible_samples(a, audible_a);
+    find_audible_samples(b, audible_b);
+
+    memset(difference, 0, sizeof(replay_difference_t));
+
+    while (replay_a.ticks < REPLAY_MAX_TICKS)
+    {
+        bool playing_a = replay_tick(&replay_a);
+        bool playing_b = replay_tick(&replay_b);
+
+        difference->position = replay_a.position;
+        difference->row = replay_a.row;
+        difference->tick = replay_a.tick;
+
+        if (differs(difference, -1, "end", playing_a, playing_b))
+        {
+            return false;
+        }
+
+        if (!playing_a)
+        {
+            return true;
+        }
+
+        if (differs(difference, -1, "speed", replay_a.speed, replay_b.speed) ||
+            differs(difference, -1, "tempo", replay_a.tempo, replay_b.tempo))
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < PT_NUM_CHANNELS; ++i)
+        {
+            const replay_channel_t* channel_a = &(replay_a.channels[i]);
+            const replay_channel_t* channel_b = &(replay_b.channels[i]);
+
+            // notes on empty or silent samples are inaudible either way
+            bool trigger_a = channel_a->trigger && audible_a[channel_a->sample];
+            bool trigger_b = channel_b->trigger && audible_b[channel_b->sample];
+
+            if (differs(difference, (int)i, "trigger", trigger_a, trigger_b))
+            {
+                return false;
+            }
+
+            if (trigger_a)
+            {
+                uint8_t* cached = &(equal[channel_a->sample][channel_b->sample]);
+                if (!*cached)
+                {
+                    *cached = samples_equal(a, channel_a->sample, b, channel_b->sample) ? 1 : 2;
+                }
+
+                if (*cached != 1)
+                {
+                    difference->channel = (int)i;
+                    difference->what = "sample";
+                    difference->expected = channel_a->sample;
+                    difference->actual = channel_b->sample;
+                    return false;
+                }
+
+                if (differs(difference, (int)i, "offset", (int)channel_a->start, (int)channel_b->start))
+                {
+                    return false;
+                }
+            }
+
+            active_a[i] = channel_a->trigger ? trigger_a : active_a[i];
+            active_b[i] = channel_b->trigger ? trigger_b : active_b[i];
+
+            int volume_a = active_a[i] ? channel_a->output_volume : 0;
+            int volume_b = active_b[i] ? channel_b->output_volume : 0;
+
+            if (differs(difference, (int)i, "volume", volume_a, volume_b) ||
+                (volume_a && differs(difference, (int)i, "period", channel_a->output_period, channel_b->output_period)))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
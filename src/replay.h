@@ -0,0 +1,186 @@
+#pragma once
+
+#include "protracker.h"
+
+#define REPLAY_PAL_CLOCK (3546895)      // Paula clock (PAL), sample rate = clock / period
+#define REPLAY_DEFAULT_SPEED (6)
+#define REPLAY_DEFAULT_TEMPO (125)
+#define REPLAY_MIN_PERIOD (113)
+#define REPLAY_MAX_PERIOD (856)
+
+// ticks played before a song is considered to never end (an hour at 50Hz)
+#define REPLAY_MAX_TICKS (50 * 60 * 60)
+
+/**
+ *
+ * Replay state of one channel
+ *
+ * The output_* fields and the trigger flag describe what Paula plays during the current tick,
+ * the remaining fields are the player's internal state.
+ *
+**/
+typedef struct
+{
+    uint8_t sample;             // current sample (1-31, 0 = none)
+    uint8_t finetune;           // 0-15 (signed 4-bit)
+    uint8_t volume;             // 0-64
+    uint16_t period;            // base period (after slides)
+
+    uint16_t output_period;     // period this tick (arpeggio, vibrato and glissando applied)
+    uint8_t output_volume;      // volume this tick (tremolo applied)
+    bool trigger;               // sample was (re)started this tick
+    uint32_t start;             // start offset in bytes of the triggered sample (9xx)
+
+    // current row
+
+    uint8_t cmd;
+    uint8_t param;
+    uint16_t delayed_period;    // note waiting for EDx
+
+    // effect memory
+
+    uint16_t porta_target;
+    uint8_t porta_speed;
+    bool glissando;
+    uint8_t vibrato_param;
+    uint8_t vibrato_pos;
+    uint8_t vibrato_wave;
+    uint8_t tremolo_param;
+    uint8_t tremolo_pos;
+    uint8_t tremolo_wave;
+    uint8_t offset_param;
+    uint8_t loop_row;
+    uint8_t loop_count;
+} replay_channel_t;
+
+/**
+ *
+ * Headless ProTracker replay state
+ *
+ * Song end is detected when a row is entered a second time through the song order, Bxx or Dxx
+ * (rows repeated by E6x loops or EEx delays do not count), or when F00 stops the song.
+ *
+**/
+typedef struct
+{
+    const protracker_t* module;
+
+    uint8_t speed;              // ticks per row
+    uint8_t tempo;              // beats per minute (CIA timing, a tick lasts 2.5 / tempo seconds)
+    uint8_t position;
+    uint8_t pattern;
+    uint8_t row;
+    uint8_t tick;               // tick within the row
+    uint8_t delay;              // remaining EEx repeats of the current row
+    bool repeat;                // current row is repeated by EEx
+    bool entered;               // last tick entered a new row
+
+    uint64_t ticks;             // ticks played
+    uint64_t rows;              // rows entered (EEx repeats not included)
+    double seconds;             // time played
+
+    bool ended;
+    bool stopped;               // ended by F00 rather than by looping
+
+    replay_channel_t channels[PT_NUM_CHANNELS];
+
+    // pending flow change of the current row
+
+    int next_position;          // Bxx/Dxx target (-1 = none)
+    int next_row;
+    int loop_row;               // E6x target (-1 = none)
+
+    uint64_t visited[PT_NUM_POSITIONS];     // bit n set if row n of a position was entered
+} replay_t;
+
+/**
+ *
+ * Callbacks for replay_run (NULL callbacks are skipped)
+ *
+ * row - Called when a row was entered (after its first tick was processed)
+ * tick - Called after every tick (including the first tick of a row)
+ *
+**/
+typedef struct
+{
+    void (*row)(const replay_t* replay, void* data);
+    void (*tick)(const replay_t* replay, void* data);
+    void* data;
+} replay_visitor_t;
+
+/**
+ *
+ * Reset replay state to the start of the song
+ *
+**/
+void replay_init(replay_t* replay, const protracker_t* module);
+
+/**
+ *
+ * Process one tick
+ *
+ * Returns false once the song has ended (no tick was played)
+ *
+**/
+bool replay_tick(replay_t* replay);
+
+/**
+ *
+ * Duration of the current tick in seconds
+ *
+**/
+double replay_tick_seconds(const replay_t* replay);
+
+/**
+ *
+ * Play the whole song, calling the visitor for every row and tick
+ *
+ * module - ProTracker module
+ * visitor - Callbacks (may be NULL)
+ * result - Final replay state (may be NULL)
+ *
+ * Returns false if the song did not end within REPLAY_MAX_TICKS
+ *
+**/
+bool replay_run(const protracker_t* module, const replay_visitor_t* visitor, replay_t* result);
+
+/**
+ *
+ * Get playing time of a module in seconds (until the song loops or stops)
+ *
+**/
+double replay_duration(const protracker_t* module);
+
+/**
+ *
+ * First difference found by replay_compare
+ *
+ * channel - Channel index, -1 for song-wide state (tempo, speed, song end)
+ * what - Compared property ("end", "speed", "tempo", "trigger", "sample", "offset", "volume", "period")
+ * expected, actual - Values in the first and second module
+ *
+**/
+typedef struct
+{
+    uint8_t position;
+    uint8_t row;
+    uint8_t tick;
+    int channel;
+    const char* what;
+    int expected;
+    int actual;
+} replay_difference_t;
+
+/**
+ *
+ * Replay two modules side by side and compare what is played, tick by tick
+ *
+ * Sample indexes may differ between the modules, triggered samples are compared by the data that
+ * is played (trailing silence of samples without a loop is ignored). Periods are only compared while
+ * a channel is audible.
+ *
+ * Returns true if both modules play the same, otherwise difference holds the first divergence
+ * (position and row of the first module)
+ *
+**/
+bool replay_compare(const protracker_t* a, const protracker_t* b, replay_difference_t* difference);
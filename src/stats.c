@@ -0,0 +1,383 @@
+#include "stats.h"
+#include "buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 33)))
+#include <malloc.h>
+#define STATS_HAVE_MALLINFO2
+#endif
+
+typedef struct
+{
+    const char* name;
+    buffer_t values;        // double (phases: seconds) or int64_t (sizes: bytes), one per file
+} stats_series_t;
+
+static bool enabled = false;
+static bool json = false;
+
+static stats_record_t record;
+static bool record_active = false;
+
+static stats_series_t phase_series[STATS_MAX_PHASES];
+static size_t num_phase_series = 0;
+static stats_series_t size_series[STATS_MAX_SIZES];
+static size_t num_size_series = 0;
+static size_t num_files = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int64_t heap_usage(void)
+{
+#if defined(STATS_HAVE_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    return (int64_t)info.uordblks;
+#else
+    return 0;
+#endif
+}
+
+static void print_json_string(const char* text)
+{
+    fputc('"', stderr);
+    for (const char* c = text; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(stderr, "\\%c", *c);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            fprintf(stderr, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+static stats_series_t* get_series(stats_series_t* series, size_t* count, size_t max, const char* name, size_t elemsize)
+{
+    for (size_t i = 0; i < *count; ++i)
+    {
+        if (!strcmp(series[i].name, name))
+        {
+            return &(series[i]);
+        }
+    }
+
+    if (*count == max)
+    {
+        return NULL;
+    }
+
+    stats_series_t* out = &(series[(*count)++]);
+    out->name = name;
+    buffer_init(&(out->values), elemsize);
+    return out;
+}
+
+void stats_enable(bool as_json)
+{
+    enabled = true;
+    json = as_json;
+}
+
+bool stats_enabled(void)
+{
+    return enabled;
+}
+
+void stats_begin_file(const char* filename)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    stats_end_file();
+
+    memset(&record, 0, sizeof(record));
+    snprintf(record.file, sizeof(record.file), "%s", filename);
+    record_active = true;
+}
+
+static void print_record(const stats_record_t* in)
+{
+    if (json)
+    {
+        fprintf(stderr, "{\"file\":");
+        print_json_string(in->file);
+
+        fprintf(stderr, ",\"phases\":{");
+        for (size_t i = 0; i < in->num_phases; ++i)
+        {
+            const stats_phase_t* phase = &(in->phases[i]);
+            fprintf(stderr, "%s\"%s\":{\"ms\":%.3f,\"allocations\":%lu,\"allocated\":%lu,\"heap\":%ld}",
+                i ? "," : "", phase->name, phase->seconds * 1000.0, phase->allocations, phase->allocated, (long)phase->heap);
+        }
+
+        fprintf(stderr, "},\"sizes\":{");
+        for (size_t i = 0; i < in->num_sizes; ++i)
+        {
+            fprintf(stderr, "%s\"%s\":%ld", i ? "," : "", in->sizes[i].name, (long)in->sizes[i].bytes);
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "Statistics for '%s':\n", in->file);
+    for (size_t i = 0; i < in->num_phases; ++i)
+    {
+        const stats_phase_t* phase = &(in->phases[i]);
+        fprintf(stderr, " %-28s %10.3f ms %6lu allocs %10lu bytes (heap %+ld)\n",
+            phase->name, phase->seconds * 1000.0, phase->allocations, phase->allocated, (long)phase->heap);
+    }
+    for (size_t i = 0; i < in->num_sizes; ++i)
+    {
+        fprintf(stderr, " %-28s %10ld bytes\n", in->sizes[i].name, (long)in->sizes[i].bytes);
+    }
+}
+
+void stats_end_file(void)
+{
+    if (!enabled || !record_active)
+    {
+        return;
+    }
+
+    print_record(&record);
+
+    for (size_t i = 0; i < record.num_phases; ++i)
+    {
+        stats_series_t* series = get_series(phase_series, &num_phase_series, STATS_MAX_PHASES, record.phases[i].name, sizeof(double));
+        if (series)
+        {
+            double* value = buffer_alloc(&(series->values), 1);
+            *value = record.phases[i].seconds;
+        }
+    }
+
+    for (size_t i = 0; i < record.num_sizes; ++i)
+    {
+        stats_series_t* series = get_series(size_series, &num_size_series, STATS_MAX_SIZES, record.sizes[i].name, sizeof(int64_t));
+        if (series)
+        {
+            int64_t* value = buffer_alloc(&(series->values), 1);
+            *value = record.sizes[i].bytes;
+        }
+    }
+
+    ++num_files;
+    record_active = false;
+}
+
+void stats_start(stats_timer_t* timer)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    timer->allocations = buffer_allocations;
+    timer->allocated = buffer_allocated;
+    timer->heap = heap_usage();
+    timer->start = now();
+}
+
+void stats_stop(const stats_timer_t* timer, const char* name)
+{
+    if (!enabled || !record_active)
+    {
+        return;
+    }
+
+    double seconds = now() - timer->start;
+
+    stats_phase_t* phase = NULL;
+    for (size_t i = 0; i < record.num_phases; ++i)
+    {
+        if (!strcmp(record.phases[i].name, name))
+        {
+            phase = &(record.phases[i]);
+            break;
+        }
+    }
+
+    if (!phase)
+    {
+        if (record.num_phases == STATS_MAX_PHASES)
+        {
+            return;
+        }
+
+        phase = &(record.phases[record.num_phases++]);
+        memset(phase, 0, sizeof(stats_phase_t));
+        phase->name = name;
+    }
+
+    phase->seconds += seconds;
+    phase->allocations += buffer_allocations - timer->allocations;
+    phase->allocated += buffer_allocated - timer->allocated;
+    phase->heap += heap_usage() - timer->heap;
+}
+
+void stats_size(const char* name, int64_t bytes)
+{
+    if (!enabled || !record_active)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < record.num_sizes; ++i)
+    {
+        if (!strcmp(record.sizes[i].name, name))
+        {
+            record.sizes[i].bytes += bytes;
+            return;
+        }
+    }
+
+    if (record.num_sizes < STATS_MAX_SIZES)
+    {
+        record.sizes[record.num_sizes].name = name;
+        record.sizes[record.num_sizes].bytes = bytes;
+        ++record.num_sizes;
+    }
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of a sorted series
+static size_t percentile_index(size_t count, size_t percent)
+{
+    size_t rank = (count * percent + 99) / 100;
+    return rank > 0 ? rank - 1 : 0;
+}
+
+void stats_report(void)
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    stats_end_file();
+
+    if (num_files > 1)
+    {
+        if (json)
+        {
+            fprintf(stderr, "{\"summary\":{\"files\":%lu,\"phases\":{", num_files);
+        }
+        else
+        {
+            fprintf(stderr, "Summary (%lu files):\n %-28s %10s %10s %10s %10s %12s\n", num_files, "phase (ms)", "p50", "p90", "p99", "max", "total");
+        }
+
+        for (size_t i = 0; i < num_phase_series; ++i)
+        {
+            stats_series_t* series = &(phase_series[i]);
+            size_t count = buffer_count(&(series->values));
+            double* values = (double*)series->values.data;
+
+            qsort(values, count, sizeof(double), compare_double);
+
+            double total = 0;
+            for (size_t j = 0; j < count; ++j)
+            {
+                total += values[j];
+            }
+
+            double p50 = values[percentile_index(count, 50)] * 1000.0;
+            double p90 = values[percentile_index(count, 90)] * 1000.0;
+            double p99 = values[percentile_index(count, 99)] * 1000.0;
+            double max = values[count-1] * 1000.0;
+
+            if (json)
+            {
+                fprintf(stderr, "%s\"%s\":{\"count\":%lu,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"total_ms\":%.3f}",
+                    i ? "," : "", series->name, count, p50, p90, p99, max, total * 1000.0);
+            }
+            else
+            {
+                fprintf(stderr, " %-28s %10.3f %10.3f %10.3f %10.3f %12.3f\n", series->name, p50, p90, p99, max, total * 1000.0);
+            }
+        }
+
+        if (json)
+        {
+            fprintf(stderr, "},\"sizes\":{");
+        }
+        else
+        {
+            fprintf(stderr, " %-28s %10s %10s %10s %10s %12s\n", "size (bytes)", "p50", "p90", "p99", "max", "total");
+        }
+
+        for (size_t i = 0; i < num_size_series; ++i)
+        {
+            stats_series_t* series = &(size_series[i]);
+            size_t count = buffer_count(&(series->values));
+            int64_t* values = (int64_t*)series->values.data;
+
+            qsort(values, count, sizeof(int64_t), compare_int64);
+
+            int64_t total = 0;
+            for (size_t j = 0; j < count; ++j)
+            {
+                total += values[j];
+            }
+
+            long p50 = (long)values[percentile_index(count, 50)];
+            long p90 = (long)values[percentile_index(count, 90)];
+            long p99 = (long)values[percentile_index(count, 99)];
+            long max = (long)values[count-1];
+
+            if (json)
+            {
+                fprintf(stderr, "%s\"%s\":{\"count\":%lu,\"p50\":%ld,\"p90\":%ld,\"p99\":%ld,\"max\":%ld,\"total\":%ld}",
+                    i ? "," : "", series->name, count, p50, p90, p99, max, (long)total);
+            }
+            else
+            {
+                fprintf(stderr, " %-28s %10ld %10ld %10ld %10ld %12ld\n", series->name, p50, p90, p99, max, (long)total);
+            }
+        }
+
+        if (json)
+        {
+            fprintf(stderr, "}}}\n");
+        }
+    }
+
+    for (size_t i = 0; i < num_phase_series; ++i)
+    {
+        buffer_release(&(phase_series[i].values));
+    }
+    for (size_t i = 0; i < num_size_series; ++i)
+    {
+        buffer_release(&(size_series[i].values));
+    }
+    num_phase_series = num_size_series = num_files = 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_MAX_PHASES (32)
+#define STATS_MAX_SIZES (32)
+
+typedef struct
+{
+    double start;
+    size_t allocations;
+    size_t allocated;
+    int64_t heap;
+} stats_timer_t;
+
+typedef struct
+{
+    const char* name;       // static string
+    double seconds;
+    size_t allocations;     // buffer allocations
+    size_t allocated;       // bytes allocated by buffers
+    int64_t heap;           // change of heap usage (bytes, 0 if not available)
+} stats_phase_t;
+
+typedef struct
+{
+    const char* name;       // static string
+    int64_t bytes;
+} stats_size_t;
+
+typedef struct
+{
+    char file[256];
+
+    stats_phase_t phases[STATS_MAX_PHASES];
+    size_t num_phases;
+
+    stats_size_t sizes[STATS_MAX_SIZES];
+    size_t num_sizes;
+} stats_record_t;
+
+/**
+ *
+ * Enable statistics collection
+ *
+ * json - Print records and the summary as JSON lines instead of text
+ *
+**/
+void stats_enable(bool json);
+bool stats_enabled(void);
+
+/**
+ *
+ * Start a new per-file record, finishing the previous one
+ *
+**/
+void stats_begin_file(const char* filename);
+
+/**
+ *
+ * Finish (and print) the current per-file record
+ *
+**/
+void stats_end_file(void);
+
+/**
+ *
+ * Measure a phase: wall time and allocations between stats_start() and stats_stop()
+ *
+ * Repeated phases with the same name are added up.
+ *
+**/
+void stats_start(stats_timer_t* timer);
+void stats_stop(const stats_timer_t* timer, const char* phase);
+
+/**
+ *
+ * Add a number of bytes to a named size entry of the current record
+ *
+**/
+void stats_size(const char* name, int64_t bytes);
+
+/**
+ *
+ * Finish the current record and print percentiles over all records (when more than one file was processed)
+ *
+**/
+void stats_report(void);